@@ -2,16 +2,31 @@
 /*
  * DMA32 Heap - Allocates memory below 4GB for 32-bit DMA devices
  * Based on system_heap.c but with __GFP_DMA32 flag
+ *
+ * A second heap, dma32-contig, hands out single physically contiguous
+ * ranges below 4GB for devices without IOMMU translation. A third one,
+ * dma32-uncached, maps its buffers write-combined and skips all CPU cache
+ * maintenance, for buffers the CPU only streams into.
  */
 
 #include <linux/dma-buf.h>
 #include <linux/dma-heap.h>
 #include <linux/dma-mapping.h>
 #include <linux/module.h>
+#include <linux/platform_device.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/iosys-map.h>
+#include <linux/gfp.h>
+#include <linux/freezer.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/memory_hotplug.h>
+#include <linux/mmzone.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/wait.h>
 
 #define LOW_ORDER_GFP (GFP_KERNEL | __GFP_ZERO | __GFP_DMA32)
 #define HIGH_ORDER_GFP (GFP_KERNEL | __GFP_ZERO | __GFP_DMA32 | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY)
@@ -19,6 +34,44 @@
 static unsigned int orders[] = {8, 4, 0};
 #define NUM_ORDERS ARRAY_SIZE(orders)
 
+#define DMA32_LIMIT_PFN PHYS_PFN(0x100000000ULL)
+
+static unsigned int pool_max_mb = 64;
+module_param(pool_max_mb, uint, 0644);
+MODULE_PARM_DESC(pool_max_mb, "Max memory kept in the page pools in MB, 0 disables pooling (default: 64)");
+
+static unsigned int pool_fill_mb = 16;
+module_param(pool_fill_mb, uint, 0644);
+MODULE_PARM_DESC(pool_fill_mb, "Pre-zeroed memory the pool thread keeps ready in MB (default: 16)");
+
+/* Back off from refilling this long after a failed refill or a shrink */
+#define POOL_REFILL_BACKOFF (5 * HZ)
+
+/*
+ * Per-order page pools. Freed pages land on the dirty list and are zeroed
+ * by a low-priority kthread, which also tops the clean lists up to
+ * pool_fill_mb, so allocations rarely touch the buddy allocator or zero
+ * anything themselves. A shrinker gives the pages back under pressure.
+ */
+struct dma32_page_pool {
+    unsigned int order;
+    spinlock_t lock;
+    struct list_head clean;
+    struct list_head dirty;
+    unsigned long clean_count;
+    unsigned long dirty_count;
+};
+
+static struct dma32_page_pool pools[NUM_ORDERS];
+static atomic_long_t pool_pages;    /* PAGE_SIZE units over all pools */
+static unsigned long pool_refill_after;
+static struct task_struct *pool_thread;
+static DECLARE_WAIT_QUEUE_HEAD(pool_wait);
+static struct shrinker *pool_shrinker;
+
+/* Device the dma32-uncached heap does its allocation-time cache flush on */
+static struct platform_device *dma32_heap_pdev;
+
 struct dma32_heap_buffer {
     struct dma_heap *heap;
     struct list_head attachments;
@@ -27,6 +80,9 @@ struct dma32_heap_buffer {
     struct sg_table sg_table;
     int vmap_cnt;
     void *vaddr;
+    bool contig;        /* one range, see dma32_contig_alloc() */
+    bool contig_range;  /* from alloc_contig_range(), not the buddy allocator */
+    bool uncached;      /* write-combined CPU mappings, no cache maintenance */
 };
 
 struct dma32_heap_attachment {
@@ -36,6 +92,265 @@ struct dma32_heap_attachment {
     bool mapped;
 };
 
+static struct dma32_page_pool *dma32_pool_find(unsigned int order)
+{
+    int i;
+
+    for (i = 0; i < NUM_ORDERS; i++)
+        if (pools[i].order == order)
+            return &pools[i];
+    return NULL;
+}
+
+static unsigned long dma32_pool_fill_target(struct dma32_page_pool *pool)
+{
+    unsigned long bytes = ((unsigned long)pool_fill_mb << 20) / NUM_ORDERS;
+
+    if (!pool_max_mb)
+        return 0;
+    return bytes >> (PAGE_SHIFT + pool->order);
+}
+
+static bool dma32_pool_refill_wanted(void)
+{
+    int i;
+
+    if (time_before(jiffies, READ_ONCE(pool_refill_after)))
+        return false;
+
+    for (i = 0; i < NUM_ORDERS; i++)
+        if (READ_ONCE(pools[i].clean_count) < dma32_pool_fill_target(&pools[i]))
+            return true;
+    return false;
+}
+
+static bool dma32_pool_has_work(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_ORDERS; i++)
+        if (READ_ONCE(pools[i].dirty_count))
+            return true;
+    return dma32_pool_refill_wanted();
+}
+
+/* Zeroed page of @order from the pool, or NULL */
+static struct page *dma32_pool_get(unsigned int order)
+{
+    struct dma32_page_pool *pool = dma32_pool_find(order);
+    struct page *page = NULL;
+
+    if (!pool)
+        return NULL;
+
+    spin_lock(&pool->lock);
+    if (pool->clean_count) {
+        page = list_first_entry(&pool->clean, struct page, lru);
+        list_del(&page->lru);
+        pool->clean_count--;
+    }
+    spin_unlock(&pool->lock);
+
+    if (page)
+        atomic_long_sub(1 << order, &pool_pages);
+    return page;
+}
+
+/* Hand a freed page to the pool for zeroing, or back to the buddy allocator */
+static void dma32_pool_put(struct page *page)
+{
+    unsigned int order = compound_order(page);
+    struct dma32_page_pool *pool = dma32_pool_find(order);
+    unsigned long max_pages = (unsigned long)pool_max_mb << (20 - PAGE_SHIFT);
+
+    if (!pool || !pool_thread ||
+        atomic_long_add_return(1 << order, &pool_pages) > max_pages) {
+        if (pool && pool_thread)
+            atomic_long_sub(1 << order, &pool_pages);
+        __free_pages(page, order);
+        return;
+    }
+
+    spin_lock(&pool->lock);
+    list_add_tail(&page->lru, &pool->dirty);
+    pool->dirty_count++;
+    spin_unlock(&pool->lock);
+
+    wake_up(&pool_wait);
+}
+
+static void dma32_pool_zero_dirty(struct dma32_page_pool *pool)
+{
+    struct page *page;
+    unsigned int i;
+
+    for (;;) {
+        spin_lock(&pool->lock);
+        if (!pool->dirty_count) {
+            spin_unlock(&pool->lock);
+            return;
+        }
+        page = list_first_entry(&pool->dirty, struct page, lru);
+        list_del(&page->lru);
+        pool->dirty_count--;
+        spin_unlock(&pool->lock);
+
+        for (i = 0; i < (1U << pool->order); i++)
+            clear_highpage(page + i);
+
+        spin_lock(&pool->lock);
+        list_add_tail(&page->lru, &pool->clean);
+        pool->clean_count++;
+        spin_unlock(&pool->lock);
+
+        cond_resched();
+    }
+}
+
+static void dma32_pool_refill(struct dma32_page_pool *pool)
+{
+    unsigned long max_pages = (unsigned long)pool_max_mb << (20 - PAGE_SHIFT);
+    gfp_t gfp = (pool->order > 0) ? HIGH_ORDER_GFP : LOW_ORDER_GFP;
+    struct page *page;
+
+    while (READ_ONCE(pool->clean_count) < dma32_pool_fill_target(pool) &&
+           !kthread_should_stop()) {
+        if (atomic_long_read(&pool_pages) + (1 << pool->order) > max_pages)
+            return;
+
+        page = alloc_pages(gfp | __GFP_NORETRY | __GFP_NOWARN, pool->order);
+        if (!page || page_to_pfn(page) >= DMA32_LIMIT_PFN) {
+            if (page)
+                __free_pages(page, pool->order);
+            WRITE_ONCE(pool_refill_after, jiffies + POOL_REFILL_BACKOFF);
+            return;
+        }
+
+        atomic_long_add(1 << pool->order, &pool_pages);
+        spin_lock(&pool->lock);
+        list_add_tail(&page->lru, &pool->clean);
+        pool->clean_count++;
+        spin_unlock(&pool->lock);
+
+        cond_resched();
+    }
+}
+
+static int dma32_pool_thread_fn(void *data)
+{
+    int i;
+
+    set_user_nice(current, MAX_NICE);
+    set_freezable();
+
+    while (!kthread_should_stop()) {
+        wait_event_freezable(pool_wait,
+                             dma32_pool_has_work() || kthread_should_stop());
+
+        for (i = 0; i < NUM_ORDERS; i++)
+            dma32_pool_zero_dirty(&pools[i]);
+
+        if (dma32_pool_refill_wanted())
+            for (i = 0; i < NUM_ORDERS; i++)
+                dma32_pool_refill(&pools[i]);
+    }
+    return 0;
+}
+
+/* Free up to @nr_pages PAGE_SIZE units, dirty pages and large orders first */
+static unsigned long dma32_pool_drain(unsigned long nr_pages)
+{
+    unsigned long freed = 0;
+    struct page *page;
+    int i;
+
+    for (i = 0; i < NUM_ORDERS && freed < nr_pages; i++) {
+        struct dma32_page_pool *pool = &pools[i];
+
+        while (freed < nr_pages) {
+            spin_lock(&pool->lock);
+            if (pool->dirty_count) {
+                page = list_first_entry(&pool->dirty, struct page, lru);
+                pool->dirty_count--;
+            } else if (pool->clean_count) {
+                page = list_first_entry(&pool->clean, struct page, lru);
+                pool->clean_count--;
+            } else {
+                spin_unlock(&pool->lock);
+                break;
+            }
+            list_del(&page->lru);
+            spin_unlock(&pool->lock);
+
+            atomic_long_sub(1 << pool->order, &pool_pages);
+            __free_pages(page, pool->order);
+            freed += 1 << pool->order;
+        }
+    }
+    return freed;
+}
+
+static unsigned long dma32_pool_shrink_count(struct shrinker *shrinker,
+                                             struct shrink_control *sc)
+{
+    unsigned long count = atomic_long_read(&pool_pages);
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long dma32_pool_shrink_scan(struct shrinker *shrinker,
+                                            struct shrink_control *sc)
+{
+    unsigned long freed;
+
+    /* Do not refill right into the memory pressure */
+    WRITE_ONCE(pool_refill_after, jiffies + POOL_REFILL_BACKOFF);
+
+    freed = dma32_pool_drain(sc->nr_to_scan);
+    return freed ? freed : SHRINK_STOP;
+}
+
+static int dma32_pool_init(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_ORDERS; i++) {
+        pools[i].order = orders[i];
+        spin_lock_init(&pools[i].lock);
+        INIT_LIST_HEAD(&pools[i].clean);
+        INIT_LIST_HEAD(&pools[i].dirty);
+    }
+
+    pool_shrinker = shrinker_alloc(0, "dma32-heap-pool");
+    if (!pool_shrinker)
+        return -ENOMEM;
+    pool_shrinker->count_objects = dma32_pool_shrink_count;
+    pool_shrinker->scan_objects = dma32_pool_shrink_scan;
+    shrinker_register(pool_shrinker);
+
+    pool_thread = kthread_run(dma32_pool_thread_fn, NULL, "dma32-heap-pool");
+    if (IS_ERR(pool_thread)) {
+        pool_thread = NULL;
+        shrinker_free(pool_shrinker);
+        pool_shrinker = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void dma32_pool_exit(void)
+{
+    if (pool_thread) {
+        kthread_stop(pool_thread);
+        pool_thread = NULL;
+    }
+    if (pool_shrinker) {
+        shrinker_free(pool_shrinker);
+        pool_shrinker = NULL;
+    }
+    dma32_pool_drain(ULONG_MAX);
+}
+
 static int dma32_heap_attach(struct dma_buf *dmabuf,
                              struct dma_buf_attachment *attachment)
 {
@@ -100,14 +415,17 @@ static void dma32_heap_detach(struct dma_buf *dmabuf,
 static struct sg_table *dma32_heap_map_dma_buf(struct dma_buf_attachment *attachment,
                                                enum dma_data_direction direction)
 {
+    struct dma32_heap_buffer *buffer = attachment->dmabuf->priv;
     struct dma32_heap_attachment *a = attachment->priv;
     struct sg_table *table = a->table;
+    unsigned long attrs = buffer->uncached ? DMA_ATTR_SKIP_CPU_SYNC : 0;
     int ret;
 
-    ret = dma_map_sgtable(attachment->dev, table, direction, 0);
+    ret = dma_map_sgtable(attachment->dev, table, direction, attrs);
     if (ret)
         return ERR_PTR(ret);
 
+    /* From here on CPU access syncs this attachment */
     a->mapped = true;
     return table;
 }
@@ -116,11 +434,219 @@ static void dma32_heap_unmap_dma_buf(struct dma_buf_attachment *attachment,
                                      struct sg_table *table,
                                      enum dma_data_direction direction)
 {
+    struct dma32_heap_buffer *buffer = attachment->dmabuf->priv;
     struct dma32_heap_attachment *a = attachment->priv;
+    unsigned long attrs = buffer->uncached ? DMA_ATTR_SKIP_CPU_SYNC : 0;
 
     a->mapped = false;
-    dma_unmap_sgtable(attachment->dev, table, direction, 0);
+    dma_unmap_sgtable(attachment->dev, table, direction, attrs);
+}
+
+static bool dma32_contig_range_valid(struct zone *zone, unsigned long pfn,
+                                     unsigned long nr_pages)
+{
+    unsigned long i;
+
+    for (i = pfn; i < pfn + nr_pages; i++) {
+        struct page *page = pfn_to_online_page(i);
+
+        if (!page || page_zone(page) != zone || PageReserved(page))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Same idea as alloc_contig_pages(), which is not exported: walk the
+ * zones below 4GB and migrate a naturally aligned range out of the way.
+ */
+static struct page *dma32_contig_alloc_range(unsigned long nr_pages)
+{
+#ifdef CONFIG_CONTIG_ALLOC
+    unsigned long align = roundup_pow_of_two(nr_pages);
+    int nid, z;
+
+    for_each_online_node(nid) {
+        pg_data_t *pgdat = NODE_DATA(nid);
+
+        for (z = 0; z < MAX_NR_ZONES; z++) {
+            struct zone *zone = &pgdat->node_zones[z];
+            unsigned long end = min(zone_end_pfn(zone), DMA32_LIMIT_PFN);
+            unsigned long pfn;
+
+            if (!populated_zone(zone) || zone->zone_start_pfn >= DMA32_LIMIT_PFN)
+                continue;
+
+            for (pfn = ALIGN(zone->zone_start_pfn, align);
+                 pfn + nr_pages <= end; pfn += align) {
+                if (fatal_signal_pending(current))
+                    return NULL;
+                if (!dma32_contig_range_valid(zone, pfn, nr_pages))
+                    continue;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+                if (!alloc_contig_range(pfn, pfn + nr_pages, ACR_FLAGS_NONE,
+                                        GFP_KERNEL | __GFP_NOWARN))
+#else
+                if (!alloc_contig_range(pfn, pfn + nr_pages, MIGRATE_MOVABLE,
+                                        GFP_KERNEL | __GFP_NOWARN))
+#endif
+                    return pfn_to_page(pfn);
+                cond_resched();
+            }
+        }
+    }
+#endif
+    return NULL;
+}
+
+static void dma32_contig_free(struct dma32_heap_buffer *buffer,
+                              struct page *page)
+{
+    unsigned long size = PAGE_ALIGN(buffer->len);
+
+    if (buffer->contig_range)
+        free_contig_range(page_to_pfn(page), size >> PAGE_SHIFT);
+    else
+        free_pages_exact(page_address(page), size);
+}
+
+/*
+ * Buddy pages up to MAX_PAGE_ORDER, anything larger is carved out of
+ * the zones below 4GB by migration.
+ */
+static struct page *dma32_contig_alloc(struct dma32_heap_buffer *buffer,
+                                       unsigned long size)
+{
+    unsigned long nr_pages = size >> PAGE_SHIFT;
+    struct page *page = NULL;
+    void *vaddr;
+
+    if (get_order(size) <= MAX_PAGE_ORDER) {
+        vaddr = alloc_pages_exact(size, GFP_KERNEL | __GFP_DMA32 |
+                                  __GFP_NOWARN | __GFP_NORETRY);
+        if (vaddr)
+            page = virt_to_page(vaddr);
+    }
+
+    if (!page) {
+        page = dma32_contig_alloc_range(nr_pages);
+        if (!page)
+            return NULL;
+        buffer->contig_range = true;
+    }
+
+    if (page_to_phys(page) + size > 0x100000000ULL) {
+        pr_warn("DMA32 Heap: contiguous allocation at 0x%llx rejected (>4GB)\n",
+                (unsigned long long)page_to_phys(page));
+        dma32_contig_free(buffer, page);
+        return NULL;
+    }
+
+    memset(page_address(page), 0, size);
+    return page;
+}
+
+/*
+ * Sync [offset, offset + len) of the buffer for every attachment that is
+ * currently mapped. Partial ranges walk the CPU entries and sync each one
+ * they overlap whole: behind an IOMMU the DMA segments are merged, and a
+ * single-range sync on one would run past the pages it starts on.
+ * Called with buffer->lock held.
+ */
+static void dma32_heap_sync_range(struct dma32_heap_buffer *buffer,
+                                  unsigned long offset, unsigned long len,
+                                  enum dma_data_direction direction,
+                                  bool for_cpu)
+{
+    struct dma32_heap_attachment *a;
+    unsigned long end = offset + len;
+    bool full = !offset && len >= buffer->len;
+
+    list_for_each_entry(a, &buffer->attachments, list) {
+        struct scatterlist *sg;
+        unsigned long pos = 0;
+        int i;
+
+        if (!a->mapped)
+            continue;
+
+        if (full) {
+            if (for_cpu)
+                dma_sync_sgtable_for_cpu(a->dev, a->table, direction);
+            else
+                dma_sync_sgtable_for_device(a->dev, a->table, direction);
+            continue;
+        }
+
+        for_each_sgtable_sg(a->table, sg, i) {
+            if (pos >= end)
+                break;
+            if (pos + sg->length > offset) {
+                if (for_cpu)
+                    dma_sync_sg_for_cpu(a->dev, sg, 1, direction);
+                else
+                    dma_sync_sg_for_device(a->dev, sg, 1, direction);
+            }
+            pos += sg->length;
+        }
+    }
+}
+
+static int dma32_heap_cpu_access(struct dma_buf *dmabuf,
+                                 enum dma_data_direction direction,
+                                 unsigned long offset, unsigned long len,
+                                 bool begin)
+{
+    struct dma32_heap_buffer *buffer = dmabuf->priv;
+
+    if (offset >= buffer->len)
+        return -EINVAL;
+    if (buffer->uncached)
+        return 0;
+    len = min(len, buffer->len - offset);
+
+    mutex_lock(&buffer->lock);
+    if (begin && buffer->vmap_cnt)
+        invalidate_kernel_vmap_range(buffer->vaddr + offset, len);
+
+    dma32_heap_sync_range(buffer, offset, len, direction, begin);
+
+    if (!begin && buffer->vmap_cnt)
+        flush_kernel_vmap_range(buffer->vaddr + offset, len);
+    mutex_unlock(&buffer->lock);
+
+    return 0;
+}
+
+static int dma32_heap_begin_cpu_access(struct dma_buf *dmabuf,
+                                       enum dma_data_direction direction)
+{
+    return dma32_heap_cpu_access(dmabuf, direction, 0, dmabuf->size, true);
+}
+
+static int dma32_heap_end_cpu_access(struct dma_buf *dmabuf,
+                                     enum dma_data_direction direction)
+{
+    return dma32_heap_cpu_access(dmabuf, direction, 0, dmabuf->size, false);
+}
+
+#ifdef CONFIG_DMABUF_PARTIAL
+static int dma32_heap_begin_cpu_access_partial(struct dma_buf *dmabuf,
+                                               enum dma_data_direction direction,
+                                               unsigned int offset,
+                                               unsigned int len)
+{
+    return dma32_heap_cpu_access(dmabuf, direction, offset, len, true);
+}
+
+static int dma32_heap_end_cpu_access_partial(struct dma_buf *dmabuf,
+                                             enum dma_data_direction direction,
+                                             unsigned int offset,
+                                             unsigned int len)
+{
+    return dma32_heap_cpu_access(dmabuf, direction, offset, len, false);
 }
+#endif
 
 static void dma32_heap_dma_buf_release(struct dma_buf *dmabuf)
 {
@@ -129,10 +655,15 @@ static void dma32_heap_dma_buf_release(struct dma_buf *dmabuf)
     struct scatterlist *sg;
     int i;
 
-    for_each_sgtable_sg(table, sg, i) {
-        struct page *page = sg_page(sg);
-        __free_pages(page, compound_order(page));
+    if (buffer->contig) {
+        dma32_contig_free(buffer, sg_page(table->sgl));
+        sg_free_table(table);
+        kfree(buffer);
+        return;
     }
+
+    for_each_sgtable_sg(table, sg, i)
+        dma32_pool_put(sg_page(sg));
     sg_free_table(table);
     kfree(buffer);
 }
@@ -142,24 +673,44 @@ static int dma32_heap_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
     struct dma32_heap_buffer *buffer = dmabuf->priv;
     struct sg_table *table = &buffer->sg_table;
     unsigned long addr = vma->vm_start;
+    unsigned long run_pfn = 0, run_len = 0;
     struct scatterlist *sg;
     int i, ret;
 
+    if (buffer->uncached)
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+    /*
+     * The whole VMA is populated here, so CPU access never faults.
+     * Physically adjacent entries are mapped as one run.
+     */
     for_each_sgtable_sg(table, sg, i) {
-        struct page *page = sg_page(sg);
+        unsigned long pfn = page_to_pfn(sg_page(sg));
         unsigned long remainder = vma->vm_end - addr;
         unsigned long len = sg->length;
 
-        if (len > remainder)
-            len = remainder;
+        if (run_len && pfn == run_pfn + (run_len >> PAGE_SHIFT)) {
+            run_len += len;
+            continue;
+        }
 
-        ret = remap_pfn_range(vma, addr, page_to_pfn(page), len, vma->vm_page_prot);
-        if (ret)
-            return ret;
-        addr += len;
-        if (addr >= vma->vm_end)
-            break;
+        if (run_len) {
+            ret = remap_pfn_range(vma, addr, run_pfn, min(run_len, remainder),
+                                  vma->vm_page_prot);
+            if (ret)
+                return ret;
+            addr += min(run_len, remainder);
+            if (addr >= vma->vm_end)
+                return 0;
+        }
+        run_pfn = pfn;
+        run_len = len;
     }
+
+    if (run_len && addr < vma->vm_end)
+        return remap_pfn_range(vma, addr, run_pfn,
+                               min(run_len, vma->vm_end - addr),
+                               vma->vm_page_prot);
     return 0;
 }
 
@@ -183,6 +734,9 @@ static int dma32_heap_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
         return 0;
     }
 
+    if (buffer->uncached)
+        pgprot = pgprot_writecombine(PAGE_KERNEL);
+
     pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
     if (!pages) {
         mutex_unlock(&buffer->lock);
@@ -238,6 +792,12 @@ static const struct dma_buf_ops dma32_heap_buf_ops = {
     .detach = dma32_heap_detach,
     .map_dma_buf = dma32_heap_map_dma_buf,
     .unmap_dma_buf = dma32_heap_unmap_dma_buf,
+    .begin_cpu_access = dma32_heap_begin_cpu_access,
+    .end_cpu_access = dma32_heap_end_cpu_access,
+#ifdef CONFIG_DMABUF_PARTIAL
+    .begin_cpu_access_partial = dma32_heap_begin_cpu_access_partial,
+    .end_cpu_access_partial = dma32_heap_end_cpu_access_partial,
+#endif
     .release = dma32_heap_dma_buf_release,
     .mmap = dma32_heap_mmap,
     .vmap = dma32_heap_vmap,
@@ -256,11 +816,19 @@ static struct page *alloc_largest_available_dma32(unsigned long size, unsigned i
         if (max_order < orders[i])
             continue;
 
+        page = dma32_pool_get(orders[i]);
+        if (page)
+            return page;
+
+        /* Pool ran dry, let the thread catch up for the next caller */
+        if (pool_thread)
+            wake_up(&pool_wait);
+
         gfp = (orders[i] > 0) ? HIGH_ORDER_GFP : LOW_ORDER_GFP;
         page = alloc_pages(gfp, orders[i]);
         if (!page)
             continue;
-        
+
         /* Verify allocation is below 4GB */
         if (page_to_phys(page) >= 0x100000000ULL) {
             pr_warn("DMA32 Heap: allocation at 0x%llx rejected (>4GB)\n",
@@ -273,10 +841,10 @@ static struct page *alloc_largest_available_dma32(unsigned long size, unsigned i
     return NULL;
 }
 
-static struct dma_buf *dma32_heap_allocate(struct dma_heap *heap,
-                                           unsigned long len,
-                                           u32 fd_flags,
-                                           u64 heap_flags)
+static struct dma_buf *dma32_heap_do_allocate(struct dma_heap *heap,
+                                              unsigned long len,
+                                              u32 fd_flags,
+                                              bool uncached)
 {
     struct dma32_heap_buffer *buffer;
     DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
@@ -297,6 +865,7 @@ static struct dma_buf *dma32_heap_allocate(struct dma_heap *heap,
     mutex_init(&buffer->lock);
     buffer->heap = heap;
     buffer->len = len;
+    buffer->uncached = uncached;
 
     INIT_LIST_HEAD(&pages);
     i = 0;
@@ -327,6 +896,20 @@ static struct dma_buf *dma32_heap_allocate(struct dma_heap *heap,
         list_del(&page->lru);
     }
 
+    /*
+     * The pages were zeroed through the cacheable linear map. Push that
+     * out once, so no dirty line can later overwrite data written
+     * through the write-combined mappings or by the device. A
+     * bidirectional map cleans, the unmap invalidates.
+     */
+    if (uncached) {
+        ret = dma_map_sgtable(&dma32_heap_pdev->dev, table,
+                              DMA_BIDIRECTIONAL, 0);
+        if (ret)
+            goto free_pages;
+        dma_unmap_sgtable(&dma32_heap_pdev->dev, table, DMA_BIDIRECTIONAL, 0);
+    }
+
     exp_info.exp_name = dma_heap_get_name(heap);
     exp_info.ops = &dma32_heap_buf_ops;
     exp_info.size = buffer->len;
@@ -344,40 +927,182 @@ free_pages:
     for_each_sgtable_sg(table, sg, i) {
         struct page *p = sg_page(sg);
         if (p)
-            __free_pages(p, compound_order(p));
+            dma32_pool_put(p);
     }
     sg_free_table(table);
 free_buffer:
-    list_for_each_entry_safe(page, tmp_page, &pages, lru)
-        __free_pages(page, compound_order(page));
+    list_for_each_entry_safe(page, tmp_page, &pages, lru) {
+        list_del(&page->lru);
+        dma32_pool_put(page);
+    }
+    kfree(buffer);
+    return ERR_PTR(ret);
+}
+
+static struct dma_buf *dma32_contig_heap_allocate(struct dma_heap *heap,
+                                                  unsigned long len,
+                                                  u32 fd_flags,
+                                                  u64 heap_flags)
+{
+    struct dma32_heap_buffer *buffer;
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct dma_buf *dmabuf;
+    struct page *page;
+    int ret = -ENOMEM;
+
+    if (!len)
+        return ERR_PTR(-EINVAL);
+
+    buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+    if (!buffer)
+        return ERR_PTR(-ENOMEM);
+
+    INIT_LIST_HEAD(&buffer->attachments);
+    mutex_init(&buffer->lock);
+    buffer->heap = heap;
+    buffer->len = len;
+    buffer->contig = true;
+
+    page = dma32_contig_alloc(buffer, PAGE_ALIGN(len));
+    if (!page)
+        goto free_buffer;
+
+    if (sg_alloc_table(&buffer->sg_table, 1, GFP_KERNEL))
+        goto free_pages;
+    sg_set_page(buffer->sg_table.sgl, page, PAGE_ALIGN(len), 0);
+
+    exp_info.exp_name = dma_heap_get_name(heap);
+    exp_info.ops = &dma32_heap_buf_ops;
+    exp_info.size = buffer->len;
+    exp_info.flags = fd_flags;
+    exp_info.priv = buffer;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        ret = PTR_ERR(dmabuf);
+        goto free_table;
+    }
+
+    return dmabuf;
+
+free_table:
+    sg_free_table(&buffer->sg_table);
+free_pages:
+    dma32_contig_free(buffer, page);
+free_buffer:
     kfree(buffer);
     return ERR_PTR(ret);
 }
 
+static struct dma_buf *dma32_heap_allocate(struct dma_heap *heap,
+                                           unsigned long len,
+                                           u32 fd_flags,
+                                           u64 heap_flags)
+{
+    return dma32_heap_do_allocate(heap, len, fd_flags, false);
+}
+
+static struct dma_buf *dma32_uncached_heap_allocate(struct dma_heap *heap,
+                                                    unsigned long len,
+                                                    u32 fd_flags,
+                                                    u64 heap_flags)
+{
+    return dma32_heap_do_allocate(heap, len, fd_flags, true);
+}
+
 static const struct dma_heap_ops dma32_heap_ops = {
     .allocate = dma32_heap_allocate,
 };
 
+static const struct dma_heap_ops dma32_uncached_heap_ops = {
+    .allocate = dma32_uncached_heap_allocate,
+};
+
+static const struct dma_heap_ops dma32_contig_heap_ops = {
+    .allocate = dma32_contig_heap_allocate,
+};
+
 static struct dma_heap *dma32_heap;
+static struct dma_heap *dma32_contig_heap;
+static struct dma_heap *dma32_uncached_heap;
+
+static int __init dma32_heap_pdev_init(void)
+{
+    int ret;
+
+    dma32_heap_pdev = platform_device_register_simple("dma32-heap",
+                                                      PLATFORM_DEVID_NONE,
+                                                      NULL, 0);
+    if (IS_ERR(dma32_heap_pdev)) {
+        ret = PTR_ERR(dma32_heap_pdev);
+        dma32_heap_pdev = NULL;
+        return ret;
+    }
+
+    /* All pages sit below 4GB, so streaming maps never bounce */
+    ret = dma_coerce_mask_and_coherent(&dma32_heap_pdev->dev,
+                                       DMA_BIT_MASK(32));
+    if (ret) {
+        platform_device_unregister(dma32_heap_pdev);
+        dma32_heap_pdev = NULL;
+    }
+    return ret;
+}
 
 static int __init dma32_heap_init(void)
 {
     struct dma_heap_export_info exp_info;
+    int ret;
+
+    /* Pools are an optimization, the heap works without them */
+    if (dma32_pool_init())
+        pr_warn("DMA32 Heap: page pools disabled\n");
 
     exp_info.name = "dma32";
     exp_info.ops = &dma32_heap_ops;
     exp_info.priv = NULL;
 
     dma32_heap = dma_heap_add(&exp_info);
-    if (IS_ERR(dma32_heap))
+    if (IS_ERR(dma32_heap)) {
+        dma32_pool_exit();
         return PTR_ERR(dma32_heap);
+    }
 
     pr_info("DMA32 Heap: registered (allocations below 4GB)\n");
+
+    /* Heaps cannot be removed, a failure here only loses the contig node */
+    exp_info.name = "dma32-contig";
+    exp_info.ops = &dma32_contig_heap_ops;
+    dma32_contig_heap = dma_heap_add(&exp_info);
+    if (IS_ERR(dma32_contig_heap))
+        pr_warn("DMA32 Heap: dma32-contig not registered: %ld\n",
+                PTR_ERR(dma32_contig_heap));
+    else
+        pr_info("DMA32 Heap: dma32-contig registered (contiguous below 4GB)\n");
+
+    /* Without its device the uncached heap has no way to flush new pages */
+    ret = dma32_heap_pdev_init();
+    if (ret) {
+        pr_warn("DMA32 Heap: dma32-uncached not registered: %d\n", ret);
+        return 0;
+    }
+
+    exp_info.name = "dma32-uncached";
+    exp_info.ops = &dma32_uncached_heap_ops;
+    dma32_uncached_heap = dma_heap_add(&exp_info);
+    if (IS_ERR(dma32_uncached_heap))
+        pr_warn("DMA32 Heap: dma32-uncached not registered: %ld\n",
+                PTR_ERR(dma32_uncached_heap));
+    else
+        pr_info("DMA32 Heap: dma32-uncached registered (write-combine)\n");
+
     return 0;
 }
 
 static void __exit dma32_heap_exit(void)
 {
+    if (dma32_heap_pdev)
+        platform_device_unregister(dma32_heap_pdev);
+    dma32_pool_exit();
     pr_info("DMA32 Heap: unloaded\n");
 }
 
@@ -94,6 +94,73 @@ struct rknpu_timer {
 	ktime_t total_busy_time;
 };
 
+/* MEM_SYNC halves performed vs. elided by the per-buffer dirty tracking */
+struct rknpu_sync_stats {
+	atomic64_t performed;
+	atomic64_t performed_bytes;
+	atomic64_t elided;
+	atomic64_t elided_bytes;
+};
+
+/* Contiguous shadows of scattered dma-buf imports, see rknpu_shadow_get() */
+struct rknpu_shadow_stats {
+	u64 created;
+	u64 reused;
+	u64 copy_in;
+	u64 copy_out;
+	u64 copy_bytes;
+	u64 live_bytes;
+};
+
+/* Sub-allocated misc buffers, see rknpu_mem_slab_alloc() */
+struct rknpu_slab_stats {
+	atomic64_t blocks;
+	atomic64_t allocs;
+	atomic64_t live;
+	atomic64_t live_bytes;
+	atomic64_t saved_bytes;
+};
+
+/* Deferred teardown on close, see rknpu_reap_defer() */
+struct rknpu_reap_item {
+	struct list_head node;
+	size_t size;
+	void (*free)(struct rknpu_reap_item *item);
+};
+
+struct rknpu_reap_stats {
+	u64 deferred;
+	u64 deferred_bytes;
+	u64 sync;
+	u64 flushes;
+	u64 last_us;
+};
+
+/* Per-file IOVA arenas, see rknpu_iova_arena_create() */
+struct rknpu_arena_stats {
+	atomic64_t arenas;
+	atomic64_t reserved_bytes;
+	atomic64_t allocs;
+	atomic64_t fallbacks;
+};
+
+/* IOMMU domain switching, see rknpu_iommu_domain_get_and_switch() */
+struct rknpu_domain_stats {
+	atomic64_t switches;
+	atomic64_t waits;
+	atomic64_t batched;
+	atomic64_t timeouts;
+};
+
+/* Idle-time DMA32 compaction, see rknpu_compact_work() */
+struct rknpu_compact_stats {
+	u64 runs;
+	u64 blocks;
+	u64 failures;
+	u64 aborted;
+	u64 last_us;
+};
+
 struct rknpu_subcore_data {
 	struct list_head todo_list;
 	wait_queue_head_t job_done_wq;
@@ -121,6 +188,9 @@ struct rknpu_device {
 	struct rk_dma_heap *heap;
 #elif defined(RKNPU_DKMS_MISCDEV_ENABLED)
 	struct miscdevice miscdev;
+#endif
+#ifdef RKNPU_DKMS_MISCDEV
+	struct rknpu_mem_pool *mem_pool;
 #endif
 	atomic_t sequence;
 	spinlock_t lock;
@@ -176,11 +246,41 @@ struct rknpu_device {
 	struct iommu_domain *iommu_domains[RKNPU_MAX_IOMMU_DOMAIN_NUM];
 	struct sg_table *cache_sgt[RKNPU_CACHE_SG_TABLE_NUM];
 	atomic_t iommu_domain_refcount;
+	wait_queue_head_t iommu_domain_wq;
+	int iommu_domain_wanted;
+	unsigned int iommu_domain_batch;
+	struct rknpu_domain_stats domain_stats;
+	atomic64_t job_seq;
+	struct rknpu_sync_stats sync_stats;
+	struct mutex shadow_lock;
+	struct list_head shadow_list;
+	struct rknpu_shadow_stats shadow_stats;
+	struct work_struct compact_work;
+	struct rknpu_compact_stats compact_stats;
+	struct rknpu_carveout *carveout;
+	struct rknpu_slab_stats slab_stats;
+	struct mutex share_lock;
+	struct list_head share_list;
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+	struct rknpu_gem_zero_cache *zero_cache;
+#endif
+	spinlock_t reap_lock;
+	struct list_head reap_list;
+	size_t reap_bytes;
+	unsigned int reap_count;
+	bool reap_closed;
+	struct work_struct reap_work;
+	struct rknpu_reap_stats reap_stats;
+	struct rknpu_arena_stats arena_stats;
 };
 
 struct rknpu_session {
+	struct kref ref;
 	struct rknpu_device *rknpu_dev;
 	struct list_head list;
+	struct mutex slab_lock;
+	struct list_head slabs;
+	struct rknpu_reap_item reap;
 };
 
 int rknpu_power_get(struct rknpu_device *rknpu_dev);
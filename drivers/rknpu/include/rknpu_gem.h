@@ -20,6 +20,7 @@
 #endif
 
 #include "rknpu_mm.h"
+#include "rknpu_mem.h"
 
 #define to_rknpu_obj(x) container_of(x, struct rknpu_gem_object, base)
 
@@ -39,6 +40,17 @@
  *	device address with IOMMU.
  * @pages: Array of backing pages.
  * @sgt: Imported sg_table.
+ * @sync_track: cache ownership state for MEM_SYNC elision.
+ * @cpu_touched: set by the fault handler once the CPU touches the buffer
+ *	after user mappings were zapped by a clean.
+ * @carveout: backed by the reserved NPU carveout, see rknpu_carveout_alloc().
+ * @share: registry entry the buffer is published under, or NULL.
+ * @zero_size: size class of the pre-zeroed cache entry backing the buffer,
+ *	0 when it was allocated directly.
+ * @reap: queues the final teardown to the reap work, see rknpu_reap_defer().
+ * @iova_arena: IOVA arena of the creating file the buffer is mapped from,
+ *	or NULL.
+ * @from_pages: backed by shmem pages mapped by rknpu_gem_get_pages().
  *
  * P.S. this object would be transferred to user as kms_bo.handle so
  *	user can access the buffer through kms_bo.handle.
@@ -49,7 +61,7 @@ struct rknpu_gem_object {
 	unsigned long size;
 	unsigned long sram_size;
 	unsigned long nbuf_size;
-	struct rknpu_mm_obj *sram_obj;
+	struct rknpu_mm_obj sram_obj;
 	dma_addr_t iova_start;
 	unsigned long iova_size;
 	void *cookie;
@@ -63,8 +75,87 @@ struct rknpu_gem_object {
 	int iommu_domain_id;
 	unsigned int core_mask;
 	unsigned int cache_with_sgt;
+	struct rknpu_sync_track sync_track;
+	bool cpu_touched;
+	bool carveout;
+	struct rknpu_share *share;
+	unsigned long zero_size;
+	struct rknpu_reap_item reap;
+	struct rknpu_iova_arena *iova_arena;
+	bool from_pages;
 };
 
+/*
+ * Per DRM file state.
+ *
+ * @lock: protects @arenas.
+ * @arenas: IOVA arena reserved on first use, one per iommu domain.
+ */
+struct rknpu_gem_file {
+	struct mutex lock;
+	struct rknpu_iova_arena *arenas[RKNPU_MAX_IOMMU_DOMAIN_NUM];
+};
+
+int rknpu_gem_open(struct drm_device *drm, struct drm_file *file_priv);
+void rknpu_gem_postclose(struct drm_device *drm, struct drm_file *file_priv);
+
+/*
+ * Pre-zeroed contiguous buffers for RKNPU_MEM_ZEROING allocations, one
+ * power-of-two size class per order. A miss raises the class's @want and
+ * records the attributes it asked for; the refill work tops the classes
+ * back up while the NPU is powered off.
+ */
+#define RKNPU_GEM_ZERO_MAX_ORDER 10
+#define RKNPU_GEM_ZERO_NUM_CLASSES (RKNPU_GEM_ZERO_MAX_ORDER + 1)
+#define RKNPU_GEM_ZERO_MAX_DEPTH 4
+
+struct rknpu_gem_zero_buf {
+	struct list_head node;
+	void *cookie;
+	dma_addr_t dma_addr;
+	unsigned long dma_attrs;
+	gfp_t gfp_mask;
+	int iommu_domain_id;
+	int order;
+};
+
+struct rknpu_gem_zero_class {
+	struct list_head free_list;
+	unsigned int count;
+	unsigned int want;
+	unsigned long dma_attrs;
+	gfp_t gfp_mask;
+	int iommu_domain_id;
+};
+
+/*
+ * @lock: protects the classes and counters below.
+ * @cached_bytes: total size of all cached buffers.
+ * @hits: zeroing allocations served from the cache.
+ * @misses: cacheable-size zeroing allocations that had to allocate.
+ * @refilled: buffers allocated by the refill work.
+ * @aborted: refills cut short because the NPU was powered again.
+ * @reclaimed: bytes given back by the shrinker.
+ */
+struct rknpu_gem_zero_cache {
+	struct rknpu_device *rknpu_dev;
+	spinlock_t lock;
+	struct rknpu_gem_zero_class classes[RKNPU_GEM_ZERO_NUM_CLASSES];
+	size_t cached_bytes;
+	u64 hits;
+	u64 misses;
+	u64 refilled;
+	u64 aborted;
+	u64 reclaimed;
+	struct work_struct refill_work;
+	struct shrinker *shrinker;
+};
+
+int rknpu_gem_zero_cache_create(struct rknpu_device *rknpu_dev);
+void rknpu_gem_zero_cache_destroy(struct rknpu_device *rknpu_dev);
+void rknpu_gem_zero_cache_kick(struct rknpu_device *rknpu_dev);
+int rknpu_gem_zero_cache_dump(struct seq_file *m, void *data);
+
 enum rknpu_cache_type {
 	RKNPU_CACHE_SRAM = 1 << 0,
 	RKNPU_CACHE_NBUF = 1 << 1,
@@ -72,9 +163,10 @@ enum rknpu_cache_type {
 
 /* create a new buffer with gem object */
 struct rknpu_gem_object *
-rknpu_gem_object_create(struct drm_device *dev, unsigned int flags,
-			unsigned long size, unsigned long sram_size,
-			int iommu_domain_id, unsigned int core_mask);
+rknpu_gem_object_create(struct drm_device *dev, struct drm_file *file_priv,
+			unsigned int flags, unsigned long size,
+			unsigned long sram_size, int iommu_domain_id,
+			unsigned int core_mask);
 
 /* destroy a buffer with gem object */
 void rknpu_gem_object_destroy(struct rknpu_gem_object *rknpu_obj);
@@ -194,6 +286,33 @@ int rknpu_gem_prime_mmap(struct drm_gem_object *obj,
 int rknpu_gem_sync_ioctl(struct drm_device *dev, void *data,
 			 struct drm_file *file_priv);
 
+int rknpu_gem_sync_vec_ioctl(struct drm_device *dev, void *data,
+			     struct drm_file *file_priv);
+
+int rknpu_gem_lookup_syncs(struct drm_file *file_priv,
+			   struct rknpu_mem_sync *syncs, unsigned int count,
+			   struct rknpu_gem_object **rknpu_objs);
+
+void rknpu_gem_put_syncs(struct rknpu_gem_object **rknpu_objs,
+			 unsigned int count);
+
+int rknpu_gem_create_vec_ioctl(struct drm_device *dev, void *data,
+			       struct drm_file *file_priv);
+
+int rknpu_gem_destroy_vec_ioctl(struct drm_device *dev, void *data,
+				struct drm_file *file_priv);
+
+int rknpu_gem_publish_ioctl(struct drm_device *dev, void *data,
+			    struct drm_file *file_priv);
+
+int rknpu_gem_lookup_ioctl(struct drm_device *dev, void *data,
+			   struct drm_file *file_priv);
+
+/* cache maintenance of one range, caller holds the object's iommu domain */
+void rknpu_gem_sync_obj(struct rknpu_device *rknpu_dev,
+			struct rknpu_gem_object *rknpu_obj,
+			struct rknpu_mem_sync *args);
+
 static inline void *rknpu_gem_alloc_page(size_t nr_pages)
 {
 #if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
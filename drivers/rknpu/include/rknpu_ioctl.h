@@ -76,12 +76,36 @@ enum e_rknpu_mem_type {
 	RKNPU_MEM_TRY_ALLOC_NBUF = 1 << 9,
 	/* IOMMU limiting IOVA alignment */
 	RKNPU_MEM_IOMMU_LIMIT_IOVA_ALIGNMENT = 1 << 10,
+	/* wrap user memory at rknpu_mem_create.userptr (misc device only) */
+	RKNPU_MEM_USERPTR = 1 << 11,
+	/*
+	 * run a scattered import without an IOMMU on a contiguous copy that
+	 * MEM_SYNC (or a submit cache_syncs entry) copies in for TO_DEVICE
+	 * and out for FROM_DEVICE (misc device only)
+	 */
+	RKNPU_MEM_SHADOW = 1 << 12,
+	/* carve a small buffer out of a shared block (misc device only) */
+	RKNPU_MEM_SUBALLOC = 1 << 13,
 	RKNPU_MEM_MASK = RKNPU_MEM_NON_CONTIGUOUS | RKNPU_MEM_CACHEABLE |
 			 RKNPU_MEM_WRITE_COMBINE | RKNPU_MEM_KERNEL_MAPPING |
 			 RKNPU_MEM_IOMMU | RKNPU_MEM_ZEROING |
 			 RKNPU_MEM_SECURE | RKNPU_MEM_DMA32 |
 			 RKNPU_MEM_TRY_ALLOC_SRAM | RKNPU_MEM_TRY_ALLOC_NBUF |
-			 RKNPU_MEM_IOMMU_LIMIT_IOVA_ALIGNMENT
+			 RKNPU_MEM_IOMMU_LIMIT_IOVA_ALIGNMENT |
+			 RKNPU_MEM_USERPTR | RKNPU_MEM_SHADOW |
+			 RKNPU_MEM_SUBALLOC
+};
+
+/* how a RKNPU_MEM_USERPTR buffer is seen by the NPU */
+enum e_rknpu_userptr_mode {
+	/* the pinned user pages are mapped directly */
+	RKNPU_USERPTR_DIRECT = 1,
+	/*
+	 * the NPU works on a driver bounce buffer; MEM_SYNC (or a submit
+	 * cache_syncs entry) copies the range in for TO_DEVICE and back out
+	 * for FROM_DEVICE, a bounced task object is copied in at submit
+	 */
+	RKNPU_USERPTR_BOUNCE = 2,
 };
 
 /* sync mode definitions. */
@@ -148,7 +172,11 @@ enum e_rknpu_action {
  * @sram_size: user-desired sram memory allocation size.
  *  - this size value would be page-aligned internally.
  * @iommu_domain_id: iommu domain id
- * @reserved: just padding to be 64-bit aligned.
+ * @userptr: page aligned user address to wrap with RKNPU_MEM_USERPTR.
+ * @userptr_mode: RKNPU_USERPTR_DIRECT or RKNPU_USERPTR_BOUNCE, returned
+ *	for RKNPU_MEM_USERPTR.
+ * @offset: byte offset of the buffer inside the mapping of @handle,
+ *	non-zero only for RKNPU_MEM_SUBALLOC buffers.
  */
 struct rknpu_mem_create {
 	__u32 handle;
@@ -159,6 +187,9 @@ struct rknpu_mem_create {
 	__u64 sram_size;
 	__s32 iommu_domain_id;
 	__u32 core_mask;
+	__u64 userptr;
+	__u32 userptr_mode;
+	__u32 offset;
 };
 
 /**
@@ -191,7 +222,9 @@ struct rknpu_mem_destroy {
  * For synchronizing DMA buffer
  *
  * @flags: user request for setting memory type or cache attributes.
- * @reserved: reserved for padding.
+ * @handle: GEM handle of the buffer. On the DRM node, MEM_SYNC,
+ *	MEM_SYNC_VEC and submit cache_syncs name buffers by handle and
+ *	ignore @obj_addr.
  * @obj_addr: address of RKNPU memory object.
  * @offset: offset in bytes from start address of buffer.
  * @size: size of memory region.
@@ -199,12 +232,94 @@ struct rknpu_mem_destroy {
  */
 struct rknpu_mem_sync {
 	__u32 flags;
-	__u32 reserved;
+	__u32 handle;
 	__u64 obj_addr;
 	__u64 offset;
 	__u64 size;
 };
 
+/**
+ * For synchronizing many DMA buffer ranges in one call
+ *
+ * @count: number of entries in @syncs, at most RKNPU_MEM_SYNC_VEC_MAX.
+ * @reserved: reserved for padding.
+ * @syncs: user pointer to an array of struct rknpu_mem_sync, one per
+ *	(handle or obj_addr, offset, size, flags) range.
+ *
+ * All objects are looked up before any cache maintenance is done; an
+ * unknown handle or object fails the whole call with nothing synced.
+ */
+struct rknpu_mem_sync_vec {
+	__u32 count;
+	__u32 reserved;
+	__u64 syncs;
+};
+
+#define RKNPU_MEM_SYNC_VEC_MAX 64
+
+/**
+ * For creating many DMA buffers in one call
+ *
+ * @count: number of entries in @creates, at most RKNPU_MEM_VEC_MAX.
+ * @reserved: reserved for padding.
+ * @creates: user pointer to an array of struct rknpu_mem_create, filled
+ *	in on return exactly as for single RKNPU_MEM_CREATE calls.
+ *
+ * Either every buffer is created or, on error, none is.
+ */
+struct rknpu_mem_create_vec {
+	__u32 count;
+	__u32 reserved;
+	__u64 creates;
+};
+
+/**
+ * For destroying many DMA buffers in one call
+ *
+ * @count: number of entries in @destroys, at most RKNPU_MEM_VEC_MAX.
+ * @reserved: reserved for padding.
+ * @destroys: user pointer to an array of struct rknpu_mem_destroy.
+ *
+ * All buffers are looked up before any is freed; an unknown or repeated
+ * buffer fails the whole call with nothing destroyed.
+ */
+struct rknpu_mem_destroy_vec {
+	__u32 count;
+	__u32 reserved;
+	__u64 destroys;
+};
+
+#define RKNPU_MEM_VEC_MAX 256
+
+#define RKNPU_MEM_SHARE_NAME_LEN 64
+
+/**
+ * For publishing a buffer under a name, or looking a published one up
+ *
+ * @name: NUL terminated name or content hash of the buffer.
+ * @handle: publish: GEM handle of the buffer (DRM node).
+ *	lookup: returns a GEM handle (DRM node), or a read-only fd to
+ *	mmap the buffer through (/dev/rknpu).
+ * @reserved: reserved for padding.
+ * @obj_addr: publish: obj_addr of the buffer (/dev/rknpu).
+ *	lookup: returns the obj_addr of the buffer in this session.
+ * @dma_addr: lookup: returns the dma address of the buffer.
+ * @size: lookup: returns the size of the buffer.
+ *
+ * A published buffer stays registered until every session holding it,
+ * publisher included, has destroyed it. New CPU mappings made through a
+ * lookup (and, on the DRM node, any mapping made after publishing) are
+ * read-only.
+ */
+struct rknpu_mem_share {
+	__u8 name[RKNPU_MEM_SHARE_NAME_LEN];
+	__u32 handle;
+	__u32 reserved;
+	__u64 obj_addr;
+	__u64 dma_addr;
+	__u64 size;
+};
+
 /**
  * struct rknpu_task structure for task information
  *
@@ -260,6 +375,15 @@ struct rknpu_subcore_task {
  * @core_mask: core mask of rknpu
  * @fence_fd: dma fence fd
  * @subcore_task: subcore task
+ * @cache_syncs: user pointer to an array of struct rknpu_mem_sync.
+ *	RKNPU_MEM_SYNC_TO_DEVICE ranges are cleaned before the job is
+ *	committed, RKNPU_MEM_SYNC_FROM_DEVICE ranges are invalidated after
+ *	it completes and before its fence is signaled or waiters woken.
+ *	For a RKNPU_MEM_SHADOW import, only the ranges named here are
+ *	copied in and out of its contiguous copy.
+ * @cache_sync_count: number of entries in @cache_syncs, at most
+ *	RKNPU_MEM_SYNC_VEC_MAX. 0 (or an older, shorter struct) disables it.
+ * @reserved2: just padding to be 64-bit aligned.
  *
  */
 struct rknpu_submit {
@@ -277,6 +401,9 @@ struct rknpu_submit {
 	__u32 core_mask;
 	__s32 fence_fd;
 	struct rknpu_subcore_task subcore_task[5];
+	__u64 cache_syncs;
+	__u32 cache_sync_count;
+	__u32 reserved2;
 };
 
 /**
@@ -297,6 +424,11 @@ struct rknpu_action {
 #define RKNPU_MEM_MAP 0x03
 #define RKNPU_MEM_DESTROY 0x04
 #define RKNPU_MEM_SYNC 0x05
+#define RKNPU_MEM_SYNC_VEC 0x06
+#define RKNPU_MEM_CREATE_VEC 0x07
+#define RKNPU_MEM_DESTROY_VEC 0x08
+#define RKNPU_MEM_PUBLISH 0x09
+#define RKNPU_MEM_LOOKUP 0x0a
 
 #define RKNPU_IOC_MAGIC 'r'
 #define RKNPU_IOW(nr, type) _IOW(RKNPU_IOC_MAGIC, nr, type)
@@ -317,6 +449,19 @@ struct rknpu_action {
 	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_DESTROY, struct rknpu_mem_destroy)
 #define DRM_IOCTL_RKNPU_MEM_SYNC \
 	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_SYNC, struct rknpu_mem_sync)
+#define DRM_IOCTL_RKNPU_MEM_SYNC_VEC \
+	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_SYNC_VEC, \
+		 struct rknpu_mem_sync_vec)
+#define DRM_IOCTL_RKNPU_MEM_CREATE_VEC \
+	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_CREATE_VEC, \
+		 struct rknpu_mem_create_vec)
+#define DRM_IOCTL_RKNPU_MEM_DESTROY_VEC \
+	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_DESTROY_VEC, \
+		 struct rknpu_mem_destroy_vec)
+#define DRM_IOCTL_RKNPU_MEM_PUBLISH \
+	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_PUBLISH, struct rknpu_mem_share)
+#define DRM_IOCTL_RKNPU_MEM_LOOKUP \
+	DRM_IOWR(DRM_COMMAND_BASE + RKNPU_MEM_LOOKUP, struct rknpu_mem_share)
 
 #define IOCTL_RKNPU_ACTION RKNPU_IOWR(RKNPU_ACTION, struct rknpu_action)
 #define IOCTL_RKNPU_SUBMIT RKNPU_IOWR(RKNPU_SUBMIT, struct rknpu_submit)
@@ -326,5 +471,15 @@ struct rknpu_action {
 #define IOCTL_RKNPU_MEM_DESTROY \
 	RKNPU_IOWR(RKNPU_MEM_DESTROY, struct rknpu_mem_destroy)
 #define IOCTL_RKNPU_MEM_SYNC RKNPU_IOWR(RKNPU_MEM_SYNC, struct rknpu_mem_sync)
+#define IOCTL_RKNPU_MEM_SYNC_VEC \
+	RKNPU_IOWR(RKNPU_MEM_SYNC_VEC, struct rknpu_mem_sync_vec)
+#define IOCTL_RKNPU_MEM_CREATE_VEC \
+	RKNPU_IOWR(RKNPU_MEM_CREATE_VEC, struct rknpu_mem_create_vec)
+#define IOCTL_RKNPU_MEM_DESTROY_VEC \
+	RKNPU_IOWR(RKNPU_MEM_DESTROY_VEC, struct rknpu_mem_destroy_vec)
+#define IOCTL_RKNPU_MEM_PUBLISH \
+	RKNPU_IOWR(RKNPU_MEM_PUBLISH, struct rknpu_mem_share)
+#define IOCTL_RKNPU_MEM_LOOKUP \
+	RKNPU_IOWR(RKNPU_MEM_LOOKUP, struct rknpu_mem_share)
 
 #endif
@@ -7,6 +7,8 @@
 #ifndef __LINUX_RKNPU_IOMMU_H
 #define __LINUX_RKNPU_IOMMU_H
 
+#include <linux/genalloc.h>
+#include <linux/kref.h>
 #include <linux/mutex.h>
 #include <linux/seq_file.h>
 #include <linux/iommu.h>
@@ -38,19 +40,46 @@ dma_addr_t rknpu_iommu_dma_alloc_iova(struct iommu_domain *domain, size_t size,
 void rknpu_iommu_dma_free_iova(struct rknpu_iommu_dma_cookie *cookie,
 			       dma_addr_t iova, size_t size, bool size_aligned);
 
+/*
+ * Contiguous IOVA range reserved from one domain for one DRM file, see
+ * rknpu_gem_file_arena(). Buffers are sub-allocated from it naturally
+ * aligned to their size order, so frees stay local to the file and its
+ * churn cannot fragment the IOVA space of other files.
+ */
+struct rknpu_iova_arena {
+	struct kref ref;
+	struct rknpu_device *rknpu_dev;
+	struct iommu_domain *domain;
+	dma_addr_t base;
+	size_t size;
+	struct gen_pool *pool;
+};
+
+struct rknpu_iova_arena *rknpu_iova_arena_create(struct rknpu_device *rknpu_dev,
+						 size_t size);
+void rknpu_iova_arena_put(struct rknpu_iova_arena *arena);
+dma_addr_t rknpu_iova_arena_alloc(struct rknpu_iova_arena *arena, size_t size);
+bool rknpu_iova_arena_free(struct rknpu_iova_arena *arena, dma_addr_t iova,
+			   size_t size);
+int rknpu_iova_arena_dump(struct seq_file *m, void *data);
+int rknpu_iommu_domain_dump(struct seq_file *m, void *data);
+
 int rknpu_iommu_dma_map_sg(struct device *dev, struct scatterlist *sg,
 			   int nents, enum dma_data_direction dir,
-			   bool iova_aligned);
+			   bool iova_aligned, struct rknpu_iova_arena *arena);
 
 void rknpu_iommu_dma_unmap_sg(struct device *dev, struct scatterlist *sg,
 			      int nents, enum dma_data_direction dir,
-			      bool iova_aligned);
+			      bool iova_aligned, struct rknpu_iova_arena *arena);
 
 int rknpu_iommu_init_domain(struct rknpu_device *rknpu_dev);
 int rknpu_iommu_switch_domain(struct rknpu_device *rknpu_dev, int domain_id);
 void rknpu_iommu_free_domains(struct rknpu_device *rknpu_dev);
 int rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
 				      int domain_id);
+int rknpu_iommu_domain_get_for_job(struct rknpu_device *rknpu_dev,
+				   int domain_id);
+int rknpu_iommu_domain_tryget(struct rknpu_device *rknpu_dev, int domain_id);
 int rknpu_iommu_domain_put(struct rknpu_device *rknpu_dev);
 
 #if KERNEL_VERSION(5, 10, 0) < LINUX_VERSION_CODE
@@ -15,12 +15,18 @@
 
 #include "rknpu_ioctl.h"
 
+struct rknpu_session;
+struct rknpu_shadow;
+
 #define RKNPU_MAX_CORES 3
 
 #define RKNPU_JOB_DONE (1 << 0)
 #define RKNPU_JOB_ASYNC (1 << 1)
 #define RKNPU_JOB_DETACHED (1 << 2)
 
+/* rknpu_job.state bit, taken by whichever of completion and abort runs */
+#define RKNPU_JOB_CLAIMED 0
+
 #define RKNPU_CORE_AUTO_MASK 0x00
 #define RKNPU_CORE0_MASK 0x01
 #define RKNPU_CORE1_MASK 0x02
@@ -50,6 +56,19 @@ struct rknpu_job {
 	atomic_t submit_count[RKNPU_MAX_CORES];
 	int iommu_domain_id;
 	bool use_drm_gem;	/* true = DRM/GEM path, false = misc device path */
+	/* submit-attached cache maintenance, see rknpu_submit.cache_syncs */
+	struct rknpu_mem_sync *cache_syncs;
+	void **cache_sync_objs;
+	uint32_t cache_sync_count;
+	bool cache_sync_post;
+	/* misc session the referenced cache_sync_objs belong to */
+	struct rknpu_session *session;
+	/* bounced userptr task object, see rknpu_mem_userptr_get() */
+	struct dma_buf *userptr_task;
+	/* shadowed scattered task object, see rknpu_shadow_get() */
+	struct rknpu_shadow *shadow_task;
+	struct work_struct done_work;
+	unsigned long state;
 };
 
 irqreturn_t rknpu_core0_irq_handler(int irq, void *data);
@@ -61,7 +80,9 @@ int rknpu_submit_ioctl(struct drm_device *dev, void *data,
 		       struct drm_file *file_priv);
 #endif
 #if defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP) || defined(RKNPU_DKMS_MISCDEV_ENABLED)
-int rknpu_miscdev_submit_ioctl(struct rknpu_device *rknpu_dev, unsigned long data);
+int rknpu_miscdev_submit_ioctl(struct rknpu_device *rknpu_dev,
+			       struct file *file, unsigned int cmd,
+			       unsigned long data);
 #endif
 
 int rknpu_get_hw_version(struct rknpu_device *rknpu_dev, uint32_t *version);
@@ -7,9 +7,53 @@
 #ifndef __LINUX_RKNPU_MEM_H
 #define __LINUX_RKNPU_MEM_H
 
+#include <linux/dma-direction.h>
+#include <linux/kref.h>
 #include <linux/mm_types.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
 
+#include "rknpu_ioctl.h"
+
+struct rknpu_device;
+struct rknpu_mem_sync;
+struct rknpu_shadow;
+struct rknpu_carveout;
+struct rknpu_mem_slab;
+struct rknpu_session;
+struct rknpu_reap_item;
+struct drm_gem_object;
+struct sg_table;
+
+/*
+ * Cache ownership of a cacheable buffer, used to turn redundant
+ * MEM_SYNC requests into no-ops.
+ *
+ * RKNPU_SYNC_CPU_DIRTY: the CPU may hold dirty lines, a clean is needed.
+ * RKNPU_SYNC_CLEAN: cleaned and not touched through a CPU mapping since,
+ *	and no job has run since the last invalidate.
+ * RKNPU_SYNC_DEVICE_DIRTY: cleaned, but a job has run since the last
+ *	invalidate, so the device may have written the buffer.
+ *
+ * Only CPU_DIRTY and CLEAN are stored, DEVICE_DIRTY is derived from
+ * @seq against rknpu_device.job_seq. @lock serializes syncs of the
+ * buffer, from reading its CPU access state to recording the result.
+ */
+enum rknpu_sync_state {
+	RKNPU_SYNC_CPU_DIRTY = 0,
+	RKNPU_SYNC_CLEAN,
+	RKNPU_SYNC_DEVICE_DIRTY,
+};
+
+struct rknpu_sync_track {
+	struct mutex lock;
+	enum rknpu_sync_state state;
+	u64 seq;
+};
+
 /*
  * rknpu DMA buffer structure.
  *
@@ -21,9 +65,18 @@
  *	- this address could be physical address without IOMMU and
  *	device address with IOMMU.
  * @pages: Array of backing pages.
- * @sgt: Imported sg_table.
+ * @sgt: Imported sg_table, or the exporter's own table for self-owned
+ *	direct-alloc buffers.
  * @dmabuf: buffer for this attachment.
+ * @attachment: dma-buf attachment, NULL for self-owned direct-alloc buffers.
  * @owner: Is this memory internally allocated.
+ * @sync_track: cache ownership state for MEM_SYNC elision.
+ * @shadow: contiguous copy the NPU uses for a scattered import, or NULL.
+ * @slab: block a RKNPU_MEM_SUBALLOC buffer was carved out of, or NULL.
+ * @slab_offset: byte offset of the buffer inside @slab.
+ * @share: registry entry the buffer was published under or looked up
+ *	from, or NULL.
+ * @ref: held by the session list and by jobs using the buffer.
  */
 struct rknpu_mem_object {
 	unsigned long flags;
@@ -36,12 +89,184 @@ struct rknpu_mem_object {
 	struct dma_buf_attachment *attachment;
 	struct list_head head;
 	unsigned int owner;
+	struct rknpu_sync_track sync_track;
+	struct rknpu_shadow *shadow;
+	struct rknpu_mem_slab *slab;
+	unsigned int slab_offset;
+	struct rknpu_share *share;
+	struct kref ref;
+};
+
+/*
+ * Buffer published under @name for other sessions, on rknpu_device's
+ * share_list under share_lock.
+ *
+ * A misc buffer holds a reference on @dmabuf for as long as @users
+ * objects (publisher included) use the entry. A GEM buffer is not
+ * referenced by its entry, it unpublishes itself when freed and lookups
+ * only take it while its refcount is non-zero.
+ */
+struct rknpu_share {
+	struct list_head node;
+	char name[RKNPU_MEM_SHARE_NAME_LEN];
+	struct rknpu_device *rknpu_dev;
+	size_t size;
+	struct dma_buf *dmabuf;
+	struct drm_gem_object *gem;
+	unsigned int users;
+};
+
+#ifdef RKNPU_DKMS_MISCDEV
+/*
+ * Power-of-two size classes of the misc direct-alloc buffer pool,
+ * PAGE_SIZE << 0 .. PAGE_SIZE << RKNPU_MEM_POOL_MAX_ORDER. Larger
+ * buffers bypass the pool.
+ */
+#define RKNPU_MEM_POOL_MAX_ORDER 10
+#define RKNPU_MEM_POOL_NUM_CLASSES (RKNPU_MEM_POOL_MAX_ORDER + 1)
+/* Coherent (uncached) and cacheable buffers are pooled separately */
+#define RKNPU_MEM_POOL_NUM_TYPES 2
+
+/*
+ * rknpu misc direct-alloc buffer pool.
+ *
+ * @dev: device the pooled buffers were allocated for.
+ * @lock: protects the free lists and counters below.
+ * @free_list: cached buffers, one list per buffer type and size class.
+ * @count: number of cached buffers per buffer type and size class.
+ * @cached_bytes: total size of all cached buffers.
+ * @hits: allocations served from the pool.
+ * @misses: pooled-size allocations that had to allocate.
+ * @bypass: allocations too large to be pooled.
+ * @reclaimed: bytes given back by the shrinker.
+ * @shrinker: reclaims cached buffers under memory pressure.
+ * @ref: held by the device and by every buffer allocated for the pool,
+ *	exported dma-bufs can outlive rknpu_mem_pool_destroy().
+ * @dead: set by rknpu_mem_pool_destroy(), freed buffers are no longer
+ *	cached.
+ */
+struct rknpu_mem_pool {
+	struct device *dev;
+	spinlock_t lock;
+	struct list_head free_list[RKNPU_MEM_POOL_NUM_TYPES]
+				  [RKNPU_MEM_POOL_NUM_CLASSES];
+	unsigned int count[RKNPU_MEM_POOL_NUM_TYPES][RKNPU_MEM_POOL_NUM_CLASSES];
+	size_t cached_bytes;
+	u64 hits;
+	u64 misses;
+	u64 bypass;
+	u64 reclaimed;
+	struct shrinker *shrinker;
+	struct kref ref;
+	bool dead;
 };
 
+int rknpu_mem_pool_create(struct device *dev, struct rknpu_mem_pool **pool);
+void rknpu_mem_pool_destroy(struct rknpu_mem_pool *pool);
+int rknpu_mem_pool_dump(struct seq_file *m, void *data);
+
+/*
+ * RKNPU_MEM_SUBALLOC buffers up to RKNPU_MEM_SLAB_MAX_SIZE are carved out
+ * of RKNPU_MEM_SLAB_SIZE blocks in RKNPU_MEM_SLAB_ALIGN granules, which
+ * also keeps them on separate cache lines.
+ */
+#define RKNPU_MEM_SLAB_SIZE SZ_64K
+#define RKNPU_MEM_SLAB_ALIGN 256
+#define RKNPU_MEM_SLAB_GRANULES (RKNPU_MEM_SLAB_SIZE / RKNPU_MEM_SLAB_ALIGN)
+#define RKNPU_MEM_SLAB_MAX_SIZE SZ_16K
+
+void rknpu_mem_slab_free(struct rknpu_mem_object *rknpu_obj);
+int rknpu_mem_slab_dump(struct seq_file *m, void *data);
+
+struct dma_buf *rknpu_mem_userptr_get(struct rknpu_device *rknpu_dev,
+				      struct file *file, __u64 obj_addr);
+struct rknpu_shadow *rknpu_mem_shadow_get(struct rknpu_device *rknpu_dev,
+					  struct file *file, __u64 obj_addr);
+void rknpu_mem_userptr_sync(struct dma_buf *dmabuf, u64 offset, u64 size,
+			    bool to_device);
+#endif
+
 int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			   unsigned int cmd, unsigned long data);
 int rknpu_mem_destroy_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			    unsigned long data);
+int rknpu_mem_create_vec_ioctl(struct rknpu_device *rknpu_dev,
+			       struct file *file, unsigned long data);
+int rknpu_mem_destroy_vec_ioctl(struct rknpu_device *rknpu_dev,
+				struct file *file, unsigned long data);
+int rknpu_mem_publish_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			    unsigned long data);
+int rknpu_mem_lookup_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			   unsigned long data);
 int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, struct file *file, unsigned long data);
+int rknpu_mem_sync_vec_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			     unsigned long data);
+int rknpu_mem_lookup_syncs(struct rknpu_device *rknpu_dev, struct file *file,
+			   struct rknpu_mem_sync *syncs, unsigned int count,
+			   struct rknpu_mem_object **rknpu_objs);
+void rknpu_mem_sync_obj(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj,
+			struct rknpu_mem_sync *args);
+void rknpu_mem_unmap(struct rknpu_mem_object *rknpu_obj);
+void rknpu_mem_put_syncs(struct rknpu_mem_object **rknpu_objs,
+			 unsigned int count);
+void rknpu_mem_free_obj(struct rknpu_mem_object *rknpu_obj);
+void rknpu_session_get(struct rknpu_session *session);
+void rknpu_session_put(struct rknpu_session *session);
+
+/* Cache maintenance of [offset, offset + size) of the range behind @data */
+typedef void (*rknpu_cache_op_t)(void *data, unsigned long offset,
+				 unsigned long size);
+
+void rknpu_cache_op_parallel(rknpu_cache_op_t fn, void *data,
+			     unsigned long size);
+void rknpu_dma_sync_range(struct device *dev, dma_addr_t addr,
+			  unsigned long offset, unsigned long size,
+			  enum dma_data_direction dir, bool for_cpu);
+
+void rknpu_sync_track_init(struct rknpu_sync_track *track);
+uint32_t rknpu_sync_track_begin(struct rknpu_device *rknpu_dev,
+				struct rknpu_sync_track *track, bool tracked,
+				bool cpu_touched, struct rknpu_mem_sync *args,
+				u64 *seq);
+void rknpu_sync_track_end(struct rknpu_sync_track *track, uint32_t flags,
+			  bool full, u64 seq);
+enum rknpu_sync_state rknpu_sync_track_state(struct rknpu_device *rknpu_dev,
+					     struct rknpu_sync_track *track);
+int rknpu_sync_stats_dump(struct seq_file *m, void *data);
+
+bool rknpu_sgt_dma_contiguous(struct sg_table *sgt);
+int rknpu_shadow_get(struct rknpu_device *rknpu_dev, struct dma_buf *dmabuf,
+		     struct rknpu_shadow **shadow);
+void rknpu_shadow_ref(struct rknpu_shadow *shadow);
+void rknpu_shadow_put(struct rknpu_shadow *shadow);
+dma_addr_t rknpu_shadow_dma_addr(struct rknpu_shadow *shadow);
+void rknpu_shadow_sync(struct rknpu_shadow *shadow, u64 offset, u64 size,
+		       bool to_device);
+int rknpu_shadow_dump(struct seq_file *m, void *data);
+
+void rknpu_compact_work(struct work_struct *work);
+void rknpu_compact_kick(struct rknpu_device *rknpu_dev);
+int rknpu_compact_dump(struct seq_file *m, void *data);
+
+int rknpu_carveout_init(struct rknpu_device *rknpu_dev);
+struct page *rknpu_carveout_alloc(struct rknpu_carveout *carveout,
+				  size_t size);
+void rknpu_carveout_free(struct rknpu_carveout *carveout, struct page *page,
+			 size_t size);
+int rknpu_carveout_dump(struct seq_file *m, void *data);
+
+int rknpu_share_check_name(const __u8 *name);
+struct rknpu_share *rknpu_share_find(struct rknpu_device *rknpu_dev,
+				     const char *name);
+void rknpu_share_del(struct rknpu_share *share);
+int rknpu_share_dump(struct seq_file *m, void *data);
+
+bool rknpu_reap_defer(struct rknpu_device *rknpu_dev,
+		      struct rknpu_reap_item *item);
+void rknpu_reap_work(struct work_struct *work);
+bool rknpu_reap_flush(struct rknpu_device *rknpu_dev);
+void rknpu_reap_close(struct rknpu_device *rknpu_dev);
+int rknpu_reap_dump(struct seq_file *m, void *data);
 
 #endif
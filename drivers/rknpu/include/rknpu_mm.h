@@ -20,6 +20,9 @@ struct rknpu_mm {
 	unsigned int chunk_size;
 	unsigned int total_chunks;
 	unsigned int free_chunks;
+	unsigned long allocs;
+	unsigned long failures;
+	unsigned long frag_failures;
 };
 
 struct rknpu_mm_obj {
@@ -33,10 +36,12 @@ int rknpu_mm_create(unsigned int mem_size, unsigned int chunk_size,
 void rknpu_mm_destroy(struct rknpu_mm *mm);
 
 int rknpu_mm_alloc(struct rknpu_mm *mm, unsigned int size,
-		   struct rknpu_mm_obj **mm_obj);
+		   unsigned int align, struct rknpu_mm_obj *mm_obj);
 
 int rknpu_mm_free(struct rknpu_mm *mm, struct rknpu_mm_obj *mm_obj);
 
+unsigned int rknpu_mm_largest_free(struct rknpu_mm *mm);
+
 int rknpu_mm_dump(struct seq_file *m, void *data);
 
 #endif
@@ -23,6 +23,11 @@
 
 #include "rknpu_drv.h"
 #include "rknpu_mm.h"
+#include "rknpu_mem.h"
+#include "rknpu_iommu.h"
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+#include "rknpu_gem.h"
+#endif
 #include "rknpu_reset.h"
 #include "rknpu_debugger.h"
 
@@ -347,6 +352,21 @@ static struct rknpu_debugger_list rknpu_debugger_root_list[] = {
 #ifdef CONFIG_ROCKCHIP_RKNPU_SRAM
 	{ "mm", rknpu_mm_dump, NULL, NULL },
 #endif
+#ifdef RKNPU_DKMS_MISCDEV
+	{ "mem_pool", rknpu_mem_pool_dump, NULL, NULL },
+	{ "mem_slab", rknpu_mem_slab_dump, NULL, NULL },
+#endif
+	{ "cache_sync", rknpu_sync_stats_dump, NULL, NULL },
+	{ "shadow", rknpu_shadow_dump, NULL, NULL },
+	{ "compact", rknpu_compact_dump, NULL, NULL },
+	{ "carveout", rknpu_carveout_dump, NULL, NULL },
+	{ "share", rknpu_share_dump, NULL, NULL },
+	{ "reap", rknpu_reap_dump, NULL, NULL },
+	{ "iova_arena", rknpu_iova_arena_dump, NULL, NULL },
+	{ "iommu_domain", rknpu_iommu_domain_dump, NULL, NULL },
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+	{ "gem_zero_cache", rknpu_gem_zero_cache_dump, NULL, NULL },
+#endif
 };
 
 static ssize_t rknpu_debugger_write(struct file *file, const char __user *ubuf,
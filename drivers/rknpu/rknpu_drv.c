@@ -375,8 +375,14 @@ static void rknpu_power_off_delay_work(struct work_struct *power_off_work)
 	mutex_lock(&rknpu_dev->power_lock);
 	if (atomic_dec_if_positive(&rknpu_dev->power_refcount) == 0) {
 		ret = rknpu_power_off(rknpu_dev);
-		if (ret)
+		if (ret) {
 			atomic_inc(&rknpu_dev->power_refcount);
+		} else {
+			rknpu_compact_kick(rknpu_dev);
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+			rknpu_gem_zero_cache_kick(rknpu_dev);
+#endif
+		}
 	}
 	mutex_unlock(&rknpu_dev->power_lock);
 
@@ -555,24 +561,27 @@ static int rknpu_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	}
 
+	kref_init(&session->ref);
 	session->rknpu_dev = rknpu_dev;
 	INIT_LIST_HEAD(&session->list);
+	mutex_init(&session->slab_lock);
+	INIT_LIST_HEAD(&session->slabs);
 
 	file->private_data = (void *)session;
 
 	return nonseekable_open(inode, file);
 }
 
-static int rknpu_release(struct inode *inode, struct file *file)
+static void rknpu_session_free(struct rknpu_reap_item *item)
 {
 	struct rknpu_mem_object *entry;
-	struct rknpu_session *session = file->private_data;
+	struct rknpu_session *session =
+		container_of(item, struct rknpu_session, reap);
 	struct rknpu_device *rknpu_dev = session->rknpu_dev;
 	LIST_HEAD(local_list);
 
 	spin_lock(&rknpu_dev->lock);
 	list_replace_init(&session->list, &local_list);
-	file->private_data = NULL;
 	spin_unlock(&rknpu_dev->lock);
 
 	while (!list_empty(&local_list)) {
@@ -583,25 +592,31 @@ static int rknpu_release(struct inode *inode, struct file *file)
 			"Fd close free rknpu_obj: %#llx, rknpu_obj->dma_addr: %#llx\n",
 			(__u64)(uintptr_t)entry, (__u64)entry->dma_addr);
 
-		if (entry->kv_addr) {
-			struct iosys_map map =
-				IOSYS_MAP_INIT_VADDR(entry->kv_addr);
-			dma_buf_vunmap(entry->dmabuf, &map);
-			entry->kv_addr = NULL;
-		}
+		list_del(&entry->head);
+		rknpu_mem_free_obj(entry);
+	}
 
-		dma_buf_unmap_attachment(entry->attachment, entry->sgt,
-					 DMA_BIDIRECTIONAL);
-		dma_buf_detach(entry->dmabuf, entry->attachment);
+	/* Jobs still holding buffers of the session keep it alive */
+	rknpu_session_put(session);
+}
 
-		if (!entry->owner)
-			dma_buf_put(entry->dmabuf);
+static int rknpu_release(struct inode *inode, struct file *file)
+{
+	struct rknpu_mem_object *entry;
+	struct rknpu_session *session = file->private_data;
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
 
-		list_del(&entry->head);
-		kfree(entry);
-	}
+	spin_lock(&rknpu_dev->lock);
+	file->private_data = NULL;
+	session->reap.size = 0;
+	list_for_each_entry(entry, &session->list, head)
+		session->reap.size += entry->size;
+	spin_unlock(&rknpu_dev->lock);
 
-	kfree(session);
+	/* Tear the buffers down in the background so close() does not stall */
+	session->reap.free = rknpu_session_free;
+	if (!rknpu_reap_defer(rknpu_dev, &session->reap))
+		rknpu_session_free(&session->reap);
 
 	return 0;
 }
@@ -649,7 +664,7 @@ static long rknpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case RKNPU_SUBMIT:
 		rknpu_power_get(rknpu_dev);
-		ret = rknpu_miscdev_submit_ioctl(rknpu_dev, arg);
+		ret = rknpu_miscdev_submit_ioctl(rknpu_dev, file, cmd, arg);
 		rknpu_power_put_delay(rknpu_dev);
 		break;
 	/* GEM/MEM ops don't need NPU power — only DMA/IOMMU access */
@@ -664,6 +679,21 @@ static long rknpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case RKNPU_MEM_SYNC:
 		ret = rknpu_mem_sync_ioctl(rknpu_dev, file, arg);
 		break;
+	case RKNPU_MEM_SYNC_VEC:
+		ret = rknpu_mem_sync_vec_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_CREATE_VEC:
+		ret = rknpu_mem_create_vec_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_DESTROY_VEC:
+		ret = rknpu_mem_destroy_vec_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_PUBLISH:
+		ret = rknpu_mem_publish_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_LOOKUP:
+		ret = rknpu_mem_lookup_ioctl(rknpu_dev, file, arg);
+		break;
 	default:
 		break;
 	}
@@ -724,6 +754,11 @@ RKNPU_IOCTL_NOPOWER(rknpu_gem_create_ioctl);
 RKNPU_IOCTL_NOPOWER(rknpu_gem_map_ioctl);
 RKNPU_IOCTL_NOPOWER(rknpu_gem_destroy_ioctl);
 RKNPU_IOCTL_NOPOWER(rknpu_gem_sync_ioctl);
+RKNPU_IOCTL_NOPOWER(rknpu_gem_sync_vec_ioctl);
+RKNPU_IOCTL_NOPOWER(rknpu_gem_create_vec_ioctl);
+RKNPU_IOCTL_NOPOWER(rknpu_gem_destroy_vec_ioctl);
+RKNPU_IOCTL_NOPOWER(rknpu_gem_publish_ioctl);
+RKNPU_IOCTL_NOPOWER(rknpu_gem_lookup_ioctl);
 
 static const struct drm_ioctl_desc rknpu_ioctls[] = {
 	DRM_IOCTL_DEF_DRV(RKNPU_ACTION, __rknpu_action_ioctl, DRM_RENDER_ALLOW),
@@ -736,6 +771,16 @@ static const struct drm_ioctl_desc rknpu_ioctls[] = {
 			  DRM_RENDER_ALLOW),
 	DRM_IOCTL_DEF_DRV(RKNPU_MEM_SYNC, __rknpu_gem_sync_ioctl,
 			  DRM_RENDER_ALLOW),
+	DRM_IOCTL_DEF_DRV(RKNPU_MEM_SYNC_VEC, __rknpu_gem_sync_vec_ioctl,
+			  DRM_RENDER_ALLOW),
+	DRM_IOCTL_DEF_DRV(RKNPU_MEM_CREATE_VEC, __rknpu_gem_create_vec_ioctl,
+			  DRM_RENDER_ALLOW),
+	DRM_IOCTL_DEF_DRV(RKNPU_MEM_DESTROY_VEC, __rknpu_gem_destroy_vec_ioctl,
+			  DRM_RENDER_ALLOW),
+	DRM_IOCTL_DEF_DRV(RKNPU_MEM_PUBLISH, __rknpu_gem_publish_ioctl,
+			  DRM_RENDER_ALLOW),
+	DRM_IOCTL_DEF_DRV(RKNPU_MEM_LOOKUP, __rknpu_gem_lookup_ioctl,
+			  DRM_RENDER_ALLOW),
 };
 
 #if KERNEL_VERSION(6, 1, 0) <= LINUX_VERSION_CODE
@@ -771,6 +816,8 @@ static struct drm_driver rknpu_drm_driver = {
 	.gem_prime_vmap = rknpu_gem_prime_vmap,
 	.gem_prime_vunmap = rknpu_gem_prime_vunmap,
 #endif
+	.open = rknpu_gem_open,
+	.postclose = rknpu_gem_postclose,
 	.dumb_create = rknpu_gem_dumb_create,
 #if KERNEL_VERSION(4, 19, 0) > LINUX_VERSION_CODE
 	.dumb_map_offset = rknpu_gem_dumb_map_offset,
@@ -1326,6 +1373,10 @@ static int rknpu_probe(struct platform_device *pdev)
 		rknpu_dev->iommu_group = iommu_group_get(dev);
 		if (!rknpu_dev->iommu_group)
 			return -EINVAL;
+
+		/* The carveout only serves the non-IOMMU path */
+		if (of_find_property(dev->of_node, "memory-region", NULL))
+			LOG_DEV_WARN(dev, "memory-region unused with the IOMMU on, drop it from the overlay\n");
 	} else {
 		/* Initialize reserved memory resources */
 		ret = of_reserved_mem_device_init(dev);
@@ -1334,6 +1385,10 @@ static int rknpu_probe(struct platform_device *pdev)
 				dev,
 				"initialize reserved memory for rknpu device!\n");
 		}
+
+		/* A plain memory-region is served by our own sub-allocator */
+		if (rknpu_carveout_init(rknpu_dev))
+			LOG_DEV_WARN(dev, "carveout unusable, allocating from the page allocator\n");
 	}
 
 	rknpu_reset_get(rknpu_dev);
@@ -1379,6 +1434,15 @@ static int rknpu_probe(struct platform_device *pdev)
 	mutex_init(&rknpu_dev->power_lock);
 	mutex_init(&rknpu_dev->reset_lock);
 	mutex_init(&rknpu_dev->domain_lock);
+	init_waitqueue_head(&rknpu_dev->iommu_domain_wq);
+	rknpu_dev->iommu_domain_wanted = -1;
+	mutex_init(&rknpu_dev->shadow_lock);
+	INIT_LIST_HEAD(&rknpu_dev->shadow_list);
+	mutex_init(&rknpu_dev->share_lock);
+	INIT_LIST_HEAD(&rknpu_dev->share_list);
+	spin_lock_init(&rknpu_dev->reap_lock);
+	INIT_LIST_HEAD(&rknpu_dev->reap_list);
+	INIT_WORK(&rknpu_dev->reap_work, rknpu_reap_work);
 	for (i = 0; i < config->num_irqs; i++) {
 		INIT_LIST_HEAD(&rknpu_dev->subcore_datas[i].todo_list);
 		init_waitqueue_head(&rknpu_dev->subcore_datas[i].job_done_wq);
@@ -1474,6 +1538,11 @@ static int rknpu_probe(struct platform_device *pdev)
 		LOG_DEV_INFO(dev, "DKMS: /dev/rknpu registered (DMA-BUF import only)\n");
 	}
 #endif
+#if defined(RKNPU_DKMS_MISCDEV) && !defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+	/* Only rknpu_dkms_alloc() uses the pool, same guard as its destroy */
+	if (rknpu_mem_pool_create(dev, &rknpu_dev->mem_pool))
+		LOG_DEV_WARN(dev, "DKMS: buffer pool unavailable, allocating directly\n");
+#endif
 
 #ifdef CONFIG_ROCKCHIP_RKNPU_FENCE
 	ret = rknpu_fence_context_alloc(rknpu_dev);
@@ -1526,6 +1595,11 @@ static int rknpu_probe(struct platform_device *pdev)
 	}
 	INIT_DEFERRABLE_WORK(&rknpu_dev->power_off_work,
 			     rknpu_power_off_delay_work);
+	INIT_WORK(&rknpu_dev->compact_work, rknpu_compact_work);
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+	if (rknpu_gem_zero_cache_create(rknpu_dev))
+		LOG_DEV_WARN(dev, "pre-zeroed buffer cache unavailable\n");
+#endif
 
 	/* DKMS: Use RKNPU_DKMS_SRAM_ENABLED to bypass CONFIG_NO_GKI check */
 #if defined(RKNPU_DKMS_SRAM_ENABLED)
@@ -1575,6 +1649,9 @@ static int rknpu_probe(struct platform_device *pdev)
 	return 0;
 
 err_remove_wq:
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+	rknpu_gem_zero_cache_destroy(rknpu_dev);
+#endif
 	destroy_workqueue(rknpu_dev->power_off_wq);
 
 err_devfreq_remove:
@@ -1589,6 +1666,10 @@ err_remove_drv:
 #if defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP) || defined(RKNPU_DKMS_MISCDEV_ENABLED)
 	misc_deregister(&(rknpu_dev->miscdev));
 #endif
+#if defined(RKNPU_DKMS_MISCDEV) && !defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+	rknpu_mem_pool_destroy(rknpu_dev->mem_pool);
+	rknpu_dev->mem_pool = NULL;
+#endif
 
 	return ret;
 }
@@ -1598,7 +1679,12 @@ static void rknpu_remove(struct platform_device *pdev)
 	struct rknpu_device *rknpu_dev = platform_get_drvdata(pdev);
 	int i = 0;
 
+	rknpu_reap_close(rknpu_dev);
 	cancel_delayed_work_sync(&rknpu_dev->power_off_work);
+	cancel_work_sync(&rknpu_dev->compact_work);
+#ifdef CONFIG_ROCKCHIP_RKNPU_DRM_GEM
+	rknpu_gem_zero_cache_destroy(rknpu_dev);
+#endif
 	destroy_workqueue(rknpu_dev->power_off_wq);
 
 	rknpu_debugger_remove(rknpu_dev);
@@ -1633,6 +1719,12 @@ static void rknpu_remove(struct platform_device *pdev)
 #if defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP) || defined(RKNPU_DKMS_MISCDEV_ENABLED)
 	misc_deregister(&(rknpu_dev->miscdev));
 #endif
+	/* a kick from just before rknpu_reap_close() must not outlive us */
+	flush_work(&rknpu_dev->reap_work);
+#if defined(RKNPU_DKMS_MISCDEV) && !defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+	rknpu_mem_pool_destroy(rknpu_dev->mem_pool);
+	rknpu_dev->mem_pool = NULL;
+#endif
 
 #ifndef FPGA_PLATFORM
 	rknpu_devfreq_remove(rknpu_dev);
@@ -15,8 +15,12 @@
 #include <drm/drm_file.h>
 #include <drm/drm_drv.h>
 
+#include <linux/bitmap.h>
 #include <linux/delay.h>
+#include <linux/log2.h>
 #include <linux/shmem_fs.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 #include <linux/dma-buf.h>
 #include <linux/iommu.h>
 #include <linux/version.h>
@@ -51,6 +55,21 @@ MODULE_PARM_DESC(
 
 #endif
 
+static unsigned int gem_fault_around_kb = 2048;
+module_param(gem_fault_around_kb, uint, 0644);
+MODULE_PARM_DESC(gem_fault_around_kb,
+		 "Map this aligned window (KB) around a GEM mmap fault at once, 0 = single page (default: 2048)");
+
+static unsigned int gem_iova_arena_mb;
+module_param(gem_iova_arena_mb, uint, 0644);
+MODULE_PARM_DESC(gem_iova_arena_mb,
+		 "Reserve this much IOVA (MB) per DRM file and domain on first use, and map its non-contiguous GEM buffers from it (0=disable, default=0)");
+
+static unsigned int gem_zero_cache_mb = 16;
+module_param(gem_zero_cache_mb, uint, 0644);
+MODULE_PARM_DESC(gem_zero_cache_mb,
+		 "Max MB of pre-zeroed contiguous buffers kept for RKNPU_MEM_ZEROING GEM allocations, refilled while the NPU is idle (0=disable, default=16)");
+
 #ifdef RKNPU_DKMS
 struct rknpu_dkms_gem_range {
 	struct list_head list;
@@ -157,9 +176,12 @@ static void rknpu_dkms_untrack_gem_obj(struct rknpu_gem_object *obj)
 }
 #endif
 
+/*
+ * Back non-contiguous buffers with shmem pages mapped into IOVA the driver
+ * manages itself. Also done at runtime for files with an IOVA arena.
+ */
 #define RKNPU_GEM_ALLOC_FROM_PAGES 0
 
-#if RKNPU_GEM_ALLOC_FROM_PAGES
 static int rknpu_gem_get_pages(struct rknpu_gem_object *rknpu_obj)
 {
 	struct drm_device *drm = rknpu_obj->base.dev;
@@ -194,7 +216,7 @@ static int rknpu_gem_get_pages(struct rknpu_gem_object *rknpu_obj)
 
 	ret = rknpu_iommu_dma_map_sg(drm->dev, rknpu_obj->sgt->sgl,
 				     rknpu_obj->sgt->nents, DMA_BIDIRECTIONAL,
-				     iova_aligned);
+				     iova_aligned, rknpu_obj->iova_arena);
 	if (ret == 0) {
 		ret = -EFAULT;
 		LOG_DEV_ERROR(drm->dev, "%s: dma map %zu fail\n", __func__,
@@ -225,12 +247,14 @@ static int rknpu_gem_get_pages(struct rknpu_gem_object *rknpu_obj)
 			i, &dma_addr, s->length, &phys, sg_virt(s));
 	}
 
+	rknpu_obj->from_pages = true;
+
 	return 0;
 
 unmap_sg:
 	rknpu_iommu_dma_unmap_sg(drm->dev, rknpu_obj->sgt->sgl,
 				 rknpu_obj->sgt->nents, DMA_BIDIRECTIONAL,
-				 iova_aligned);
+				 iova_aligned, rknpu_obj->iova_arena);
 
 free_sgt:
 	sg_free_table(rknpu_obj->sgt);
@@ -256,14 +280,458 @@ static void rknpu_gem_put_pages(struct rknpu_gem_object *rknpu_obj)
 	if (rknpu_obj->sgt != NULL) {
 		rknpu_iommu_dma_unmap_sg(drm->dev, rknpu_obj->sgt->sgl,
 					 rknpu_obj->sgt->nents,
-					 DMA_BIDIRECTIONAL, iova_aligned);
+					 DMA_BIDIRECTIONAL, iova_aligned,
+					 rknpu_obj->iova_arena);
 		sg_free_table(rknpu_obj->sgt);
 		kfree(rknpu_obj->sgt);
 	}
 
 	drm_gem_put_pages(&rknpu_obj->base, rknpu_obj->pages, true, true);
+	rknpu_obj->from_pages = false;
+}
+
+/*
+ * Contiguous buffer from the reserved carveout. Uncached buffers get an
+ * uncached kernel alias, like dma_alloc_attrs() would give them.
+ */
+static int rknpu_gem_alloc_carveout(struct rknpu_gem_object *rknpu_obj)
+{
+	struct drm_device *drm = rknpu_obj->base.dev;
+	struct rknpu_device *rknpu_dev = drm->dev_private;
+	unsigned int nr_pages = rknpu_obj->size >> PAGE_SHIFT;
+	bool cacheable = rknpu_obj->flags & RKNPU_MEM_CACHEABLE;
+	phys_addr_t phys;
+	struct sg_table *sgt = NULL;
+	struct page *page = NULL;
+	int ret = -ENOMEM, i = 0;
+
+	page = rknpu_carveout_alloc(rknpu_dev->carveout, rknpu_obj->size);
+	if (!page)
+		return -ENOMEM;
+	phys = page_to_phys(page);
+
+	rknpu_obj->pages = rknpu_gem_alloc_page(nr_pages);
+	if (!rknpu_obj->pages)
+		goto err_free;
+	for (i = 0; i < nr_pages; i++)
+		rknpu_obj->pages[i] = nth_page(page, i);
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		goto err_free_pages;
+	ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+	if (ret)
+		goto err_free_sgt;
+	sg_set_page(sgt->sgl, page, rknpu_obj->size, 0);
+	sg_dma_address(sgt->sgl) = phys;
+	sg_dma_len(sgt->sgl) = rknpu_obj->size;
+
+	/* Carveout memory is recycled across processes, never hand it out dirty */
+	memset(page_address(page), 0, rknpu_obj->size);
+
+	/* Write back the zeroing, drop the lines for uncached users */
+	dma_sync_single_for_device(drm->dev, phys, rknpu_obj->size,
+				   DMA_BIDIRECTIONAL);
+	if (!cacheable)
+		dma_sync_single_for_cpu(drm->dev, phys, rknpu_obj->size,
+					DMA_FROM_DEVICE);
+
+	if (cacheable) {
+		rknpu_obj->cookie = page_address(page);
+	} else if (rknpu_obj->flags & RKNPU_MEM_KERNEL_MAPPING) {
+		rknpu_obj->cookie = vmap(rknpu_obj->pages, nr_pages, VM_MAP,
+					 pgprot_dmacoherent(PAGE_KERNEL));
+		if (!rknpu_obj->cookie) {
+			ret = -ENOMEM;
+			goto err_free_table;
+		}
+	}
+	if (rknpu_obj->flags & RKNPU_MEM_KERNEL_MAPPING)
+		rknpu_obj->kv_addr = rknpu_obj->cookie;
+
+	rknpu_obj->flags |= RKNPU_MEM_CONTIGUOUS;
+	rknpu_obj->dma_addr = phys;
+	rknpu_obj->sgt = sgt;
+	rknpu_obj->carveout = true;
+
+	return 0;
+
+err_free_table:
+	sg_free_table(sgt);
+err_free_sgt:
+	kfree(sgt);
+err_free_pages:
+	rknpu_gem_free_page(rknpu_obj->pages);
+	rknpu_obj->pages = NULL;
+err_free:
+	rknpu_carveout_free(rknpu_dev->carveout, page, rknpu_obj->size);
+
+	return ret;
+}
+
+static void rknpu_gem_free_carveout(struct rknpu_gem_object *rknpu_obj)
+{
+	struct rknpu_device *rknpu_dev = rknpu_obj->base.dev->dev_private;
+
+	if (!(rknpu_obj->flags & RKNPU_MEM_CACHEABLE) && rknpu_obj->cookie)
+		vunmap(rknpu_obj->cookie);
+	rknpu_obj->cookie = NULL;
+	rknpu_obj->kv_addr = NULL;
+
+	sg_free_table(rknpu_obj->sgt);
+	kfree(rknpu_obj->sgt);
+	rknpu_obj->sgt = NULL;
+
+	rknpu_carveout_free(rknpu_dev->carveout, rknpu_obj->pages[0],
+			    rknpu_obj->size);
+	rknpu_gem_free_page(rknpu_obj->pages);
+	rknpu_obj->pages = NULL;
+	rknpu_obj->carveout = false;
+	rknpu_obj->dma_addr = 0;
+}
+
+/* Size handed to dma_alloc_attrs(), larger than @size for cached buffers */
+static inline size_t rknpu_gem_alloc_size(struct rknpu_gem_object *rknpu_obj)
+{
+	return rknpu_obj->zero_size ? rknpu_obj->zero_size : rknpu_obj->size;
+}
+
+/*
+ * Take a cached pre-zeroed buffer for @rknpu_obj, whose dma_attrs are
+ * already set up. A miss records what the class was asked for so the
+ * refill work allocates the same kind of buffer next time.
+ */
+static void *rknpu_gem_zero_cache_get(struct rknpu_gem_object *rknpu_obj,
+				      gfp_t gfp_mask)
+{
+	struct rknpu_device *rknpu_dev = rknpu_obj->base.dev->dev_private;
+	struct rknpu_gem_zero_cache *cache = rknpu_dev->zero_cache;
+	struct rknpu_gem_zero_buf *zbuf = NULL, *iter;
+	struct rknpu_gem_zero_class *class;
+	int order = get_order(rknpu_obj->size);
+	void *cookie;
+
+	if (!cache || !READ_ONCE(gem_zero_cache_mb) ||
+	    !(rknpu_obj->flags & RKNPU_MEM_ZEROING) ||
+	    !(rknpu_obj->dma_attrs & DMA_ATTR_FORCE_CONTIGUOUS) ||
+	    order > RKNPU_GEM_ZERO_MAX_ORDER)
+		return NULL;
+
+	class = &cache->classes[order];
+
+	spin_lock(&cache->lock);
+	list_for_each_entry(iter, &class->free_list, node) {
+		if (iter->dma_attrs == rknpu_obj->dma_attrs &&
+		    iter->gfp_mask == gfp_mask &&
+		    iter->iommu_domain_id == rknpu_obj->iommu_domain_id) {
+			zbuf = iter;
+			break;
+		}
+	}
+	if (zbuf) {
+		list_del(&zbuf->node);
+		class->count--;
+		cache->cached_bytes -= PAGE_SIZE << order;
+		cache->hits++;
+	} else {
+		class->dma_attrs = rknpu_obj->dma_attrs;
+		class->gfp_mask = gfp_mask;
+		class->iommu_domain_id = rknpu_obj->iommu_domain_id;
+		if (class->want < RKNPU_GEM_ZERO_MAX_DEPTH)
+			class->want++;
+		cache->misses++;
+	}
+	spin_unlock(&cache->lock);
+
+	if (!zbuf)
+		return NULL;
+
+	cookie = zbuf->cookie;
+	rknpu_obj->dma_addr = zbuf->dma_addr;
+	rknpu_obj->zero_size = PAGE_SIZE << order;
+	kfree(zbuf);
+
+	return cookie;
+}
+
+/* Caller holds a reference on the buffer's iommu domain */
+static void __rknpu_gem_zero_buf_free(struct rknpu_device *rknpu_dev,
+				      struct rknpu_gem_zero_buf *zbuf)
+{
+	dma_free_attrs(rknpu_dev->dev, PAGE_SIZE << zbuf->order, zbuf->cookie,
+		       zbuf->dma_addr, zbuf->dma_attrs);
+	kfree(zbuf);
+}
+
+static void rknpu_gem_zero_buf_free(struct rknpu_device *rknpu_dev,
+				    struct rknpu_gem_zero_buf *zbuf)
+{
+	if (rknpu_iommu_domain_get_and_switch(rknpu_dev,
+					      zbuf->iommu_domain_id)) {
+		LOG_DEV_ERROR(rknpu_dev->dev,
+			      "failed to free cached zero buffer: %pad\n",
+			      &zbuf->dma_addr);
+		kfree(zbuf);
+		return;
+	}
+
+	__rknpu_gem_zero_buf_free(rknpu_dev, zbuf);
+
+	rknpu_iommu_domain_put(rknpu_dev);
+}
+
+/*
+ * Free up to @nr_pages worth of cached buffers, largest classes first.
+ * Unless @any_domain is set, only buffers mapped in the active iommu
+ * domain are freed, under a reference taken without waiting: reclaim
+ * must neither switch domains under a job nor sleep waiting for one.
+ * Returns the number of pages freed.
+ */
+static unsigned long
+rknpu_gem_zero_cache_drain(struct rknpu_gem_zero_cache *cache,
+			   unsigned long nr_pages, bool any_domain)
+{
+	struct rknpu_device *rknpu_dev = cache->rknpu_dev;
+	int domain_id = READ_ONCE(rknpu_dev->iommu_domain_id);
+	struct rknpu_gem_zero_buf *zbuf, *tmp;
+	struct rknpu_gem_zero_class *class;
+	unsigned long freed = 0;
+	LIST_HEAD(local_list);
+	int order;
+
+	if (!any_domain && rknpu_iommu_domain_tryget(rknpu_dev, domain_id))
+		return 0;
+
+	spin_lock(&cache->lock);
+	for (order = RKNPU_GEM_ZERO_MAX_ORDER; order >= 0 && freed < nr_pages;
+	     order--) {
+		class = &cache->classes[order];
+		list_for_each_entry_safe(zbuf, tmp, &class->free_list, node) {
+			if (freed >= nr_pages)
+				break;
+			if (!any_domain && zbuf->iommu_domain_id != domain_id)
+				continue;
+			list_move(&zbuf->node, &local_list);
+			class->count--;
+			cache->cached_bytes -= PAGE_SIZE << order;
+			cache->reclaimed += PAGE_SIZE << order;
+			freed += 1UL << order;
+		}
+		/* do not refill what reclaim just took back */
+		class->want = min(class->want, class->count);
+	}
+	spin_unlock(&cache->lock);
+
+	list_for_each_entry_safe(zbuf, tmp, &local_list, node) {
+		list_del(&zbuf->node);
+		if (any_domain)
+			rknpu_gem_zero_buf_free(rknpu_dev, zbuf);
+		else
+			__rknpu_gem_zero_buf_free(rknpu_dev, zbuf);
+	}
+
+	if (!any_domain)
+		rknpu_iommu_domain_put(rknpu_dev);
+
+	return freed;
+}
+
+/*
+ * Allocate the buffers the classes are missing, smallest first, in the
+ * iommu domain that is active anyway. Runs from the power-off work and
+ * stops as soon as the NPU is powered again.
+ */
+static void rknpu_gem_zero_cache_refill(struct work_struct *work)
+{
+	struct rknpu_gem_zero_cache *cache =
+		container_of(work, struct rknpu_gem_zero_cache, refill_work);
+	struct rknpu_device *rknpu_dev = cache->rknpu_dev;
+	size_t max_bytes = (size_t)READ_ONCE(gem_zero_cache_mb) << 20;
+	int domain_id = READ_ONCE(rknpu_dev->iommu_domain_id);
+	struct rknpu_gem_zero_class *class;
+	struct rknpu_gem_zero_buf *zbuf;
+	unsigned long dma_attrs;
+	gfp_t gfp_mask;
+	bool done;
+	int order;
+
+	if (rknpu_iommu_domain_get_and_switch(rknpu_dev, domain_id))
+		return;
+
+	for (order = 0; order <= RKNPU_GEM_ZERO_MAX_ORDER; order++) {
+		class = &cache->classes[order];
+
+		while (true) {
+			spin_lock(&cache->lock);
+			done = class->count >= class->want ||
+			       class->iommu_domain_id != domain_id ||
+			       cache->cached_bytes + (PAGE_SIZE << order) >
+				       max_bytes;
+			dma_attrs = class->dma_attrs;
+			gfp_mask = class->gfp_mask;
+			spin_unlock(&cache->lock);
+			if (done)
+				break;
+
+			if (atomic_read(&rknpu_dev->power_refcount) > 0) {
+				spin_lock(&cache->lock);
+				cache->aborted++;
+				spin_unlock(&cache->lock);
+				goto out;
+			}
+
+			zbuf = kzalloc(sizeof(*zbuf), GFP_KERNEL);
+			if (!zbuf)
+				goto out;
+
+			zbuf->cookie = dma_alloc_attrs(
+				rknpu_dev->dev, PAGE_SIZE << order,
+				&zbuf->dma_addr,
+				gfp_mask | __GFP_NOWARN | __GFP_NORETRY,
+				dma_attrs);
+			if (!zbuf->cookie) {
+				kfree(zbuf);
+				goto out;
+			}
+			zbuf->dma_attrs = dma_attrs;
+			zbuf->gfp_mask = gfp_mask;
+			zbuf->iommu_domain_id = domain_id;
+			zbuf->order = order;
+
+			spin_lock(&cache->lock);
+			list_add_tail(&zbuf->node, &class->free_list);
+			class->count++;
+			cache->cached_bytes += PAGE_SIZE << order;
+			cache->refilled++;
+			spin_unlock(&cache->lock);
+
+			cond_resched();
+		}
+	}
+
+out:
+	rknpu_iommu_domain_put(rknpu_dev);
+}
+
+static unsigned long
+rknpu_gem_zero_cache_shrink_count(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct rknpu_gem_zero_cache *cache = shrinker->private_data;
+	unsigned long count = READ_ONCE(cache->cached_bytes) >> PAGE_SHIFT;
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long
+rknpu_gem_zero_cache_shrink_scan(struct shrinker *shrinker,
+				 struct shrink_control *sc)
+{
+	struct rknpu_gem_zero_cache *cache = shrinker->private_data;
+	unsigned long freed;
+
+	freed = rknpu_gem_zero_cache_drain(cache, sc->nr_to_scan, false);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+int rknpu_gem_zero_cache_create(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_gem_zero_cache *cache;
+	int order;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+
+	cache->rknpu_dev = rknpu_dev;
+	spin_lock_init(&cache->lock);
+	for (order = 0; order < RKNPU_GEM_ZERO_NUM_CLASSES; order++)
+		INIT_LIST_HEAD(&cache->classes[order].free_list);
+	INIT_WORK(&cache->refill_work, rknpu_gem_zero_cache_refill);
+
+	cache->shrinker = shrinker_alloc(0, "rknpu-gem-zero-cache");
+	if (!cache->shrinker) {
+		kfree(cache);
+		return -ENOMEM;
+	}
+
+	cache->shrinker->count_objects = rknpu_gem_zero_cache_shrink_count;
+	cache->shrinker->scan_objects = rknpu_gem_zero_cache_shrink_scan;
+	cache->shrinker->private_data = cache;
+	shrinker_register(cache->shrinker);
+
+	rknpu_dev->zero_cache = cache;
+
+	return 0;
+}
+
+/* Must run before the iommu domains are freed */
+void rknpu_gem_zero_cache_destroy(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_gem_zero_cache *cache = rknpu_dev->zero_cache;
+
+	if (cache == NULL)
+		return;
+
+	cancel_work_sync(&cache->refill_work);
+	shrinker_free(cache->shrinker);
+	rknpu_gem_zero_cache_drain(cache, ULONG_MAX, true);
+	rknpu_dev->zero_cache = NULL;
+	kfree(cache);
+}
+
+/* Called with power_lock held once the NPU has been powered off */
+void rknpu_gem_zero_cache_kick(struct rknpu_device *rknpu_dev)
+{
+	if (rknpu_dev->zero_cache && READ_ONCE(gem_zero_cache_mb))
+		queue_work(rknpu_dev->power_off_wq,
+			   &rknpu_dev->zero_cache->refill_work);
+}
+
+int rknpu_gem_zero_cache_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_gem_zero_cache *cache = rknpu_dev->zero_cache;
+	unsigned int count[RKNPU_GEM_ZERO_NUM_CLASSES];
+	unsigned int want[RKNPU_GEM_ZERO_NUM_CLASSES];
+	u64 hits, misses, refilled, aborted, reclaimed;
+	size_t cached_bytes;
+	int order;
+
+	if (cache == NULL)
+		return 0;
+
+	spin_lock(&cache->lock);
+	for (order = 0; order < RKNPU_GEM_ZERO_NUM_CLASSES; order++) {
+		count[order] = cache->classes[order].count;
+		want[order] = cache->classes[order].want;
+	}
+	cached_bytes = cache->cached_bytes;
+	hits = cache->hits;
+	misses = cache->misses;
+	refilled = cache->refilled;
+	aborted = cache->aborted;
+	reclaimed = cache->reclaimed;
+	spin_unlock(&cache->lock);
+
+	seq_printf(m, "hits: %llu, misses: %llu\n", hits, misses);
+	seq_printf(m, "refilled: %llu, aborted: %llu\n", refilled, aborted);
+	seq_printf(m, "cached: %zu KB, max: %u KB, reclaimed: %llu KB\n",
+		   cached_bytes >> 10, READ_ONCE(gem_zero_cache_mb) << 10,
+		   reclaimed >> 10);
+	for (order = 0; order < RKNPU_GEM_ZERO_NUM_CLASSES; order++) {
+		if (count[order] || want[order])
+			seq_printf(m, "[%6lu KB] cached: %u, want: %u\n",
+				   (PAGE_SIZE << order) >> 10, count[order],
+				   want[order]);
+	}
+
+	return 0;
 }
-#endif
 
 static int rknpu_gem_alloc_buf(struct rknpu_gem_object *rknpu_obj)
 {
@@ -316,12 +784,17 @@ static int rknpu_gem_alloc_buf(struct rknpu_gem_object *rknpu_obj)
 		rknpu_obj->dma_attrs |= DMA_ATTR_SKIP_ZEROING;
 #endif
 
-#if RKNPU_GEM_ALLOC_FROM_PAGES
 	if ((rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS) &&
-	    rknpu_dev->iommu_en) {
+	    rknpu_dev->iommu_en &&
+	    (RKNPU_GEM_ALLOC_FROM_PAGES || rknpu_obj->iova_arena)) {
 		return rknpu_gem_get_pages(rknpu_obj);
 	}
-#endif
+
+	/* Falls back to the page allocator once the carveout is full */
+	if (rknpu_dev->carveout &&
+	    !(rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS) &&
+	    !rknpu_gem_alloc_carveout(rknpu_obj))
+		return 0;
 
 	if (rknpu_obj->flags & RKNPU_MEM_ZEROING)
 		gfp_mask |= __GFP_ZERO;
@@ -341,9 +814,12 @@ static int rknpu_gem_alloc_buf(struct rknpu_gem_object *rknpu_obj)
 		return -ENOMEM;
 	}
 
-	rknpu_obj->cookie = dma_alloc_attrs(alloc_dev, rknpu_obj->size,
-					    &rknpu_obj->dma_addr, gfp_mask,
-					    rknpu_obj->dma_attrs);
+	rknpu_obj->cookie = rknpu_gem_zero_cache_get(rknpu_obj, gfp_mask);
+	if (!rknpu_obj->cookie)
+		rknpu_obj->cookie = dma_alloc_attrs(alloc_dev, rknpu_obj->size,
+						    &rknpu_obj->dma_addr,
+						    gfp_mask,
+						    rknpu_obj->dma_attrs);
 	if (!rknpu_obj->cookie) {
 		/*
 		 * when RKNPU_MEM_CONTIGUOUS and IOMMU is available
@@ -419,8 +895,10 @@ err_free_sg_table:
 err_free_sgt:
 	kfree(sgt);
 err_free_dma:
-	dma_free_attrs(alloc_dev, rknpu_obj->size, rknpu_obj->cookie,
-		       rknpu_obj->dma_addr, rknpu_obj->dma_attrs);
+	dma_free_attrs(alloc_dev, rknpu_gem_alloc_size(rknpu_obj),
+		       rknpu_obj->cookie, rknpu_obj->dma_addr,
+		       rknpu_obj->dma_attrs);
+	rknpu_obj->zero_size = 0;
 err_free:
 	rknpu_gem_free_page(rknpu_obj->pages);
 
@@ -434,33 +912,35 @@ static void rknpu_gem_free_buf(struct rknpu_gem_object *rknpu_obj)
 	struct rknpu_device *rknpu_dev = drm->dev_private;
 	struct device *free_dev = drm->dev;
 #endif
-#if RKNPU_GEM_ALLOC_FROM_PAGES
-	struct rknpu_device *rknpu_dev_pages = drm->dev_private;
-#endif
 
 	if (!rknpu_obj->dma_addr) {
 		LOG_DEBUG("dma handle is invalid.\n");
 		return;
 	}
 
-#if RKNPU_GEM_ALLOC_FROM_PAGES
-	if ((rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS) &&
-	    rknpu_dev_pages->iommu_en) {
+	if (rknpu_obj->carveout) {
+		rknpu_gem_free_carveout(rknpu_obj);
+		return;
+	}
+
+	if (rknpu_obj->from_pages) {
 		rknpu_gem_put_pages(rknpu_obj);
 		return;
 	}
-#endif
 
 	sg_free_table(rknpu_obj->sgt);
 	kfree(rknpu_obj->sgt);
 
 #ifdef RKNPU_DKMS
-	dma_free_attrs(free_dev, rknpu_obj->size, rknpu_obj->cookie,
-		       rknpu_obj->dma_addr, rknpu_obj->dma_attrs);
+	dma_free_attrs(free_dev, rknpu_gem_alloc_size(rknpu_obj),
+		       rknpu_obj->cookie, rknpu_obj->dma_addr,
+		       rknpu_obj->dma_attrs);
 #else
-	dma_free_attrs(drm->dev, rknpu_obj->size, rknpu_obj->cookie,
-		       rknpu_obj->dma_addr, rknpu_obj->dma_attrs);
+	dma_free_attrs(drm->dev, rknpu_gem_alloc_size(rknpu_obj),
+		       rknpu_obj->cookie, rknpu_obj->dma_addr,
+		       rknpu_obj->dma_attrs);
 #endif
+	rknpu_obj->zero_size = 0;
 
 	rknpu_gem_free_page(rknpu_obj->pages);
 
@@ -538,6 +1018,7 @@ static struct rknpu_gem_object *rknpu_gem_init(struct drm_device *drm,
 	}
 
 	rknpu_obj->size = rknpu_obj->base.size;
+	rknpu_sync_track_init(&rknpu_obj->sync_track);
 
 	gfp_mask = mapping_gfp_mask(obj->filp->f_mapping);
 
@@ -558,6 +1039,9 @@ static struct rknpu_gem_object *rknpu_gem_init(struct drm_device *drm,
 
 static void rknpu_gem_release(struct rknpu_gem_object *rknpu_obj)
 {
+	if (rknpu_obj->iova_arena)
+		rknpu_iova_arena_put(rknpu_obj->iova_arena);
+
 	/* release file pointer to gem object. */
 	drm_gem_object_release(&rknpu_obj->base);
 	kfree(rknpu_obj);
@@ -635,7 +1119,7 @@ static int rknpu_gem_alloc_buf_with_cache(struct rknpu_gem_object *rknpu_obj,
 	switch (cache_type) {
 	case RKNPU_CACHE_SRAM:
 		cache_start = rknpu_dev->sram_start;
-		cache_offset = rknpu_obj->sram_obj->range_start *
+		cache_offset = rknpu_obj->sram_obj.range_start *
 			       rknpu_dev->sram_mm->chunk_size;
 		cache_size = rknpu_obj->sram_size;
 		break;
@@ -835,10 +1319,75 @@ static void rknpu_gem_free_buf_with_cache(struct rknpu_gem_object *rknpu_obj,
 	}
 }
 
+/*
+ * Referenced IOVA arena of @file_priv for the active domain @domain_id,
+ * reserved on first use. NULL when arenas are disabled or the domain is
+ * out of IOVA space, in which case buffers allocate from the domain.
+ */
+static struct rknpu_iova_arena *
+rknpu_gem_file_arena(struct rknpu_device *rknpu_dev,
+		     struct drm_file *file_priv, int domain_id)
+{
+	struct rknpu_gem_file *gem_file = file_priv->driver_priv;
+	size_t size = (size_t)READ_ONCE(gem_iova_arena_mb) << 20;
+	struct rknpu_iova_arena *arena;
+
+	if (!size || !gem_file || domain_id < 0 ||
+	    domain_id >= RKNPU_MAX_IOMMU_DOMAIN_NUM)
+		return NULL;
+
+	mutex_lock(&gem_file->lock);
+	arena = gem_file->arenas[domain_id];
+	if (!arena) {
+		arena = rknpu_iova_arena_create(rknpu_dev, size);
+		if (!arena)
+			LOG_DEV_WARN(rknpu_dev->dev,
+				     "failed to reserve %zu KB iova arena\n",
+				     size >> 10);
+		gem_file->arenas[domain_id] = arena;
+	}
+	if (arena)
+		kref_get(&arena->ref);
+	mutex_unlock(&gem_file->lock);
+
+	return arena;
+}
+
+int rknpu_gem_open(struct drm_device *drm, struct drm_file *file_priv)
+{
+	struct rknpu_gem_file *gem_file;
+
+	gem_file = kzalloc(sizeof(*gem_file), GFP_KERNEL);
+	if (!gem_file)
+		return -ENOMEM;
+
+	mutex_init(&gem_file->lock);
+	file_priv->driver_priv = gem_file;
+
+	return 0;
+}
+
+/* Buffers still alive, e.g. exported ones, keep their arena referenced */
+void rknpu_gem_postclose(struct drm_device *drm, struct drm_file *file_priv)
+{
+	struct rknpu_gem_file *gem_file = file_priv->driver_priv;
+	int i;
+
+	for (i = 0; i < RKNPU_MAX_IOMMU_DOMAIN_NUM; i++) {
+		if (gem_file->arenas[i])
+			rknpu_iova_arena_put(gem_file->arenas[i]);
+	}
+
+	mutex_destroy(&gem_file->lock);
+	kfree(gem_file);
+	file_priv->driver_priv = NULL;
+}
+
 struct rknpu_gem_object *
-rknpu_gem_object_create(struct drm_device *drm, unsigned int flags,
-			unsigned long size, unsigned long sram_size,
-			int iommu_domain_id, unsigned int core_mask)
+rknpu_gem_object_create(struct drm_device *drm, struct drm_file *file_priv,
+			unsigned int flags, unsigned long size,
+			unsigned long sram_size, int iommu_domain_id,
+			unsigned int core_mask)
 {
 	struct rknpu_device *rknpu_dev = drm->dev_private;
 	struct rknpu_gem_object *rknpu_obj = NULL;
@@ -877,6 +1426,11 @@ rknpu_gem_object_create(struct drm_device *drm, unsigned int flags,
 	/* set memory type and cache attribute from user side. */
 	rknpu_obj->flags = flags;
 
+	if (file_priv && rknpu_dev->iommu_en &&
+	    (flags & RKNPU_MEM_NON_CONTIGUOUS))
+		rknpu_obj->iova_arena = rknpu_gem_file_arena(
+			rknpu_dev, file_priv, iommu_domain_id);
+
 	if (IS_ENABLED(CONFIG_ROCKCHIP_RKNPU_SRAM) &&
 	    (flags & RKNPU_MEM_TRY_ALLOC_SRAM) && rknpu_dev->sram_size > 0) {
 		size_t sram_free_size = 0;
@@ -887,8 +1441,8 @@ rknpu_gem_object_create(struct drm_device *drm, unsigned int flags,
 
 		rknpu_obj->cache_with_sgt = 0;
 
-		sram_free_size = rknpu_dev->sram_mm->free_chunks *
-				 rknpu_dev->sram_mm->chunk_size;
+		/* Only as much as one free extent holds, not the total free */
+		sram_free_size = rknpu_mm_largest_free(rknpu_dev->sram_mm);
 		if (sram_free_size > 0) {
 			real_sram_size = remain_ddr_size;
 			if (sram_size != 0 && remain_ddr_size > sram_size)
@@ -896,7 +1450,7 @@ rknpu_gem_object_create(struct drm_device *drm, unsigned int flags,
 			if (real_sram_size > sram_free_size)
 				real_sram_size = sram_free_size;
 			ret = rknpu_mm_alloc(rknpu_dev->sram_mm, real_sram_size,
-					     &rknpu_obj->sram_obj);
+					     0, &rknpu_obj->sram_obj);
 			if (ret != 0) {
 				sram_free_size =
 					rknpu_dev->sram_mm->free_chunks *
@@ -966,9 +1520,8 @@ rknpu_gem_object_create(struct drm_device *drm, unsigned int flags,
 	return rknpu_obj;
 
 mm_free:
-	if (IS_ENABLED(CONFIG_ROCKCHIP_RKNPU_SRAM) &&
-	    rknpu_obj->sram_obj != NULL)
-		rknpu_mm_free(rknpu_dev->sram_mm, rknpu_obj->sram_obj);
+	if (IS_ENABLED(CONFIG_ROCKCHIP_RKNPU_SRAM))
+		rknpu_mm_free(rknpu_dev->sram_mm, &rknpu_obj->sram_obj);
 
 gem_release:
 	rknpu_gem_release(rknpu_obj);
@@ -1015,9 +1568,8 @@ void rknpu_gem_object_destroy(struct rknpu_gem_object *rknpu_obj)
 	} else {
 		if (IS_ENABLED(CONFIG_ROCKCHIP_RKNPU_SRAM) &&
 		    rknpu_obj->sram_size > 0) {
-			if (rknpu_obj->sram_obj != NULL)
-				rknpu_mm_free(rknpu_dev->sram_mm,
-					      rknpu_obj->sram_obj);
+			rknpu_mm_free(rknpu_dev->sram_mm,
+				      &rknpu_obj->sram_obj);
 			rknpu_gem_free_buf_with_cache(rknpu_obj,
 						      RKNPU_CACHE_SRAM);
 		} else if (IS_ENABLED(CONFIG_NO_GKI) &&
@@ -1040,12 +1592,22 @@ int rknpu_gem_create_ioctl(struct drm_device *drm, void *data,
 	struct rknpu_gem_object *rknpu_obj = NULL;
 	int ret = -EINVAL;
 
+	/* User memory can only be wrapped through the misc device */
+	if (args->flags & RKNPU_MEM_USERPTR)
+		return -EINVAL;
+
 	rknpu_obj = rknpu_gem_object_find(file_priv, args->handle);
 	if (!rknpu_obj) {
-		rknpu_obj = rknpu_gem_object_create(drm, args->flags,
-						    args->size, args->sram_size,
-						    args->iommu_domain_id,
-						    args->core_mask);
+		rknpu_obj = rknpu_gem_object_create(
+			drm, file_priv, args->flags, args->size,
+			args->sram_size, args->iommu_domain_id,
+			args->core_mask);
+		/* freed buffers may still be on their way out, wait for them */
+		if (IS_ERR(rknpu_obj) && rknpu_reap_flush(drm->dev_private))
+			rknpu_obj = rknpu_gem_object_create(
+				drm, file_priv, args->flags, args->size,
+				args->sram_size, args->iommu_domain_id,
+				args->core_mask);
 		if (IS_ERR(rknpu_obj))
 			return PTR_ERR(rknpu_obj);
 
@@ -1119,7 +1681,9 @@ int rknpu_gem_destroy_ioctl(struct drm_device *drm, void *data,
 	} while (ret);
 
 #ifdef RKNPU_DKMS
-	rknpu_dkms_untrack_gem_obj(rknpu_obj);
+	/* A published buffer stays tracked until its last handle goes */
+	if (!rknpu_obj->share || rknpu_obj->base.handle_count <= 1)
+		rknpu_dkms_untrack_gem_obj(rknpu_obj);
 #endif
 
 	ret = rknpu_gem_handle_destroy(file_priv, args->handle);
@@ -1129,7 +1693,6 @@ int rknpu_gem_destroy_ioctl(struct drm_device *drm, void *data,
 	return ret;
 }
 
-#if RKNPU_GEM_ALLOC_FROM_PAGES
 /*
  * __vm_map_pages - maps range of kernel pages into user vma
  * @vma: user vma to map to
@@ -1182,7 +1745,6 @@ static int rknpu_gem_mmap_pages(struct rknpu_gem_object *rknpu_obj,
 
 	return ret;
 }
-#endif
 
 static int rknpu_remap_pfn_with_cache_sgt(struct rknpu_device *rknpu_dev,
 					  struct rknpu_gem_object *rknpu_obj,
@@ -1249,7 +1811,7 @@ static int rknpu_gem_mmap_cache(struct rknpu_gem_object *rknpu_obj,
 	switch (cache_type) {
 	case RKNPU_CACHE_SRAM:
 		cache_start = rknpu_dev->sram_start;
-		cache_offset = rknpu_obj->sram_obj->range_start *
+		cache_offset = rknpu_obj->sram_obj.range_start *
 			       rknpu_dev->sram_mm->chunk_size;
 		cache_size = rknpu_obj->sram_size;
 		break;
@@ -1332,12 +1894,18 @@ static int rknpu_gem_mmap_buffer(struct rknpu_gem_object *rknpu_obj,
 	else if (rknpu_obj->nbuf_size > 0)
 		return rknpu_gem_mmap_cache(rknpu_obj, vma, RKNPU_CACHE_NBUF);
 
-#if RKNPU_GEM_ALLOC_FROM_PAGES
-	if ((rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS) &&
-	    rknpu_dev->iommu_en) {
+	if (rknpu_obj->from_pages)
 		return rknpu_gem_mmap_pages(rknpu_obj, vma);
+
+	if (rknpu_obj->carveout) {
+		if (rknpu_obj->flags & RKNPU_MEM_WRITE_COMBINE)
+			vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+		else if (!(rknpu_obj->flags & RKNPU_MEM_CACHEABLE))
+			vma->vm_page_prot = pgprot_dmacoherent(vma->vm_page_prot);
+		return remap_pfn_range(vma, vma->vm_start,
+				       page_to_pfn(rknpu_obj->pages[0]), vm_size,
+				       vma->vm_page_prot);
 	}
-#endif
 
 	ret = dma_mmap_attrs(drm->dev, vma, rknpu_obj->cookie,
 			     rknpu_obj->dma_addr, rknpu_obj->size,
@@ -1350,9 +1918,25 @@ static int rknpu_gem_mmap_buffer(struct rknpu_gem_object *rknpu_obj,
 	return 0;
 }
 
+static void rknpu_gem_reap_free(struct rknpu_reap_item *item)
+{
+	rknpu_gem_object_destroy(
+		container_of(item, struct rknpu_gem_object, reap));
+}
+
 void rknpu_gem_free_object(struct drm_gem_object *obj)
 {
-	rknpu_gem_object_destroy(to_rknpu_obj(obj));
+	struct rknpu_gem_object *rknpu_obj = to_rknpu_obj(obj);
+	struct rknpu_device *rknpu_dev = obj->dev->dev_private;
+
+	if (rknpu_obj->share)
+		rknpu_share_del(rknpu_obj->share);
+
+	/* The last reference goes away with the handle or the file */
+	rknpu_obj->reap.size = rknpu_obj->size;
+	rknpu_obj->reap.free = rknpu_gem_reap_free;
+	if (!rknpu_reap_defer(rknpu_dev, &rknpu_obj->reap))
+		rknpu_gem_object_destroy(rknpu_obj);
 }
 
 int rknpu_gem_dumb_create(struct drm_file *file_priv, struct drm_device *drm,
@@ -1376,7 +1960,8 @@ int rknpu_gem_dumb_create(struct drm_file *file_priv, struct drm_device *drm,
 	else
 		flags = RKNPU_MEM_CONTIGUOUS | RKNPU_MEM_WRITE_COMBINE;
 
-	rknpu_obj = rknpu_gem_object_create(drm, flags, args->size, 0, 0, 0);
+	rknpu_obj = rknpu_gem_object_create(drm, file_priv, flags, args->size,
+					    0, 0, 0);
 	if (IS_ERR(rknpu_obj)) {
 		LOG_DEV_ERROR(drm->dev, "gem object allocate failed.\n");
 		return PTR_ERR(rknpu_obj);
@@ -1421,14 +2006,29 @@ int rknpu_gem_dumb_map_offset(struct drm_file *file_priv,
 #endif
 
 #if KERNEL_VERSION(4, 15, 0) <= LINUX_VERSION_CODE
+static vm_fault_t rknpu_gem_insert_page(struct vm_area_struct *vma,
+					struct rknpu_gem_object *rknpu_obj,
+					unsigned long addr)
+{
+	pgoff_t page_offset = (addr - vma->vm_start) >> PAGE_SHIFT;
+	unsigned long pfn = page_to_pfn(rknpu_obj->pages[page_offset]);
+
+	addr &= PAGE_MASK;
+	if (vma->vm_flags & VM_PFNMAP)
+		return vmf_insert_pfn(vma, addr, pfn);
+
+	return vmf_insert_mixed(vma, addr, RKNPU_PFN_ARG(pfn));
+}
+
 vm_fault_t rknpu_gem_fault(struct vm_fault *vmf)
 {
 	struct vm_area_struct *vma = vmf->vma;
 	struct drm_gem_object *obj = vma->vm_private_data;
 	struct rknpu_gem_object *rknpu_obj = to_rknpu_obj(obj);
 	struct drm_device *drm = rknpu_obj->base.dev;
-	unsigned long pfn = 0;
+	unsigned long window, start, end, addr;
 	pgoff_t page_offset = 0;
+	vm_fault_t ret;
 
 	page_offset = (vmf->address - vma->vm_start) >> PAGE_SHIFT;
 
@@ -1437,9 +2037,33 @@ vm_fault_t rknpu_gem_fault(struct vm_fault *vmf)
 		return VM_FAULT_SIGBUS;
 	}
 
-	pfn = page_to_pfn(rknpu_obj->pages[page_offset]);
-	return vmf_insert_mixed(vma, vmf->address,
-				RKNPU_PFN_ARG(pfn));
+	/* Mappings are zapped by a full clean, see rknpu_gem_sync_obj() */
+	WRITE_ONCE(rknpu_obj->cpu_touched, true);
+
+	ret = rknpu_gem_insert_page(vma, rknpu_obj, vmf->address);
+	if (ret != VM_FAULT_NOPAGE)
+		return ret;
+
+	/*
+	 * Large tensors are walked linearly by CPU pre-processing, so map
+	 * the whole aligned window now instead of taking a fault per page.
+	 */
+	window = (unsigned long)gem_fault_around_kb << 10;
+	if (window <= PAGE_SIZE)
+		return ret;
+	window = rounddown_pow_of_two(window);
+
+	start = max(ALIGN_DOWN(vmf->address, window), vma->vm_start);
+	end = min3(ALIGN_DOWN(vmf->address, window) + window, vma->vm_end,
+		   vma->vm_start + rknpu_obj->size);
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		if (addr == (vmf->address & PAGE_MASK))
+			continue;
+		if (rknpu_gem_insert_page(vma, rknpu_obj, addr) & VM_FAULT_ERROR)
+			break;
+	}
+
+	return ret;
 }
 #elif KERNEL_VERSION(4, 14, 0) <= LINUX_VERSION_CODE
 int rknpu_gem_fault(struct vm_fault *vmf)
@@ -1519,6 +2143,15 @@ int rknpu_gem_mmap_obj(struct drm_gem_object *obj, struct vm_area_struct *vma)
 
 	LOG_DEBUG("flags: %#x\n", rknpu_obj->flags);
 
+	/* Published buffers only get new read-only mappings */
+	if (rknpu_obj->share) {
+		if (vma->vm_flags & VM_WRITE) {
+			ret = -EPERM;
+			goto err_close_vm;
+		}
+		vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
 	/* non-cacheable as default. */
 	if (rknpu_obj->flags & RKNPU_MEM_CACHEABLE) {
 		vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
@@ -1559,7 +2192,19 @@ int rknpu_gem_mmap(struct file *filp, struct vm_area_struct *vma)
 	if (obj->import_attach)
 		return dma_buf_mmap(obj->dma_buf, vma, 0);
 
-	return rknpu_gem_mmap_obj(obj, vma);
+	ret = rknpu_gem_mmap_obj(obj, vma);
+	if (ret)
+		return ret;
+
+	/*
+	 * Link the vma into the object's own address_space, so a clean that
+	 * re-arms CPU access tracking can zap it whatever vm_pgoff the
+	 * mapping above left (remap_pfn_range() keeps the pfn there).
+	 */
+	vma_set_file(vma, obj->filp);
+	WRITE_ONCE(to_rknpu_obj(obj)->cpu_touched, true);
+
+	return 0;
 }
 
 /* low-level interface prime helpers */
@@ -1590,6 +2235,7 @@ rknpu_gem_prime_import_sg_table(struct drm_device *dev,
 				struct dma_buf_attachment *attach,
 				struct sg_table *sgt)
 {
+	struct rknpu_device *rknpu_dev = dev->dev_private;
 	struct rknpu_gem_object *rknpu_obj = NULL;
 	int npages = 0;
 	int ret = -EINVAL;
@@ -1620,17 +2266,23 @@ rknpu_gem_prime_import_sg_table(struct drm_device *dev,
 
 	rknpu_obj->sgt = sgt;
 
-	if (sgt->nents == 1) {
-		/* always physically continuous memory if sgt->nents is 1. */
+	if (rknpu_sgt_dma_contiguous(sgt)) {
+		/* one linear DMA range, whatever the exporter's layout is */
 		rknpu_obj->flags |= RKNPU_MEM_CONTIGUOUS;
-	} else {
+	} else if (rknpu_dev->iommu_en) {
 		/*
 		 * this case could be CONTIG or NONCONTIG type but for now
 		 * sets NONCONTIG.
-		 * TODO. we have to find a way that exporter can notify
-		 * the type of its own buffer to importer.
 		 */
 		rknpu_obj->flags |= RKNPU_MEM_NON_CONTIGUOUS;
+	} else {
+		/*
+		 * The NPU cannot walk a scattered buffer without an IOMMU, and
+		 * a GEM import has no way to opt into a RKNPU_MEM_SHADOW copy.
+		 */
+		LOG_ERROR("scattered dma-buf import without iommu\n");
+		ret = -EINVAL;
+		goto err_free_large;
 	}
 
 	return &rknpu_obj->base;
@@ -1699,6 +2351,47 @@ int rknpu_gem_prime_mmap(struct drm_gem_object *obj, struct vm_area_struct *vma)
 	return rknpu_gem_mmap_obj(obj, vma);
 }
 
+struct rknpu_cache_range {
+	void __iomem *start;
+	uint32_t dir;
+};
+
+static void rknpu_cache_range_chunk(void *data, unsigned long offset,
+				    unsigned long size)
+{
+	struct rknpu_cache_range *range = data;
+	void __iomem *start = range->start + offset;
+
+	if (range->dir & RKNPU_MEM_SYNC_TO_DEVICE) {
+#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
+		__dma_map_area(start, size, DMA_TO_DEVICE);
+#else
+		dcache_clean_poc((unsigned long)start,
+				 (unsigned long)start + size);
+#endif
+	}
+
+	if (range->dir & RKNPU_MEM_SYNC_FROM_DEVICE) {
+#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
+		__dma_unmap_area(start, size, DMA_FROM_DEVICE);
+#else
+		dcache_inval_poc((unsigned long)start,
+				 (unsigned long)start + size);
+#endif
+	}
+}
+
+static void rknpu_cache_range_sync(void __iomem *start, unsigned long length,
+				   uint32_t dir)
+{
+	struct rknpu_cache_range range = {
+		.start = start,
+		.dir = dir,
+	};
+
+	rknpu_cache_op_parallel(rknpu_cache_range_chunk, &range, length);
+}
+
 static int rknpu_cache_sync_with_sg(struct rknpu_device *rknpu_dev,
 				    struct rknpu_gem_object *rknpu_obj,
 				    unsigned long *length,
@@ -1726,27 +2419,7 @@ static int rknpu_cache_sync_with_sg(struct rknpu_device *rknpu_dev,
 		cache_length = (*offset + *length) <= s->length ?
 				       *length :
 				       s->length - *offset;
-		if (dir & RKNPU_MEM_SYNC_TO_DEVICE) {
-#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
-			__dma_map_area(cache_start, cache_length,
-				       DMA_TO_DEVICE);
-#else
-			dcache_clean_poc((unsigned long)cache_start,
-					 (unsigned long)cache_start +
-						 cache_length);
-#endif
-		}
-
-		if (dir & RKNPU_MEM_SYNC_FROM_DEVICE) {
-#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
-			__dma_unmap_area(cache_start, cache_length,
-					 DMA_FROM_DEVICE);
-#else
-			dcache_inval_poc((unsigned long)cache_start,
-					 (unsigned long)cache_start +
-						 cache_length);
-#endif
-		}
+		rknpu_cache_range_sync(cache_start, cache_length, dir);
 
 		*length = (*offset + *length) <= s->length ?
 				  0 :
@@ -1775,7 +2448,7 @@ static int rknpu_cache_sync(struct rknpu_gem_object *rknpu_obj,
 	switch (cache_type) {
 	case RKNPU_CACHE_SRAM:
 		cache_base_io = rknpu_dev->sram_base_io;
-		cache_offset = rknpu_obj->sram_obj->range_start *
+		cache_offset = rknpu_obj->sram_obj.range_start *
 			       rknpu_dev->sram_mm->chunk_size;
 		cache_size = rknpu_obj->sram_size;
 		break;
@@ -1799,27 +2472,7 @@ static int rknpu_cache_sync(struct rknpu_gem_object *rknpu_obj,
 		cache_length = (*offset + *length) <= cache_size ?
 				       *length :
 				       cache_size - *offset;
-		if (dir & RKNPU_MEM_SYNC_TO_DEVICE) {
-#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
-			__dma_map_area(cache_start, cache_length,
-				       DMA_TO_DEVICE);
-#else
-			dcache_clean_poc((unsigned long)cache_start,
-					 (unsigned long)cache_start +
-						 cache_length);
-#endif
-		}
-
-		if (dir & RKNPU_MEM_SYNC_FROM_DEVICE) {
-#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
-			__dma_unmap_area(cache_start, cache_length,
-					 DMA_FROM_DEVICE);
-#else
-			dcache_inval_poc((unsigned long)cache_start,
-					 (unsigned long)cache_start +
-						 cache_length);
-#endif
-		}
+		rknpu_cache_range_sync(cache_start, cache_length, dir);
 
 		*length = (*offset + *length) <= cache_size ?
 				  0 :
@@ -1833,52 +2486,63 @@ static int rknpu_cache_sync(struct rknpu_gem_object *rknpu_obj,
 	return 0;
 }
 
-int rknpu_gem_sync_ioctl(struct drm_device *dev, void *data,
-			 struct drm_file *file_priv)
+/*
+ * CPU access is only observable through the zap/refault of the DRM mmap,
+ * so the buffer has to be private to this driver and fully page backed.
+ */
+static bool rknpu_gem_sync_tracked(struct rknpu_gem_object *rknpu_obj)
 {
-	struct rknpu_gem_object *rknpu_obj = NULL;
-	struct rknpu_device *rknpu_dev = dev->dev_private;
-	struct rknpu_mem_sync *args = data;
+	return rknpu_obj->pages && !rknpu_obj->base.import_attach &&
+	       !rknpu_obj->base.dma_buf && !rknpu_obj->sram_size &&
+	       !rknpu_obj->nbuf_size;
+}
+
+void rknpu_gem_sync_obj(struct rknpu_device *rknpu_dev,
+			struct rknpu_gem_object *rknpu_obj,
+			struct rknpu_mem_sync *args)
+{
+	struct drm_device *dev = rknpu_dev->drm_dev;
 	struct scatterlist *sg;
 	dma_addr_t sg_phys_addr;
 	unsigned long length, offset = 0;
 	unsigned long sg_offset, sg_left, size = 0;
 	unsigned long len = 0;
+	struct rknpu_mem_sync sync = *args;
+	bool tracked = rknpu_gem_sync_tracked(rknpu_obj);
+	bool full = tracked && args->offset == 0 &&
+		    PAGE_ALIGN(args->size) >= rknpu_obj->size;
+	bool cpu_touched;
+	u64 seq;
 	int i;
 
-	rknpu_obj = (struct rknpu_gem_object *)(uintptr_t)args->obj_addr;
-	if (!rknpu_obj)
-		return -EINVAL;
-
-#ifdef RKNPU_DKMS
-	LOG_DEBUG(
-		"DKMS: MEM_SYNC obj=%p dma_addr=%#llx size=%llu offset=%llu flags=%#x obj_flags=%#x noncontig=%d\n",
-		rknpu_obj, (unsigned long long)rknpu_obj->dma_addr,
-		(unsigned long long)args->size,
-		(unsigned long long)args->offset, args->flags, rknpu_obj->flags,
-		!!(rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS));
-#endif
+	mutex_lock(&rknpu_obj->sync_track.lock);
 
-	if (!(rknpu_obj->flags & RKNPU_MEM_CACHEABLE))
-		return -EINVAL;
+	cpu_touched = READ_ONCE(rknpu_obj->cpu_touched);
+	sync.flags = rknpu_sync_track_begin(rknpu_dev, &rknpu_obj->sync_track,
+					    tracked, cpu_touched, args, &seq);
+	if (!sync.flags)
+		goto out_unlock;
+	args = &sync;
 
-	if (rknpu_iommu_domain_get_and_switch(rknpu_dev,
-					      rknpu_obj->iommu_domain_id)) {
-		LOG_DEV_ERROR(rknpu_dev->dev, "%s error\n", __func__);
-		return -EINVAL;
+	/*
+	 * Re-arm CPU access detection before cleaning, see rknpu_gem_fault().
+	 * Untouched buffers have no user PTEs left since the last zap.
+	 */
+	if (full && cpu_touched && (args->flags & RKNPU_MEM_SYNC_TO_DEVICE)) {
+		WRITE_ONCE(rknpu_obj->cpu_touched, false);
+		unmap_mapping_range(rknpu_obj->base.filp->f_mapping, 0, 0, 1);
 	}
 
 	if (!(rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS)) {
 		if (args->flags & RKNPU_MEM_SYNC_TO_DEVICE) {
-			dma_sync_single_range_for_device(
-				dev->dev, rknpu_obj->dma_addr, args->offset,
-				args->size, DMA_TO_DEVICE);
+			rknpu_dma_sync_range(dev->dev, rknpu_obj->dma_addr,
+					     args->offset, args->size,
+					     DMA_TO_DEVICE, false);
 		}
 		if (args->flags & RKNPU_MEM_SYNC_FROM_DEVICE) {
-			dma_sync_single_range_for_cpu(dev->dev,
-						      rknpu_obj->dma_addr,
-						      args->offset, args->size,
-						      DMA_FROM_DEVICE);
+			rknpu_dma_sync_range(dev->dev, rknpu_obj->dma_addr,
+					     args->offset, args->size,
+					     DMA_FROM_DEVICE, true);
 		}
 	} else {
 		WARN_ON(!rknpu_dev->fake_dev);
@@ -1931,15 +2595,17 @@ int rknpu_gem_sync_ioctl(struct drm_device *dev, void *data,
 			size = (length < sg_left) ? length : sg_left;
 
 			if (args->flags & RKNPU_MEM_SYNC_TO_DEVICE) {
-				dma_sync_single_range_for_device(
-					rknpu_dev->fake_dev, sg_phys_addr,
-					sg_offset, size, DMA_TO_DEVICE);
+				rknpu_dma_sync_range(rknpu_dev->fake_dev,
+						     sg_phys_addr, sg_offset,
+						     size, DMA_TO_DEVICE,
+						     false);
 			}
 
 			if (args->flags & RKNPU_MEM_SYNC_FROM_DEVICE) {
-				dma_sync_single_range_for_cpu(
-					rknpu_dev->fake_dev, sg_phys_addr,
-					sg_offset, size, DMA_FROM_DEVICE);
+				rknpu_dma_sync_range(rknpu_dev->fake_dev,
+						     sg_phys_addr, sg_offset,
+						     size, DMA_FROM_DEVICE,
+						     true);
 			}
 
 			offset += size;
@@ -1947,7 +2613,365 @@ int rknpu_gem_sync_ioctl(struct drm_device *dev, void *data,
 		}
 	}
 
+	rknpu_sync_track_end(&rknpu_obj->sync_track, args->flags, full, seq);
+out_unlock:
+	mutex_unlock(&rknpu_obj->sync_track.lock);
+}
+
+int rknpu_gem_sync_ioctl(struct drm_device *dev, void *data,
+			 struct drm_file *file_priv)
+{
+	struct rknpu_gem_object *rknpu_obj = NULL;
+	struct rknpu_device *rknpu_dev = dev->dev_private;
+	struct rknpu_mem_sync *args = data;
+	struct drm_gem_object *obj = NULL;
+	int ret = 0;
+
+	obj = drm_gem_object_lookup(file_priv, args->handle);
+	if (!obj)
+		return -EINVAL;
+
+	rknpu_obj = to_rknpu_obj(obj);
+
+#ifdef RKNPU_DKMS
+	LOG_DEBUG(
+		"DKMS: MEM_SYNC obj=%p dma_addr=%#llx size=%llu offset=%llu flags=%#x obj_flags=%#x noncontig=%d\n",
+		rknpu_obj, (unsigned long long)rknpu_obj->dma_addr,
+		(unsigned long long)args->size,
+		(unsigned long long)args->offset, args->flags, rknpu_obj->flags,
+		!!(rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS));
+#endif
+
+	if (!(rknpu_obj->flags & RKNPU_MEM_CACHEABLE)) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	if (rknpu_iommu_domain_get_and_switch(rknpu_dev,
+					      rknpu_obj->iommu_domain_id)) {
+		LOG_DEV_ERROR(rknpu_dev->dev, "%s error\n", __func__);
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	rknpu_gem_sync_obj(rknpu_dev, rknpu_obj, args);
+
 	rknpu_iommu_domain_put(rknpu_dev);
 
+out_put:
+	rknpu_gem_object_put(obj);
+
+	return ret;
+}
+
+/*
+ * Look up the GEM handle of every entry of @syncs in @file_priv, taking a
+ * reference on each object. An unknown handle fails the lookup with
+ * nothing referenced.
+ */
+int rknpu_gem_lookup_syncs(struct drm_file *file_priv,
+			   struct rknpu_mem_sync *syncs, unsigned int count,
+			   struct rknpu_gem_object **rknpu_objs)
+{
+	struct drm_gem_object *obj = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		obj = drm_gem_object_lookup(file_priv, syncs[i].handle);
+		if (!obj) {
+			rknpu_gem_put_syncs(rknpu_objs, i);
+			return -EINVAL;
+		}
+		rknpu_objs[i] = to_rknpu_obj(obj);
+	}
+
+	return 0;
+}
+
+void rknpu_gem_put_syncs(struct rknpu_gem_object **rknpu_objs,
+			 unsigned int count)
+{
+	while (count--) {
+		rknpu_gem_object_put(&rknpu_objs[count]->base);
+		rknpu_objs[count] = NULL;
+	}
+}
+
+int rknpu_gem_sync_vec_ioctl(struct drm_device *dev, void *data,
+			     struct drm_file *file_priv)
+{
+	struct rknpu_device *rknpu_dev = dev->dev_private;
+	struct rknpu_mem_sync_vec *args = data;
+	struct rknpu_gem_object **rknpu_objs = NULL;
+	struct rknpu_gem_object *rknpu_obj = NULL;
+	struct rknpu_mem_sync *syncs;
+	int domain_id = -1;
+	int ret = 0;
+	int i;
+
+	if (args->count == 0)
+		return 0;
+	if (args->count > RKNPU_MEM_SYNC_VEC_MAX)
+		return -EINVAL;
+
+	syncs = memdup_user(u64_to_user_ptr(args->syncs),
+			    args->count * sizeof(struct rknpu_mem_sync));
+	if (IS_ERR(syncs))
+		return PTR_ERR(syncs);
+
+	rknpu_objs = kcalloc(args->count, sizeof(*rknpu_objs), GFP_KERNEL);
+	if (!rknpu_objs) {
+		ret = -ENOMEM;
+		goto out_free_syncs;
+	}
+
+	/* Validate everything first so a bad entry syncs nothing */
+	ret = rknpu_gem_lookup_syncs(file_priv, syncs, args->count,
+				     rknpu_objs);
+	if (ret)
+		goto out_free_objs;
+
+	for (i = 0; i < args->count; i++) {
+		if (!(rknpu_objs[i]->flags & RKNPU_MEM_CACHEABLE)) {
+			ret = -EINVAL;
+			goto out_put_objs;
+		}
+	}
+
+	/*
+	 * Only switch the iommu domain when it changes between entries, a
+	 * run of buffers in the same domain shares one get/put.
+	 */
+	for (i = 0; i < args->count; i++) {
+		rknpu_obj = rknpu_objs[i];
+
+		if (rknpu_obj->iommu_domain_id != domain_id) {
+			if (domain_id >= 0)
+				rknpu_iommu_domain_put(rknpu_dev);
+			domain_id = -1;
+			if (rknpu_iommu_domain_get_and_switch(
+				    rknpu_dev, rknpu_obj->iommu_domain_id)) {
+				LOG_DEV_ERROR(rknpu_dev->dev, "%s error\n",
+					      __func__);
+				ret = -EINVAL;
+				goto out_put_objs;
+			}
+			domain_id = rknpu_obj->iommu_domain_id;
+		}
+
+		rknpu_gem_sync_obj(rknpu_dev, rknpu_obj, &syncs[i]);
+	}
+
+	if (domain_id >= 0)
+		rknpu_iommu_domain_put(rknpu_dev);
+
+out_put_objs:
+	rknpu_gem_put_syncs(rknpu_objs, args->count);
+out_free_objs:
+	kfree(rknpu_objs);
+out_free_syncs:
+	kfree(syncs);
+
+	return ret;
+}
+
+/*
+ * Create every buffer of the array, undoing the ones this call created
+ * if any entry fails. Entries naming an existing handle only report it.
+ */
+int rknpu_gem_create_vec_ioctl(struct drm_device *dev, void *data,
+			       struct drm_file *file_priv)
+{
+	struct rknpu_mem_create_vec *args = data;
+	struct rknpu_mem_create *creates;
+	struct rknpu_mem_destroy destroy;
+	unsigned long *created;
+	int ret = 0;
+	int i;
+
+	if (args->count == 0)
+		return 0;
+	if (args->count > RKNPU_MEM_VEC_MAX)
+		return -EINVAL;
+
+	creates = memdup_user(u64_to_user_ptr(args->creates),
+			      args->count * sizeof(struct rknpu_mem_create));
+	if (IS_ERR(creates))
+		return PTR_ERR(creates);
+
+	created = bitmap_zalloc(args->count, GFP_KERNEL);
+	if (!created) {
+		ret = -ENOMEM;
+		goto out_free_creates;
+	}
+
+	for (i = 0; i < args->count; i++) {
+		if (!rknpu_gem_object_find(file_priv, creates[i].handle))
+			__set_bit(i, created);
+		ret = rknpu_gem_create_ioctl(dev, &creates[i], file_priv);
+		if (ret) {
+			__clear_bit(i, created);
+			goto err_rollback;
+		}
+	}
+
+	if (copy_to_user(u64_to_user_ptr(args->creates), creates,
+			 args->count * sizeof(struct rknpu_mem_create))) {
+		ret = -EFAULT;
+		goto err_rollback;
+	}
+
+	goto out_free_created;
+
+err_rollback:
+	for_each_set_bit(i, created, args->count) {
+		destroy.handle = creates[i].handle;
+		rknpu_gem_destroy_ioctl(dev, &destroy, file_priv);
+	}
+
+out_free_created:
+	bitmap_free(created);
+
+out_free_creates:
+	kfree(creates);
+
+	return ret;
+}
+
+/*
+ * Destroy every handle of the array. All handles are looked up first, so
+ * an unknown or repeated handle destroys nothing.
+ */
+int rknpu_gem_destroy_vec_ioctl(struct drm_device *dev, void *data,
+				struct drm_file *file_priv)
+{
+	struct rknpu_mem_destroy_vec *args = data;
+	struct rknpu_mem_destroy *destroys;
+	int ret = 0;
+	int i, j;
+
+	if (args->count == 0)
+		return 0;
+	if (args->count > RKNPU_MEM_VEC_MAX)
+		return -EINVAL;
+
+	destroys = memdup_user(u64_to_user_ptr(args->destroys),
+			       args->count * sizeof(struct rknpu_mem_destroy));
+	if (IS_ERR(destroys))
+		return PTR_ERR(destroys);
+
+	for (i = 0; i < args->count; i++) {
+		if (!rknpu_gem_object_find(file_priv, destroys[i].handle)) {
+			ret = -EINVAL;
+			goto out_free_destroys;
+		}
+		for (j = 0; j < i; j++) {
+			if (destroys[j].handle == destroys[i].handle) {
+				ret = -EINVAL;
+				goto out_free_destroys;
+			}
+		}
+	}
+
+	/* Keep going past a failed entry, report the first error */
+	for (i = 0; i < args->count; i++) {
+		int err = rknpu_gem_destroy_ioctl(dev, &destroys[i], file_priv);
+
+		if (err && !ret)
+			ret = err;
+	}
+
+out_free_destroys:
+	kfree(destroys);
+
+	return ret;
+}
+
+/*
+ * Publish the buffer behind args->handle under args->name. The entry
+ * does not pin the object, it goes away when the last handle on the
+ * buffer does.
+ */
+int rknpu_gem_publish_ioctl(struct drm_device *dev, void *data,
+			    struct drm_file *file_priv)
+{
+	struct rknpu_device *rknpu_dev = dev->dev_private;
+	struct rknpu_mem_share *args = data;
+	struct rknpu_gem_object *rknpu_obj = NULL;
+	struct rknpu_share *share;
+	int ret;
+
+	ret = rknpu_share_check_name(args->name);
+	if (ret)
+		return ret;
+
+	rknpu_obj = rknpu_gem_object_find(file_priv, args->handle);
+	if (!rknpu_obj)
+		return -EINVAL;
+
+	/* Imports belong to their exporter */
+	if (rknpu_obj->base.import_attach)
+		return -EINVAL;
+
+	share = kzalloc(sizeof(*share), GFP_KERNEL);
+	if (!share)
+		return -ENOMEM;
+
+	strscpy(share->name, (const char *)args->name, sizeof(share->name));
+	share->rknpu_dev = rknpu_dev;
+	share->size = rknpu_obj->size;
+	share->gem = &rknpu_obj->base;
+
+	mutex_lock(&rknpu_dev->share_lock);
+	if (rknpu_obj->share) {
+		ret = -EBUSY;
+	} else if (rknpu_share_find(rknpu_dev, share->name)) {
+		ret = -EEXIST;
+	} else {
+		list_add_tail(&share->node, &rknpu_dev->share_list);
+		rknpu_obj->share = share;
+	}
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	if (ret)
+		kfree(share);
+
+	return ret;
+}
+
+/* Open a handle in this file on the buffer published under args->name */
+int rknpu_gem_lookup_ioctl(struct drm_device *dev, void *data,
+			   struct drm_file *file_priv)
+{
+	struct rknpu_device *rknpu_dev = dev->dev_private;
+	struct rknpu_mem_share *args = data;
+	struct rknpu_gem_object *rknpu_obj = NULL;
+	struct rknpu_share *share;
+	int ret;
+
+	ret = rknpu_share_check_name(args->name);
+	if (ret)
+		return ret;
+
+	mutex_lock(&rknpu_dev->share_lock);
+	share = rknpu_share_find(rknpu_dev, (const char *)args->name);
+	if (share && share->gem && kref_get_unless_zero(&share->gem->refcount))
+		rknpu_obj = to_rknpu_obj(share->gem);
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	if (!rknpu_obj)
+		return -ENOENT;
+
+	ret = rknpu_gem_handle_create(&rknpu_obj->base, file_priv,
+				      &args->handle);
+	if (ret) {
+		rknpu_gem_object_put(&rknpu_obj->base);
+		return ret;
+	}
+
+	args->obj_addr = (__u64)(uintptr_t)rknpu_obj;
+	args->dma_addr = rknpu_obj->dma_addr;
+	args->size = rknpu_obj->size;
+
 	return 0;
 }
@@ -5,14 +5,20 @@
  */
 
 #include <linux/dma-map-ops.h>
-#include <linux/delay.h>
 #include <linux/jiffies.h>
+#include <linux/module.h>
 #include <linux/scatterlist.h>
+#include <linux/wait.h>
 
 #include "rknpu_iommu.h"
 
 #define RKNPU_SWITCH_DOMAIN_WAIT_TIME_MS 6000
 
+static unsigned int iommu_domain_batch = 16;
+module_param(iommu_domain_batch, uint, 0644);
+MODULE_PARM_DESC(iommu_domain_batch,
+		 "Jobs still let into the active iommu domain while another domain waits to switch (0=switch as soon as it is idle, default=16)");
+
 #if KERNEL_VERSION(6, 5, 0) <= LINUX_VERSION_CODE
 #define sg_is_dma_bus_address(sg) sg_dma_is_bus_address(sg)
 #endif
@@ -84,6 +90,150 @@ void rknpu_iommu_dma_free_iova(struct rknpu_iommu_dma_cookie *cookie,
 		free_iova(iovad, iova_pfn(iovad, iova));
 }
 
+/*
+ * Reserve @size bytes of IOVA from the domain currently attached to the
+ * NPU. The caller holds a reference; each buffer allocated from the arena
+ * takes another, so the arena outlives the file that created it for as
+ * long as its buffers do.
+ */
+struct rknpu_iova_arena *rknpu_iova_arena_create(struct rknpu_device *rknpu_dev,
+						 size_t size)
+{
+	struct rknpu_arena_stats *stats = &rknpu_dev->arena_stats;
+	struct device *dev = rknpu_dev->dev;
+	struct rknpu_iova_arena *arena;
+
+	arena = kzalloc(sizeof(*arena), GFP_KERNEL);
+	if (!arena)
+		return NULL;
+
+	arena->domain = iommu_get_domain_for_dev(dev);
+	if (!arena->domain)
+		goto err_free;
+
+	arena->size = size;
+	arena->base = rknpu_iommu_dma_alloc_iova(arena->domain, size,
+						 dma_get_mask(dev), dev, false);
+	if (!arena->base)
+		goto err_free;
+
+	arena->pool = gen_pool_create(PAGE_SHIFT, NUMA_NO_NODE);
+	if (!arena->pool)
+		goto err_free_iova;
+
+	gen_pool_set_algo(arena->pool, gen_pool_first_fit_order_align, NULL);
+	if (gen_pool_add(arena->pool, arena->base, size, NUMA_NO_NODE))
+		goto err_destroy_pool;
+
+	kref_init(&arena->ref);
+	arena->rknpu_dev = rknpu_dev;
+
+	atomic64_inc(&stats->arenas);
+	atomic64_add(size, &stats->reserved_bytes);
+
+	return arena;
+
+err_destroy_pool:
+	gen_pool_destroy(arena->pool);
+err_free_iova:
+	rknpu_iommu_dma_free_iova((void *)arena->domain->iova_cookie,
+				  arena->base, size, false);
+err_free:
+	kfree(arena);
+
+	return NULL;
+}
+
+static void rknpu_iova_arena_release(struct kref *ref)
+{
+	struct rknpu_iova_arena *arena =
+		container_of(ref, struct rknpu_iova_arena, ref);
+	struct rknpu_arena_stats *stats = &arena->rknpu_dev->arena_stats;
+
+	gen_pool_destroy(arena->pool);
+	rknpu_iommu_dma_free_iova((void *)arena->domain->iova_cookie,
+				  arena->base, arena->size, false);
+
+	atomic64_dec(&stats->arenas);
+	atomic64_sub(arena->size, &stats->reserved_bytes);
+
+	kfree(arena);
+}
+
+void rknpu_iova_arena_put(struct rknpu_iova_arena *arena)
+{
+	kref_put(&arena->ref, rknpu_iova_arena_release);
+}
+
+/* Returns 0 once the arena is full, the caller then falls back to the domain */
+dma_addr_t rknpu_iova_arena_alloc(struct rknpu_iova_arena *arena, size_t size)
+{
+	struct rknpu_arena_stats *stats = &arena->rknpu_dev->arena_stats;
+	dma_addr_t iova;
+
+	iova = gen_pool_alloc(arena->pool, size);
+	if (iova)
+		atomic64_inc(&stats->allocs);
+	else
+		atomic64_inc(&stats->fallbacks);
+
+	return iova;
+}
+
+/* Returns false if @iova did not come from @arena */
+bool rknpu_iova_arena_free(struct rknpu_iova_arena *arena, dma_addr_t iova,
+			   size_t size)
+{
+	if (iova < arena->base || iova - arena->base >= arena->size)
+		return false;
+
+	gen_pool_free(arena->pool, iova, size);
+
+	return true;
+}
+
+int rknpu_iova_arena_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_arena_stats *stats = &rknpu_dev->arena_stats;
+
+	seq_printf(m, "arenas: %lld, reserved: %lld KB\n",
+		   atomic64_read(&stats->arenas),
+		   atomic64_read(&stats->reserved_bytes) >> 10);
+	seq_printf(m, "allocs: %lld, fallbacks: %lld\n",
+		   atomic64_read(&stats->allocs),
+		   atomic64_read(&stats->fallbacks));
+
+	return 0;
+}
+
+int rknpu_iommu_domain_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_domain_stats *stats = &rknpu_dev->domain_stats;
+
+	seq_printf(m, "domain: %d/%d, refcount: %d, waiting: %d, batch: %u/%u\n",
+		   READ_ONCE(rknpu_dev->iommu_domain_id),
+		   READ_ONCE(rknpu_dev->iommu_domain_num),
+		   atomic_read(&rknpu_dev->iommu_domain_refcount),
+		   READ_ONCE(rknpu_dev->iommu_domain_wanted),
+		   READ_ONCE(rknpu_dev->iommu_domain_batch),
+		   iommu_domain_batch);
+	seq_printf(m, "switches: %lld, waits: %lld, batched: %lld, timeouts: %lld\n",
+		   atomic64_read(&stats->switches),
+		   atomic64_read(&stats->waits),
+		   atomic64_read(&stats->batched),
+		   atomic64_read(&stats->timeouts));
+
+	return 0;
+}
+
 static int rknpu_dma_info_to_prot(enum dma_data_direction dir, bool coherent)
 {
 	int prot = coherent ? IOMMU_CACHE : 0;
@@ -211,7 +361,7 @@ static void __invalidate_sg(struct scatterlist *sg, int nents)
 
 int rknpu_iommu_dma_map_sg(struct device *dev, struct scatterlist *sg,
 			   int nents, enum dma_data_direction dir,
-			   bool iova_aligned)
+			   bool iova_aligned, struct rknpu_iova_arena *arena)
 {
 	struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
 	struct rknpu_iommu_dma_cookie *cookie = (void *)domain->iova_cookie;
@@ -224,7 +374,10 @@ int rknpu_iommu_dma_map_sg(struct device *dev, struct scatterlist *sg,
 	ssize_t ret = -EINVAL;
 	int i = 0;
 
-	if (iova_aligned)
+	if (arena && arena->domain != domain)
+		arena = NULL;
+
+	if (iova_aligned && !arena)
 		return dma_map_sg(dev, sg, nents, dir);
 
 	/*
@@ -271,8 +424,11 @@ int rknpu_iommu_dma_map_sg(struct device *dev, struct scatterlist *sg,
 		goto out;
 	}
 
-	iova = rknpu_iommu_dma_alloc_iova(domain, iova_len, dma_get_mask(dev),
-					  dev, iova_aligned);
+	iova = arena ? rknpu_iova_arena_alloc(arena, iova_len) : 0;
+	if (!iova)
+		iova = rknpu_iommu_dma_alloc_iova(domain, iova_len,
+						  dma_get_mask(dev), dev,
+						  iova_aligned);
 	if (!iova) {
 		ret = -ENOMEM;
 		LOG_ERROR("failed to allocate IOVA: %zd\n", ret);
@@ -292,7 +448,8 @@ int rknpu_iommu_dma_map_sg(struct device *dev, struct scatterlist *sg,
 	return __finalise_sg(dev, sg, nents, iova);
 
 out_free_iova:
-	rknpu_iommu_dma_free_iova(cookie, iova, iova_len, iova_aligned);
+	if (!arena || !rknpu_iova_arena_free(arena, iova, iova_len))
+		rknpu_iommu_dma_free_iova(cookie, iova, iova_len, iova_aligned);
 out_restore_sg:
 	__invalidate_sg(sg, nents);
 out:
@@ -305,7 +462,7 @@ out:
 
 void rknpu_iommu_dma_unmap_sg(struct device *dev, struct scatterlist *sg,
 			      int nents, enum dma_data_direction dir,
-			      bool iova_aligned)
+			      bool iova_aligned, struct rknpu_iova_arena *arena)
 {
 	struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
 	struct rknpu_iommu_dma_cookie *cookie = (void *)domain->iova_cookie;
@@ -317,7 +474,10 @@ void rknpu_iommu_dma_unmap_sg(struct device *dev, struct scatterlist *sg,
 	size_t size = 0;
 	int i = 0;
 
-	if (iova_aligned)
+	if (arena && arena->domain != domain)
+		arena = NULL;
+
+	if (iova_aligned && !arena)
 		return dma_unmap_sg(dev, sg, nents, dir);
 
 #if KERNEL_VERSION(6, 1, 0) <= LINUX_VERSION_CODE
@@ -369,7 +529,9 @@ void rknpu_iommu_dma_unmap_sg(struct device *dev, struct scatterlist *sg,
 		dma_addr -= iova_off;
 		size = iova_align(iovad, size + iova_off);
 		iommu_unmap(domain, dma_addr, size);
-		rknpu_iommu_dma_free_iova(cookie, dma_addr, size, iova_aligned);
+		if (!arena || !rknpu_iova_arena_free(arena, dma_addr, size))
+			rknpu_iommu_dma_free_iova(cookie, dma_addr, size,
+						  iova_aligned);
 	}
 }
 
@@ -520,13 +682,45 @@ int rknpu_iommu_switch_domain(struct rknpu_device *rknpu_dev, int domain_id)
 	return ret;
 }
 
-int rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
+/*
+ * A reference on the active domain can be taken right away, except by a job
+ * while another domain is waiting for it to drain and the active domain
+ * already had its batch of jobs. Buffer operations are never held back, they
+ * may nest under a reference the caller already holds. A different domain
+ * can only be switched to once nothing holds the active one, and only by the
+ * domain that asked first.
+ */
+static bool rknpu_iommu_domain_can_get(struct rknpu_device *rknpu_dev,
+				       int domain_id, bool job)
+{
+	int wanted = READ_ONCE(rknpu_dev->iommu_domain_wanted);
+
+	if (domain_id == READ_ONCE(rknpu_dev->iommu_domain_id))
+		return !job || wanted < 0 ||
+		       READ_ONCE(rknpu_dev->iommu_domain_batch) <
+			       iommu_domain_batch;
+
+	return atomic_read(&rknpu_dev->iommu_domain_refcount) == 0 &&
+	       (wanted < 0 || wanted == domain_id);
+}
+
+static void rknpu_iommu_domain_unwant(struct rknpu_device *rknpu_dev,
 				      int domain_id)
 {
-	unsigned long timeout_jiffies =
-		msecs_to_jiffies(RKNPU_SWITCH_DOMAIN_WAIT_TIME_MS);
-	unsigned long start = jiffies;
-	int ret = -EINVAL;
+	if (rknpu_dev->iommu_domain_wanted != domain_id)
+		return;
+
+	WRITE_ONCE(rknpu_dev->iommu_domain_wanted, -1);
+	wake_up_all(&rknpu_dev->iommu_domain_wq);
+}
+
+static int __rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
+					       int domain_id, bool job)
+{
+	struct rknpu_domain_stats *stats = &rknpu_dev->domain_stats;
+	long timeout = msecs_to_jiffies(RKNPU_SWITCH_DOMAIN_WAIT_TIME_MS);
+	bool switched = false;
+	int ret = 0;
 
 	/* Fast path: single domain, no switching possible */
 	if (rknpu_dev->iommu_domain_num <= 1) {
@@ -534,34 +728,26 @@ int rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
 		return 0;
 	}
 
-	while (true) {
-		mutex_lock(&rknpu_dev->domain_lock);
-
-		if (domain_id == rknpu_dev->iommu_domain_id) {
-			atomic_inc(&rknpu_dev->iommu_domain_refcount);
-			mutex_unlock(&rknpu_dev->domain_lock);
-			break;
-		}
-
-		if (atomic_read(&rknpu_dev->iommu_domain_refcount) == 0) {
-			ret = rknpu_iommu_switch_domain(rknpu_dev, domain_id);
-			if (ret) {
-				LOG_DEV_ERROR(
-					rknpu_dev->dev,
-					"failed to switch iommu domain, id: %d, ret: %d\n",
-					domain_id, ret);
-				mutex_unlock(&rknpu_dev->domain_lock);
-				return ret;
-			}
-			atomic_inc(&rknpu_dev->iommu_domain_refcount);
-			mutex_unlock(&rknpu_dev->domain_lock);
-			break;
-		}
+	mutex_lock(&rknpu_dev->domain_lock);
 
+	while (!rknpu_iommu_domain_can_get(rknpu_dev, domain_id, job)) {
+		if (domain_id != rknpu_dev->iommu_domain_id &&
+		    rknpu_dev->iommu_domain_wanted < 0)
+			WRITE_ONCE(rknpu_dev->iommu_domain_wanted, domain_id);
 		mutex_unlock(&rknpu_dev->domain_lock);
 
-		usleep_range(10, 100);
-		if (time_after(jiffies, start + timeout_jiffies)) {
+		atomic64_inc(&stats->waits);
+		timeout = wait_event_timeout(
+			rknpu_dev->iommu_domain_wq,
+			rknpu_iommu_domain_can_get(rknpu_dev, domain_id, job),
+			timeout);
+
+		mutex_lock(&rknpu_dev->domain_lock);
+		if (!timeout &&
+		    !rknpu_iommu_domain_can_get(rknpu_dev, domain_id, job)) {
+			rknpu_iommu_domain_unwant(rknpu_dev, domain_id);
+			mutex_unlock(&rknpu_dev->domain_lock);
+			atomic64_inc(&stats->timeouts);
 			LOG_DEV_ERROR(
 				rknpu_dev->dev,
 				"switch iommu domain time out, failed to switch iommu domain, id: %d\n",
@@ -570,12 +756,85 @@ int rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
 		}
 	}
 
+	if (domain_id != rknpu_dev->iommu_domain_id) {
+		ret = rknpu_iommu_switch_domain(rknpu_dev, domain_id);
+		if (ret) {
+			LOG_DEV_ERROR(
+				rknpu_dev->dev,
+				"failed to switch iommu domain, id: %d, ret: %d\n",
+				domain_id, ret);
+			rknpu_iommu_domain_unwant(rknpu_dev, domain_id);
+			mutex_unlock(&rknpu_dev->domain_lock);
+			return ret;
+		}
+		WRITE_ONCE(rknpu_dev->iommu_domain_batch, 0);
+		if (rknpu_dev->iommu_domain_wanted == domain_id)
+			WRITE_ONCE(rknpu_dev->iommu_domain_wanted, -1);
+		atomic64_inc(&stats->switches);
+		switched = true;
+	} else if (job && rknpu_dev->iommu_domain_wanted >= 0) {
+		/* Joins the batch the waiting domain lets drain first */
+		WRITE_ONCE(rknpu_dev->iommu_domain_batch,
+			   rknpu_dev->iommu_domain_batch + 1);
+		atomic64_inc(&stats->batched);
+	}
+
+	atomic_inc(&rknpu_dev->iommu_domain_refcount);
+	mutex_unlock(&rknpu_dev->domain_lock);
+
+	/* Let the rest of the new domain in, and the old one queue up again */
+	if (switched)
+		wake_up_all(&rknpu_dev->iommu_domain_wq);
+
 	return 0;
 }
 
+int rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
+				      int domain_id)
+{
+	return __rknpu_iommu_domain_get_and_switch(rknpu_dev, domain_id, false);
+}
+
+/*
+ * Like rknpu_iommu_domain_get_and_switch(), but while another domain waits,
+ * only iommu_domain_batch more jobs join the active one before new jobs for
+ * it queue up behind the switch.
+ */
+int rknpu_iommu_domain_get_for_job(struct rknpu_device *rknpu_dev,
+				   int domain_id)
+{
+	return __rknpu_iommu_domain_get_and_switch(rknpu_dev, domain_id, true);
+}
+
+/*
+ * Take a reference on @domain_id only if it is the active domain, without
+ * switching or sleeping. For reclaim, which must not wait for a domain
+ * switch. Returns -EBUSY otherwise.
+ */
+int rknpu_iommu_domain_tryget(struct rknpu_device *rknpu_dev, int domain_id)
+{
+	int ret = -EBUSY;
+
+	if (rknpu_dev->iommu_domain_num <= 1) {
+		atomic_inc(&rknpu_dev->iommu_domain_refcount);
+		return 0;
+	}
+
+	if (!mutex_trylock(&rknpu_dev->domain_lock))
+		return -EBUSY;
+	if (domain_id == rknpu_dev->iommu_domain_id) {
+		atomic_inc(&rknpu_dev->iommu_domain_refcount);
+		ret = 0;
+	}
+	mutex_unlock(&rknpu_dev->domain_lock);
+
+	return ret;
+}
+
 int rknpu_iommu_domain_put(struct rknpu_device *rknpu_dev)
 {
-	atomic_dec(&rknpu_dev->iommu_domain_refcount);
+	if (atomic_dec_and_test(&rknpu_dev->iommu_domain_refcount))
+		wake_up_all(&rknpu_dev->iommu_domain_wq);
 
 	return 0;
 }
@@ -622,6 +881,17 @@ int rknpu_iommu_domain_get_and_switch(struct rknpu_device *rknpu_dev,
 	return 0;
 }
 
+int rknpu_iommu_domain_get_for_job(struct rknpu_device *rknpu_dev,
+				   int domain_id)
+{
+	return 0;
+}
+
+int rknpu_iommu_domain_tryget(struct rknpu_device *rknpu_dev, int domain_id)
+{
+	return 0;
+}
+
 int rknpu_iommu_domain_put(struct rknpu_device *rknpu_dev)
 {
 	return 0;
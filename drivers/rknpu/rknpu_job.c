@@ -108,6 +108,33 @@ static void rknpu_job_free(struct rknpu_job *job)
 #endif
 	/* DKMS_MISCDEV uses rknpu_mem_object which is managed by session list */
 
+	if (job->cache_sync_post)
+		cancel_work_sync(&job->done_work);
+
+#ifdef RKNPU_DKMS_MISCDEV
+	if (job->userptr_task)
+		dma_buf_put(job->userptr_task);
+#endif
+	if (job->shadow_task)
+		rknpu_shadow_put(job->shadow_task);
+
+#if defined(CONFIG_ROCKCHIP_RKNPU_DRM_GEM)
+	if (job->use_drm_gem && job->cache_sync_count)
+		rknpu_gem_put_syncs(
+			(struct rknpu_gem_object **)job->cache_sync_objs,
+			job->cache_sync_count);
+#endif
+#if defined(RKNPU_DKMS_MISCDEV) || defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+	if (!job->use_drm_gem && job->cache_sync_count) {
+		rknpu_mem_put_syncs(
+			(struct rknpu_mem_object **)job->cache_sync_objs,
+			job->cache_sync_count);
+		rknpu_session_put(job->session);
+	}
+#endif
+	kfree(job->cache_sync_objs);
+	kfree(job->cache_syncs);
+
 	if (job->fence)
 		dma_fence_put(job->fence);
 
@@ -132,6 +159,8 @@ static void rknpu_job_cleanup_work(struct work_struct *work)
 	rknpu_job_cleanup(job);
 }
 
+static void rknpu_job_done_work(struct work_struct *work);
+
 static inline struct rknpu_job *rknpu_job_alloc(struct rknpu_device *rknpu_dev,
 						struct rknpu_submit *args)
 {
@@ -154,6 +183,7 @@ static inline struct rknpu_job *rknpu_job_alloc(struct rknpu_device *rknpu_dev,
 		atomic_set(&job->submit_count[i], 0);
 	/* Note: use_drm_gem is set after allocation, GEM refcount taken then */
 	job->use_drm_gem = false;
+	INIT_WORK(&job->done_work, rknpu_job_done_work);
 
 	if (!(args->flags & RKNPU_JOB_NONBLOCK)) {
 		job->args = args;
@@ -174,6 +204,120 @@ static inline struct rknpu_job *rknpu_job_alloc(struct rknpu_device *rknpu_dev,
 	return job;
 }
 
+/*
+ * Copy in and resolve the submit-attached cache maintenance list. GEM
+ * entries are looked up by handle, misc entries against the session
+ * list; every object is referenced until the job is freed, and so is
+ * the misc session.
+ */
+static int rknpu_job_get_cache_syncs(struct rknpu_job *job, struct file *file)
+{
+	struct rknpu_device *rknpu_dev = job->rknpu_dev;
+	struct rknpu_submit *args = job->args;
+	unsigned int count = args->cache_sync_count;
+	int ret = 0;
+	int i;
+
+	if (count == 0)
+		return 0;
+	if (count > RKNPU_MEM_SYNC_VEC_MAX)
+		return -EINVAL;
+
+	job->cache_syncs = memdup_user(u64_to_user_ptr(args->cache_syncs),
+				       count * sizeof(struct rknpu_mem_sync));
+	if (IS_ERR(job->cache_syncs)) {
+		ret = PTR_ERR(job->cache_syncs);
+		job->cache_syncs = NULL;
+		return ret;
+	}
+
+	job->cache_sync_objs =
+		kcalloc(count, sizeof(*job->cache_sync_objs), GFP_KERNEL);
+	if (!job->cache_sync_objs)
+		return -ENOMEM;
+
+	if (!file)
+		return -EINVAL;
+
+#if defined(CONFIG_ROCKCHIP_RKNPU_DRM_GEM)
+	if (job->use_drm_gem) {
+		ret = rknpu_gem_lookup_syncs(
+			file->private_data, job->cache_syncs, count,
+			(struct rknpu_gem_object **)job->cache_sync_objs);
+		if (ret)
+			return ret;
+	}
+#endif
+#if defined(RKNPU_DKMS_MISCDEV) || defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+	if (!job->use_drm_gem) {
+		ret = rknpu_mem_lookup_syncs(
+			rknpu_dev, file, job->cache_syncs, count,
+			(struct rknpu_mem_object **)job->cache_sync_objs);
+		if (ret)
+			return ret;
+		/* Still set, the submit ioctl holds the file */
+		job->session = file->private_data;
+		rknpu_session_get(job->session);
+	}
+#endif
+	job->cache_sync_count = count;
+
+	for (i = 0; i < count; i++) {
+		if (job->cache_syncs[i].flags & RKNPU_MEM_SYNC_FROM_DEVICE)
+			job->cache_sync_post = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy a bounced or shadowed task object in before the job. Bounced and
+ * shadowed data buffers are copied by the job's cache sync list, range by
+ * range.
+ */
+static void rknpu_job_task_sync(struct rknpu_job *job)
+{
+#ifdef RKNPU_DKMS_MISCDEV
+	if (job->userptr_task)
+		rknpu_mem_userptr_sync(job->userptr_task, 0,
+				       job->userptr_task->size, true);
+#endif
+	if (job->shadow_task)
+		rknpu_shadow_sync(job->shadow_task, 0, U64_MAX, true);
+}
+
+/* Run the @dir_flag half (TO_DEVICE or FROM_DEVICE) of the job's list */
+static void rknpu_job_cache_sync(struct rknpu_job *job, uint32_t dir_flag)
+{
+	struct rknpu_mem_sync sync;
+	int i;
+
+	for (i = 0; i < job->cache_sync_count; i++) {
+		if (!(job->cache_syncs[i].flags & dir_flag))
+			continue;
+
+		sync = job->cache_syncs[i];
+		sync.flags = dir_flag;
+
+#if defined(CONFIG_ROCKCHIP_RKNPU_DRM_GEM)
+		if (job->use_drm_gem) {
+			struct rknpu_gem_object *gem_obj =
+				job->cache_sync_objs[i];
+
+			/* Uncached GEM buffers need no maintenance */
+			if (gem_obj->flags & RKNPU_MEM_CACHEABLE)
+				rknpu_gem_sync_obj(job->rknpu_dev, gem_obj,
+						   &sync);
+		}
+#endif
+#if defined(RKNPU_DKMS_MISCDEV) || defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+		if (!job->use_drm_gem)
+			rknpu_mem_sync_obj(job->rknpu_dev,
+					   job->cache_sync_objs[i], &sync);
+#endif
+	}
+}
+
 static inline int rknpu_job_wait(struct rknpu_job *job)
 {
 	struct rknpu_device *rknpu_dev = job->rknpu_dev;
@@ -498,6 +642,45 @@ static void rknpu_job_next(struct rknpu_device *rknpu_dev, int core_index)
 		rknpu_job_commit(job);
 }
 
+static void rknpu_job_finish(struct rknpu_job *job, int ret)
+{
+	struct rknpu_device *rknpu_dev = job->rknpu_dev;
+	wait_queue_head_t *job_done_wq =
+		&rknpu_dev->subcore_datas[rknpu_wait_core_index(
+						  job->args->core_mask)]
+			 .job_done_wq;
+
+	rknpu_iommu_domain_put(rknpu_dev);
+
+	job->flags |= RKNPU_JOB_DONE;
+	job->ret = ret;
+
+	if (job->fence)
+		dma_fence_signal(job->fence);
+
+	if (job->flags & RKNPU_JOB_ASYNC)
+		schedule_work(&job->cleanup_work);
+
+	wake_up(job_done_wq);
+}
+
+/*
+ * Completion worker for jobs with FROM_DEVICE cache maintenance, which
+ * includes copying bounced and shadowed ranges out: the invalidation and
+ * copy-out have to run in process context, and before the fence is
+ * signaled or the waiter woken so they never see stale data.
+ * The iommu domain is still held for the GEM syncs.
+ */
+static void rknpu_job_done_work(struct work_struct *work)
+{
+	struct rknpu_job *job =
+		container_of(work, struct rknpu_job, done_work);
+
+	rknpu_job_cache_sync(job, RKNPU_MEM_SYNC_FROM_DEVICE);
+
+	rknpu_job_finish(job, job->ret);
+}
+
 static void rknpu_job_done(struct rknpu_job *job, int ret, int core_index)
 {
 	struct rknpu_device *rknpu_dev = job->rknpu_dev;
@@ -524,23 +707,18 @@ static void rknpu_job_done(struct rknpu_job *job, int ret, int core_index)
 	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
 
 	if (atomic_dec_and_test(&job->interrupt_count)) {
-		int use_core_num = job->use_core_num;
-
-		rknpu_iommu_domain_put(rknpu_dev);
-
-		job->flags |= RKNPU_JOB_DONE;
-		job->ret = ret;
-
-		if (job->fence)
-			dma_fence_signal(job->fence);
-
-		if (job->flags & RKNPU_JOB_ASYNC)
-			schedule_work(&job->cleanup_work);
-
-		if (use_core_num > 1)
-			wake_up(&(&rknpu_dev->subcore_datas[0])->job_done_wq);
-		else
-			wake_up(&subcore_data->job_done_wq);
+		atomic64_inc(&rknpu_dev->job_seq);
+
+		/* rknpu_job_abort() may have given up on the job already */
+		if (!test_and_set_bit(RKNPU_JOB_CLAIMED, &job->state)) {
+			/* Cache syncs after completion need process context */
+			if (job->cache_sync_post) {
+				job->ret = ret;
+				queue_work(system_highpri_wq, &job->done_work);
+			} else {
+				rknpu_job_finish(job, ret);
+			}
+		}
 	}
 
 	rknpu_job_next(rknpu_dev, core_index);
@@ -578,11 +756,20 @@ static void rknpu_job_schedule(struct rknpu_job *job)
 		atomic_set(&job->interrupt_count, job->use_core_num);
 	}
 
-	if (rknpu_iommu_domain_get_and_switch(rknpu_dev, job->iommu_domain_id)) {
+	if (rknpu_iommu_domain_get_for_job(rknpu_dev, job->iommu_domain_id)) {
+		/* no domain reference to drop, keep abort from putting one */
+		set_bit(RKNPU_JOB_CLAIMED, &job->state);
 		job->ret = -EINVAL;
 		return;
 	}
 
+	/* Clean CPU-written buffers before the job can be committed */
+	rknpu_job_cache_sync(job, RKNPU_MEM_SYNC_TO_DEVICE);
+	rknpu_job_task_sync(job);
+
+	/* The device may write any buffer from here on */
+	atomic64_inc(&rknpu_dev->job_seq);
+
 	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
 	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
 		if (job->args->core_mask & rknpu_core_mask(i)) {
@@ -606,7 +793,24 @@ static void rknpu_job_abort(struct rknpu_job *job)
 	unsigned long flags;
 	int i = 0;
 
-	rknpu_iommu_domain_put(rknpu_dev);
+	/*
+	 * Completion may race the timeout. Whichever side claims the job
+	 * drops its domain reference and signals its fence, once.
+	 */
+	if (test_and_set_bit(RKNPU_JOB_CLAIMED, &job->state)) {
+		/* let a queued completion run before the job is freed */
+		if (job->cache_sync_post)
+			flush_work(&job->done_work);
+	} else {
+		rknpu_iommu_domain_put(rknpu_dev);
+		if (job->fence) {
+			dma_fence_set_error(job->fence, job->ret);
+			dma_fence_signal(job->fence);
+		}
+	}
+
+	/* A partly run job may still have written its outputs */
+	atomic64_inc(&rknpu_dev->job_seq);
 
 	msleep(10);
 
@@ -785,7 +989,8 @@ static void rknpu_job_timeout_clean(struct rknpu_device *rknpu_dev,
 }
 
 static int rknpu_submit(struct rknpu_device *rknpu_dev,
-			struct rknpu_submit *args, bool use_drm_gem)
+			struct rknpu_submit *args, struct file *file,
+			bool use_drm_gem)
 {
 	struct rknpu_job *job = NULL;
 	int ret = -EINVAL;
@@ -819,6 +1024,22 @@ static int rknpu_submit(struct rknpu_device *rknpu_dev,
 	}
 #endif
 
+	ret = rknpu_job_get_cache_syncs(job, file);
+	if (ret) {
+		LOG_ERROR("invalid submit cache sync list: %d\n", ret);
+		rknpu_job_free(job);
+		return ret;
+	}
+
+#ifdef RKNPU_DKMS_MISCDEV
+	if (!use_drm_gem) {
+		job->userptr_task = rknpu_mem_userptr_get(
+			rknpu_dev, file, args->task_obj_addr);
+		job->shadow_task = rknpu_mem_shadow_get(
+			rknpu_dev, file, args->task_obj_addr);
+	}
+#endif
+
 	if (args->flags & RKNPU_JOB_FENCE_IN) {
 #ifdef CONFIG_ROCKCHIP_RKNPU_FENCE
 		struct dma_fence *in_fence;
@@ -828,6 +1049,7 @@ static int rknpu_submit(struct rknpu_device *rknpu_dev,
 		if (!in_fence) {
 			LOG_ERROR("invalid fence in fd, fd: %d\n",
 				  args->fence_fd);
+			rknpu_job_free(job);
 			return -EINVAL;
 		}
 		args->fence_fd = -1;
@@ -847,6 +1069,7 @@ static int rknpu_submit(struct rknpu_device *rknpu_dev,
 				LOG_ERROR("Error (%d) waiting for fence!\n",
 					  ret);
 
+			rknpu_job_free(job);
 			return ret;
 		}
 #else
@@ -906,29 +1129,35 @@ int rknpu_submit_ioctl(struct drm_device *dev, void *data,
 	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev->dev);
 	struct rknpu_submit *args = data;
 
-	/* DRM path uses rknpu_gem_object */
-	return rknpu_submit(rknpu_dev, args, true);
+	/* DRM path uses rknpu_gem_object, looked up in file_priv */
+	return rknpu_submit(rknpu_dev, args, file_priv->filp, true);
 }
 #endif
 
 #if defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP) || defined(RKNPU_DKMS_MISCDEV_ENABLED)
-int rknpu_miscdev_submit_ioctl(struct rknpu_device *rknpu_dev, unsigned long data)
+int rknpu_miscdev_submit_ioctl(struct rknpu_device *rknpu_dev,
+			       struct file *file, unsigned int cmd,
+			       unsigned long data)
 {
 	struct rknpu_submit args;
 	int ret = -EINVAL;
+	unsigned int in_size = min_t(unsigned int, _IOC_SIZE(cmd),
+				     sizeof(struct rknpu_submit));
 
+	/* Older userspace passes the struct without the cache sync list */
+	memset(&args, 0, sizeof(args));
 	if (unlikely(copy_from_user(&args, (struct rknpu_submit *)data,
-				    sizeof(struct rknpu_submit)))) {
+				    in_size))) {
 		LOG_ERROR("%s: copy_from_user failed\n", __func__);
 		ret = -EFAULT;
 		return ret;
 	}
 
 	/* Misc device path uses rknpu_mem_object */
-	ret = rknpu_submit(rknpu_dev, &args, false);
+	ret = rknpu_submit(rknpu_dev, &args, file, false);
 
 	if (unlikely(copy_to_user((struct rknpu_submit *)data, &args,
-				  sizeof(struct rknpu_submit)))) {
+				  in_size))) {
 		LOG_ERROR("%s: copy_to_user failed\n", __func__);
 		ret = -EFAULT;
 		return ret;
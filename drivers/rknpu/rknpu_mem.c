@@ -10,10 +10,21 @@
 #endif
 
 #include <linux/version.h>
+#include <linux/anon_inodes.h>
+#include <linux/bitmap.h>
 #include <linux/dma-buf.h>
+#include <linux/file.h>
+#include <linux/genalloc.h>
+#include <linux/highmem.h>
 #include <linux/iosys-map.h>
+#include <linux/mm.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/scatterlist.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 #if defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP) && !defined(RKNPU_DKMS_MISCDEV)
 #include <linux/rk-dma-heap.h>
 #endif
@@ -81,20 +92,273 @@ static int kern_addr_valid(unsigned long addr)
 #endif
 #endif
 
+static struct rknpu_mem_object *
+rknpu_mem_session_find(struct rknpu_session *session, __u64 obj_addr)
+{
+	struct rknpu_mem_object *entry;
+
+	list_for_each_entry(entry, &session->list, head) {
+		if ((unsigned long)(uintptr_t)entry == (unsigned long)obj_addr)
+			return entry;
+	}
+
+	return NULL;
+}
+
 #ifdef RKNPU_DKMS_MISCDEV
 
 /*
  * DKMS direct allocation backend — replaces rk-dma-heap with
  * dma_alloc_coherent + dma_buf_export so /dev/rknpu can allocate
- * buffers directly (not import-only).
+ * buffers directly (not import-only). Buffers requested with
+ * RKNPU_MEM_CACHEABLE come from dma_alloc_pages() instead and are kept
+ * coherent by explicit MEM_SYNC / DMA_BUF_IOCTL_SYNC cache maintenance.
+ *
+ * @size is the size of the backing allocation, @len the page aligned
+ * size exported to userspace. They differ for pooled buffers, which are
+ * rounded up to their power-of-two size class. @sgt describes @len and is
+ * handed to the driver's own rknpu_mem_object without an attachment.
  */
 struct rknpu_dkms_buf {
 	struct device *dev;
 	size_t size;
+	size_t len;
 	void *vaddr;
 	dma_addr_t dma_addr;
+	struct page *page;
+	bool cacheable;
+	bool shared;
+	bool cpu_touched;
+	struct sg_table sgt;
+	struct rknpu_mem_pool *pool;
+	struct rknpu_carveout *carveout;
+	int order;
+	struct list_head node;
 };
 
+static unsigned int mem_pool_max_mb = 64;
+module_param(mem_pool_max_mb, uint, 0644);
+MODULE_PARM_DESC(mem_pool_max_mb,
+	"Max MB of freed /dev/rknpu buffers kept for reuse (0=disable pool, default=64)");
+
+static bool dkms_mem_cacheable;
+module_param(dkms_mem_cacheable, bool, 0644);
+MODULE_PARM_DESC(
+	dkms_mem_cacheable,
+	"DKMS: honor RKNPU_MEM_CACHEABLE for /dev/rknpu direct allocations, callers must MEM_SYNC them (default=N, always uncached as before)"
+);
+
+static void rknpu_mem_pool_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct rknpu_mem_pool, ref));
+}
+
+static void rknpu_dkms_buf_free(struct rknpu_dkms_buf *buf)
+{
+	if (buf->pool)
+		kref_put(&buf->pool->ref, rknpu_mem_pool_release);
+	sg_free_table(&buf->sgt);
+	if (buf->carveout) {
+		if (!buf->cacheable)
+			vunmap(buf->vaddr);
+		rknpu_carveout_free(buf->carveout, buf->page, buf->size);
+	} else if (buf->cacheable)
+		dma_free_pages(buf->dev, buf->size, buf->page, buf->dma_addr,
+			       DMA_BIDIRECTIONAL);
+	else
+		dma_free_coherent(buf->dev, buf->size, buf->vaddr,
+				  buf->dma_addr);
+	kfree(buf);
+}
+
+static struct rknpu_dkms_buf *rknpu_mem_pool_get(struct rknpu_mem_pool *pool,
+						 bool cacheable, int order)
+{
+	struct rknpu_dkms_buf *buf = NULL;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->free_list[cacheable][order])) {
+		buf = list_first_entry(&pool->free_list[cacheable][order],
+				       struct rknpu_dkms_buf, node);
+		list_del(&buf->node);
+		pool->count[cacheable][order]--;
+		pool->cached_bytes -= buf->size;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	spin_unlock(&pool->lock);
+
+	return buf;
+}
+
+/* Returns true if the pool took ownership of @buf */
+static bool rknpu_mem_pool_put(struct rknpu_dkms_buf *buf)
+{
+	struct rknpu_mem_pool *pool = buf->pool;
+	size_t max_bytes = (size_t)READ_ONCE(mem_pool_max_mb) << 20;
+	bool cached = false;
+
+	if (!pool || buf->order < 0)
+		return false;
+
+	spin_lock(&pool->lock);
+	if (!pool->dead && pool->cached_bytes + buf->size <= max_bytes) {
+		list_add(&buf->node,
+			 &pool->free_list[buf->cacheable][buf->order]);
+		pool->count[buf->cacheable][buf->order]++;
+		pool->cached_bytes += buf->size;
+		cached = true;
+	}
+	spin_unlock(&pool->lock);
+
+	return cached;
+}
+
+/*
+ * Free up to @nr_pages worth of cached buffers, largest classes first.
+ * Returns the number of pages freed.
+ */
+static unsigned long rknpu_mem_pool_drain(struct rknpu_mem_pool *pool,
+					  unsigned long nr_pages)
+{
+	struct rknpu_dkms_buf *buf, *tmp;
+	unsigned long freed = 0;
+	LIST_HEAD(local_list);
+	int order, type;
+
+	spin_lock(&pool->lock);
+	for (order = RKNPU_MEM_POOL_MAX_ORDER; order >= 0 && freed < nr_pages;
+	     order--) {
+		for (type = 0; type < RKNPU_MEM_POOL_NUM_TYPES; type++) {
+			while (!list_empty(&pool->free_list[type][order]) &&
+			       freed < nr_pages) {
+				buf = list_first_entry(
+					&pool->free_list[type][order],
+					struct rknpu_dkms_buf, node);
+				list_move(&buf->node, &local_list);
+				pool->count[type][order]--;
+				pool->cached_bytes -= buf->size;
+				pool->reclaimed += buf->size;
+				freed += buf->size >> PAGE_SHIFT;
+			}
+		}
+	}
+	spin_unlock(&pool->lock);
+
+	list_for_each_entry_safe(buf, tmp, &local_list, node) {
+		list_del(&buf->node);
+		rknpu_dkms_buf_free(buf);
+	}
+
+	return freed;
+}
+
+static unsigned long rknpu_mem_pool_shrink_count(struct shrinker *shrinker,
+						 struct shrink_control *sc)
+{
+	struct rknpu_mem_pool *pool = shrinker->private_data;
+	unsigned long count = READ_ONCE(pool->cached_bytes) >> PAGE_SHIFT;
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long rknpu_mem_pool_shrink_scan(struct shrinker *shrinker,
+						struct shrink_control *sc)
+{
+	struct rknpu_mem_pool *pool = shrinker->private_data;
+	unsigned long freed;
+
+	freed = rknpu_mem_pool_drain(pool, sc->nr_to_scan);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+int rknpu_mem_pool_create(struct device *dev, struct rknpu_mem_pool **pool)
+{
+	int order, type;
+
+	*pool = kzalloc(sizeof(struct rknpu_mem_pool), GFP_KERNEL);
+	if (!(*pool))
+		return -ENOMEM;
+
+	(*pool)->dev = dev;
+	kref_init(&(*pool)->ref);
+	spin_lock_init(&(*pool)->lock);
+	for (type = 0; type < RKNPU_MEM_POOL_NUM_TYPES; type++)
+		for (order = 0; order < RKNPU_MEM_POOL_NUM_CLASSES; order++)
+			INIT_LIST_HEAD(&(*pool)->free_list[type][order]);
+
+	(*pool)->shrinker = shrinker_alloc(0, "rknpu-mem-pool");
+	if (!(*pool)->shrinker) {
+		kfree(*pool);
+		*pool = NULL;
+		return -ENOMEM;
+	}
+
+	(*pool)->shrinker->count_objects = rknpu_mem_pool_shrink_count;
+	(*pool)->shrinker->scan_objects = rknpu_mem_pool_shrink_scan;
+	(*pool)->shrinker->private_data = *pool;
+	shrinker_register((*pool)->shrinker);
+
+	return 0;
+}
+
+/*
+ * Drop the device's reference. Exported buffers still pointing at the
+ * pool keep it alive and are freed instead of cached once released.
+ */
+void rknpu_mem_pool_destroy(struct rknpu_mem_pool *pool)
+{
+	if (pool != NULL) {
+		shrinker_free(pool->shrinker);
+		spin_lock(&pool->lock);
+		pool->dead = true;
+		spin_unlock(&pool->lock);
+		rknpu_mem_pool_drain(pool, ULONG_MAX);
+		kref_put(&pool->ref, rknpu_mem_pool_release);
+	}
+}
+
+int rknpu_mem_pool_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_mem_pool *pool = rknpu_dev->mem_pool;
+	unsigned int count[RKNPU_MEM_POOL_NUM_TYPES][RKNPU_MEM_POOL_NUM_CLASSES];
+	u64 hits, misses, bypass, reclaimed;
+	size_t cached_bytes;
+	int order;
+
+	if (pool == NULL)
+		return 0;
+
+	spin_lock(&pool->lock);
+	memcpy(count, pool->count, sizeof(count));
+	cached_bytes = pool->cached_bytes;
+	hits = pool->hits;
+	misses = pool->misses;
+	bypass = pool->bypass;
+	reclaimed = pool->reclaimed;
+	spin_unlock(&pool->lock);
+
+	seq_printf(m, "hits: %llu, misses: %llu, bypass: %llu\n", hits, misses,
+		   bypass);
+	seq_printf(m, "cached: %zu KB, max: %u KB, reclaimed: %llu KB\n",
+		   cached_bytes >> 10, READ_ONCE(mem_pool_max_mb) << 10,
+		   reclaimed >> 10);
+	for (order = 0; order < RKNPU_MEM_POOL_NUM_CLASSES; order++) {
+		if (count[0][order] || count[1][order])
+			seq_printf(m, "[%6lu KB] uncached: %u, cached: %u\n",
+				   (PAGE_SIZE << order) >> 10, count[0][order],
+				   count[1][order]);
+	}
+
+	return 0;
+}
+
 static struct sg_table *rknpu_dkms_buf_map(struct dma_buf_attachment *attach,
 					   enum dma_data_direction dir)
 {
@@ -112,14 +376,26 @@ static struct sg_table *rknpu_dkms_buf_map(struct dma_buf_attachment *attach,
 		return ERR_PTR(ret);
 	}
 
-	sg_set_page(sgt->sgl, virt_to_page(buf->vaddr), buf->size, 0);
+	sg_set_page(sgt->sgl, buf->page ? buf->page : virt_to_page(buf->vaddr),
+		    buf->len, 0);
 	sg_dma_address(sgt->sgl) = buf->dma_addr;
-	sg_dma_len(sgt->sgl) = buf->size;
+	sg_dma_len(sgt->sgl) = buf->len;
 	sgt->nents = 1;
 
 	return sgt;
 }
 
+/* Another device may write the buffer, stop eliding syncs for it */
+static int rknpu_dkms_buf_attach(struct dma_buf *dmabuf,
+				 struct dma_buf_attachment *attach)
+{
+	struct rknpu_dkms_buf *buf = dmabuf->priv;
+
+	WRITE_ONCE(buf->shared, true);
+
+	return 0;
+}
+
 static void rknpu_dkms_buf_unmap(struct dma_buf_attachment *attach,
 				 struct sg_table *sgt,
 				 enum dma_data_direction dir)
@@ -132,14 +408,17 @@ static void rknpu_dkms_buf_release(struct dma_buf *dmabuf)
 {
 	struct rknpu_dkms_buf *buf = dmabuf->priv;
 
-	dma_free_coherent(buf->dev, buf->size, buf->vaddr, buf->dma_addr);
-	kfree(buf);
+	if (rknpu_mem_pool_put(buf))
+		return;
+
+	rknpu_dkms_buf_free(buf);
 }
 
 static int rknpu_dkms_buf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
 {
 	struct rknpu_dkms_buf *buf = dmabuf->priv;
 
+	WRITE_ONCE(buf->cpu_touched, true);
 	iosys_map_set_vaddr(map, buf->vaddr);
 	return 0;
 }
@@ -149,442 +428,2835 @@ static void rknpu_dkms_buf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
 	iosys_map_clear(map);
 }
 
+/*
+ * User mappings of cacheable buffers are zapped by a full clean (see
+ * rknpu_mem_sync_obj()), the next CPU access lands here and marks the
+ * buffer as CPU-dirty again. The whole VMA is mapped back at once, a
+ * buffer the CPU fills every frame must not refault page by page.
+ */
+static vm_fault_t rknpu_dkms_buf_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct rknpu_dkms_buf *buf = vma->vm_private_data;
+	unsigned long npages = buf->len >> PAGE_SHIFT;
+	pgoff_t pgoff = vma->vm_pgoff +
+			((vmf->address - vma->vm_start) >> PAGE_SHIFT);
+	unsigned long addr, end;
+	vm_fault_t ret;
+
+	if (pgoff >= npages)
+		return VM_FAULT_SIGBUS;
+
+	WRITE_ONCE(buf->cpu_touched, true);
+
+	ret = vmf_insert_pfn(vma, vmf->address & PAGE_MASK,
+			     page_to_pfn(buf->page) + pgoff);
+	if (ret != VM_FAULT_NOPAGE)
+		return ret;
+
+	end = min(vma->vm_end,
+		  vma->vm_start + ((npages - vma->vm_pgoff) << PAGE_SHIFT));
+	for (addr = vma->vm_start; addr < end; addr += PAGE_SIZE) {
+		if (addr == (vmf->address & PAGE_MASK))
+			continue;
+		pgoff = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+		if (vmf_insert_pfn(vma, addr, page_to_pfn(buf->page) + pgoff) &
+		    VM_FAULT_ERROR)
+			break;
+	}
+
+	return ret;
+}
+
+static const struct vm_operations_struct rknpu_dkms_buf_vm_ops = {
+	.fault = rknpu_dkms_buf_fault,
+};
+
 static int rknpu_dkms_buf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 {
 	struct rknpu_dkms_buf *buf = dmabuf->priv;
+	int ret;
+
+	if (buf->cacheable) {
+		ret = dma_mmap_pages(buf->dev, vma, buf->len, buf->page);
+		if (ret)
+			return ret;
+
+		WRITE_ONCE(buf->cpu_touched, true);
+		vma->vm_ops = &rknpu_dkms_buf_vm_ops;
+		vma->vm_private_data = buf;
+		return 0;
+	}
+
+	if (buf->carveout) {
+		unsigned long count = vma_pages(vma);
+
+		if (vma->vm_pgoff >= (buf->len >> PAGE_SHIFT) ||
+		    count > (buf->len >> PAGE_SHIFT) - vma->vm_pgoff)
+			return -ENXIO;
+		vma->vm_page_prot = pgprot_dmacoherent(vma->vm_page_prot);
+		return remap_pfn_range(vma, vma->vm_start,
+				       page_to_pfn(buf->page) + vma->vm_pgoff,
+				       count << PAGE_SHIFT, vma->vm_page_prot);
+	}
 
 	return dma_mmap_coherent(buf->dev, vma, buf->vaddr,
-				 buf->dma_addr, buf->size);
+				 buf->dma_addr, buf->len);
+}
+
+static int rknpu_dkms_buf_begin_cpu_access(struct dma_buf *dmabuf,
+					   enum dma_data_direction dir)
+{
+	struct rknpu_dkms_buf *buf = dmabuf->priv;
+
+	WRITE_ONCE(buf->cpu_touched, true);
+	if (buf->cacheable)
+		dma_sync_single_for_cpu(buf->dev, buf->dma_addr, buf->len, dir);
+
+	return 0;
+}
+
+static int rknpu_dkms_buf_end_cpu_access(struct dma_buf *dmabuf,
+					 enum dma_data_direction dir)
+{
+	struct rknpu_dkms_buf *buf = dmabuf->priv;
+
+	if (buf->cacheable)
+		dma_sync_single_for_device(buf->dev, buf->dma_addr, buf->len,
+					   dir);
+
+	return 0;
 }
 
 static const struct dma_buf_ops rknpu_dkms_buf_ops = {
+	.attach = rknpu_dkms_buf_attach,
 	.map_dma_buf = rknpu_dkms_buf_map,
 	.unmap_dma_buf = rknpu_dkms_buf_unmap,
 	.release = rknpu_dkms_buf_release,
 	.vmap = rknpu_dkms_buf_vmap,
 	.vunmap = rknpu_dkms_buf_vunmap,
 	.mmap = rknpu_dkms_buf_mmap,
+	.begin_cpu_access = rknpu_dkms_buf_begin_cpu_access,
+	.end_cpu_access = rknpu_dkms_buf_end_cpu_access,
 };
 
-static struct dma_buf *rknpu_dkms_alloc(struct device *dev, size_t size)
+/*
+ * Carveout-backed buffer, always zeroed since the carveout is recycled
+ * across processes. Uncached ones get an uncached kernel alias, the
+ * cacheable linear alias is cleaned and invalidated first.
+ */
+static struct rknpu_dkms_buf *
+rknpu_dkms_carveout_alloc(struct rknpu_device *rknpu_dev, size_t len,
+			  bool cacheable)
 {
 	struct rknpu_dkms_buf *buf;
-	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
-	struct dma_buf *dmabuf;
+	struct page **pages;
+	unsigned long i, nr_pages = len >> PAGE_SHIFT;
 
 	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
 	if (!buf)
-		return ERR_PTR(-ENOMEM);
+		return NULL;
+	if (sg_alloc_table(&buf->sgt, 1, GFP_KERNEL))
+		goto err_free;
+
+	buf->page = rknpu_carveout_alloc(rknpu_dev->carveout, len);
+	if (!buf->page)
+		goto err_free_table;
+
+	buf->dev = rknpu_dev->dev;
+	buf->size = len;
+	buf->order = -1;
+	buf->cacheable = cacheable;
+	buf->carveout = rknpu_dev->carveout;
+	buf->dma_addr = page_to_phys(buf->page);
+
+	memset(page_address(buf->page), 0, len);
+	dma_sync_single_for_device(buf->dev, buf->dma_addr, len,
+				   DMA_BIDIRECTIONAL);
+
+	if (cacheable) {
+		buf->vaddr = page_address(buf->page);
+		return buf;
+	}
 
-	buf->size = PAGE_ALIGN(size);
-	buf->dev = dev;
-	buf->vaddr = dma_alloc_coherent(dev, buf->size, &buf->dma_addr,
-					GFP_KERNEL | __GFP_DMA);
-	if (!buf->vaddr) {
-		kfree(buf);
-		return ERR_PTR(-ENOMEM);
+	dma_sync_single_for_cpu(buf->dev, buf->dma_addr, len, DMA_FROM_DEVICE);
+
+	pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		goto err_free_carveout;
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = nth_page(buf->page, i);
+	buf->vaddr = vmap(pages, nr_pages, VM_MAP,
+			  pgprot_dmacoherent(PAGE_KERNEL));
+	kvfree(pages);
+	if (!buf->vaddr)
+		goto err_free_carveout;
+
+	return buf;
+
+err_free_carveout:
+	rknpu_carveout_free(rknpu_dev->carveout, buf->page, len);
+err_free_table:
+	sg_free_table(&buf->sgt);
+err_free:
+	kfree(buf);
+
+	return NULL;
+}
+
+static struct dma_buf *rknpu_dkms_alloc(struct rknpu_device *rknpu_dev,
+					size_t size, unsigned long flags)
+{
+	struct rknpu_mem_pool *pool = rknpu_dev->mem_pool;
+	struct device *dev = rknpu_dev->dev;
+	struct rknpu_dkms_buf *buf = NULL;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+	size_t len = PAGE_ALIGN(size);
+	int order = get_order(len);
+	bool cacheable = dkms_mem_cacheable && (flags & RKNPU_MEM_CACHEABLE);
+
+	/* The carveout is tried first, and is never recycled through the pool */
+	if (rknpu_dev->carveout)
+		buf = rknpu_dkms_carveout_alloc(rknpu_dev, len, cacheable);
+
+	if (buf) {
+		order = -1;
+	} else if (!pool || order > RKNPU_MEM_POOL_MAX_ORDER) {
+		if (pool) {
+			spin_lock(&pool->lock);
+			pool->bypass++;
+			spin_unlock(&pool->lock);
+		}
+		order = -1;
+	} else {
+		buf = rknpu_mem_pool_get(pool, cacheable, order);
+	}
+
+	if (buf) {
+		/*
+		 * The pool is shared by all sessions, a recycled buffer may
+		 * still hold another process's data. Fresh and carveout
+		 * allocations are zeroed already.
+		 */
+		if (!buf->carveout)
+			memset(buf->vaddr, 0, len);
+	} else {
+		buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+		if (!buf)
+			return ERR_PTR(-ENOMEM);
+
+		buf->size = order < 0 ? len : PAGE_SIZE << order;
+		buf->dev = dev;
+		buf->order = order;
+		buf->cacheable = cacheable;
+		if (sg_alloc_table(&buf->sgt, 1, GFP_KERNEL)) {
+			kfree(buf);
+			return ERR_PTR(-ENOMEM);
+		}
+		if (cacheable) {
+			/* dma_alloc_pages() rejects zone modifiers, dma_mask picks the zone */
+			buf->page = dma_alloc_pages(dev, buf->size,
+						    &buf->dma_addr,
+						    DMA_BIDIRECTIONAL, GFP_KERNEL);
+			buf->vaddr = buf->page ? page_address(buf->page) : NULL;
+		} else {
+			buf->vaddr = dma_alloc_coherent(dev, buf->size,
+							&buf->dma_addr,
+							GFP_KERNEL);
+		}
+		if (!buf->vaddr) {
+			sg_free_table(&buf->sgt);
+			kfree(buf);
+			return ERR_PTR(-ENOMEM);
+		}
+		if (pool) {
+			kref_get(&pool->ref);
+			buf->pool = pool;
+		}
 	}
+	buf->len = len;
+	buf->shared = false;
+	buf->cpu_touched = false;
+
+	/* Write back the zeroing (or stale lines) before handing it out */
+	if (buf->cacheable)
+		dma_sync_single_for_device(dev, buf->dma_addr, buf->len,
+					   DMA_BIDIRECTIONAL);
+	sg_set_page(buf->sgt.sgl,
+		    buf->page ? buf->page : virt_to_page(buf->vaddr),
+		    buf->len, 0);
+	sg_dma_address(buf->sgt.sgl) = buf->dma_addr;
+	sg_dma_len(buf->sgt.sgl) = buf->len;
 
 	exp_info.ops = &rknpu_dkms_buf_ops;
-	exp_info.size = buf->size;
+	exp_info.size = buf->len;
 	exp_info.flags = O_CLOEXEC | O_RDWR;
 	exp_info.priv = buf;
 
 	dmabuf = dma_buf_export(&exp_info);
 	if (IS_ERR(dmabuf)) {
-		dma_free_coherent(dev, buf->size, buf->vaddr, buf->dma_addr);
-		kfree(buf);
+		if (!rknpu_mem_pool_put(buf))
+			rknpu_dkms_buf_free(buf);
 	}
 
 	return dmabuf;
 }
 
-/**
- * rknpu_mem_find_by_obj_addr - Validate and find mem_object by its kernel address
- * @rknpu_dev: RKNPU device
- * @file: File handle (contains session)
- * @obj_addr: The kernel address returned from MEM_CREATE
- *
- * Searches the session's memory object list to validate that obj_addr
- * is a legitimate pointer that was returned to this session. This prevents
- * userspace from passing arbitrary kernel pointers.
- *
- * Returns: pointer to rknpu_mem_object if found, NULL otherwise
+/*
+ * RKNPU_MEM_SLAB_SIZE block that small RKNPU_MEM_SUBALLOC buffers of one
+ * session are carved out of. The block's own reference on @dmabuf is
+ * dropped once its last buffer is freed, every buffer holds another one.
  */
-struct rknpu_mem_object *rknpu_mem_find_by_obj_addr(struct rknpu_device *rknpu_dev,
-						    struct file *file,
-						    __u64 obj_addr)
-{
+struct rknpu_mem_slab {
 	struct rknpu_session *session;
-	struct rknpu_mem_object *entry;
-	struct rknpu_mem_object *found = NULL;
+	struct dma_buf *dmabuf;
+	bool cacheable;
+	unsigned int used;
+	DECLARE_BITMAP(map, RKNPU_MEM_SLAB_GRANULES);
+	struct list_head node;
+};
 
-	if (!file || !file->private_data)
-		return NULL;
+/*
+ * Carve @size bytes for @rknpu_obj out of a block of @session, starting
+ * a new block when none has room. On success @rknpu_obj holds its own
+ * reference on the block dma-buf and rknpu_mem_map() offsets its
+ * addresses by @rknpu_obj->slab_offset.
+ */
+static int rknpu_mem_slab_alloc(struct rknpu_device *rknpu_dev,
+				struct rknpu_session *session,
+				struct rknpu_mem_object *rknpu_obj, size_t size,
+				unsigned long flags)
+{
+	struct rknpu_slab_stats *stats = &rknpu_dev->slab_stats;
+	bool cacheable = dkms_mem_cacheable && (flags & RKNPU_MEM_CACHEABLE);
+	unsigned int nr = DIV_ROUND_UP(size, RKNPU_MEM_SLAB_ALIGN);
+	struct rknpu_mem_slab *slab;
+	struct rknpu_dkms_buf *buf;
+	struct dma_buf *dmabuf;
+	unsigned long start;
 
-	spin_lock(&rknpu_dev->lock);
-	session = file->private_data;
-	list_for_each_entry(entry, &session->list, head) {
-		if ((unsigned long)(uintptr_t)entry == (unsigned long)obj_addr) {
-			found = entry;
-			break;
-		}
+	mutex_lock(&session->slab_lock);
+	list_for_each_entry(slab, &session->slabs, node) {
+		if (slab->cacheable != cacheable)
+			continue;
+		start = bitmap_find_next_zero_area(slab->map,
+						   RKNPU_MEM_SLAB_GRANULES, 0,
+						   nr, 0);
+		if (start < RKNPU_MEM_SLAB_GRANULES)
+			goto found;
 	}
-	spin_unlock(&rknpu_dev->lock);
 
-	return found;
+	slab = kzalloc(sizeof(*slab), GFP_KERNEL);
+	if (!slab) {
+		mutex_unlock(&session->slab_lock);
+		return -ENOMEM;
+	}
+
+	/*
+	 * The handle maps the whole block, so it must not carry anything of
+	 * another process: rknpu_dkms_alloc() zeroes pooled blocks as well.
+	 */
+	dmabuf = rknpu_dkms_alloc(rknpu_dev, RKNPU_MEM_SLAB_SIZE,
+				  flags & RKNPU_MEM_CACHEABLE);
+	if (IS_ERR(dmabuf)) {
+		mutex_unlock(&session->slab_lock);
+		kfree(slab);
+		return PTR_ERR(dmabuf);
+	}
+
+	slab->session = session;
+	slab->dmabuf = dmabuf;
+	slab->cacheable = cacheable;
+	list_add(&slab->node, &session->slabs);
+	atomic64_inc(&stats->blocks);
+	start = 0;
+
+found:
+	bitmap_set(slab->map, start, nr);
+	slab->used += nr;
+	get_dma_buf(slab->dmabuf);
+	mutex_unlock(&session->slab_lock);
+
+	rknpu_obj->dmabuf = slab->dmabuf;
+	rknpu_obj->owner = 1;
+	rknpu_obj->slab = slab;
+	rknpu_obj->slab_offset = start * RKNPU_MEM_SLAB_ALIGN;
+	rknpu_obj->size = nr * RKNPU_MEM_SLAB_ALIGN;
+
+	/*
+	 * A new block is zero, freed granules are only reused within the
+	 * session, clear them on request.
+	 */
+	if (flags & RKNPU_MEM_ZEROING) {
+		buf = slab->dmabuf->priv;
+		memset(buf->vaddr + rknpu_obj->slab_offset, 0,
+		       nr * RKNPU_MEM_SLAB_ALIGN);
+		if (buf->cacheable)
+			dma_sync_single_for_device(buf->dev,
+						   buf->dma_addr +
+							   rknpu_obj->slab_offset,
+						   nr * RKNPU_MEM_SLAB_ALIGN,
+						   DMA_TO_DEVICE);
+	}
+
+	atomic64_inc(&stats->allocs);
+	atomic64_inc(&stats->live);
+	atomic64_add(nr * RKNPU_MEM_SLAB_ALIGN, &stats->live_bytes);
+	atomic64_add(PAGE_ALIGN(size) - nr * RKNPU_MEM_SLAB_ALIGN,
+		     &stats->saved_bytes);
+
+	return 0;
 }
-#endif
 
-int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
-			   unsigned int cmd, unsigned long data)
+/* Give the granules of @rknpu_obj back to its block */
+void rknpu_mem_slab_free(struct rknpu_mem_object *rknpu_obj)
 {
-	struct rknpu_mem_create args;
-	int ret = -EINVAL;
-	struct dma_buf_attachment *attachment;
-	struct sg_table *table;
-	struct dma_buf *dmabuf;
-	struct rknpu_mem_object *rknpu_obj = NULL;
-	struct rknpu_session *session = NULL;
-	int fd;
-	unsigned int in_size = _IOC_SIZE(cmd);
-	unsigned int k_size = sizeof(struct rknpu_mem_create);
-	char *k_data = (char *)&args;
-	struct iosys_map map = { 0 };
-
-	if (unlikely(copy_from_user(&args, (struct rknpu_mem_create *)data,
-				    in_size))) {
-		LOG_ERROR("%s: copy_from_user failed\n", __func__);
-		ret = -EFAULT;
-		return ret;
+	struct rknpu_mem_slab *slab = rknpu_obj->slab;
+	struct rknpu_session *session = slab->session;
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
+	struct rknpu_slab_stats *stats = &rknpu_dev->slab_stats;
+	unsigned int nr = rknpu_obj->size / RKNPU_MEM_SLAB_ALIGN;
+	struct dma_buf *last = NULL;
+
+	mutex_lock(&session->slab_lock);
+	bitmap_clear(slab->map, rknpu_obj->slab_offset / RKNPU_MEM_SLAB_ALIGN,
+		     nr);
+	slab->used -= nr;
+	if (!slab->used) {
+		list_del(&slab->node);
+		last = slab->dmabuf;
+		kfree(slab);
+		atomic64_dec(&stats->blocks);
 	}
+	mutex_unlock(&session->slab_lock);
 
-	if (k_size > in_size)
-		memset(k_data + in_size, 0, k_size - in_size);
+	atomic64_dec(&stats->live);
+	atomic64_sub(rknpu_obj->size, &stats->live_bytes);
+	atomic64_sub(PAGE_ALIGN(rknpu_obj->size) - rknpu_obj->size,
+		     &stats->saved_bytes);
 
-	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL);
-	if (!rknpu_obj)
-		return -ENOMEM;
+	if (last)
+		dma_buf_put(last);
+}
 
-	if (args.handle > 0) {
-		fd = args.handle;
+int rknpu_mem_slab_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_slab_stats *stats = &rknpu_dev->slab_stats;
+
+	seq_printf(m, "blocks: %lld x %u KB\n", atomic64_read(&stats->blocks),
+		   RKNPU_MEM_SLAB_SIZE / SZ_1K);
+	seq_printf(m, "live: %lld, %lld bytes\n", atomic64_read(&stats->live),
+		   atomic64_read(&stats->live_bytes));
+	seq_printf(m, "saved: %lld bytes\n",
+		   atomic64_read(&stats->saved_bytes));
+	seq_printf(m, "allocs: %lld\n", atomic64_read(&stats->allocs));
 
-		dmabuf = dma_buf_get(fd);
-		if (IS_ERR(dmabuf)) {
-			ret = PTR_ERR(dmabuf);
-			goto err_free_obj;
-		}
+	return 0;
+}
 
-		rknpu_obj->dmabuf = dmabuf;
-		rknpu_obj->owner = 0;
-	} else {
-		/* Allocate DMA buffer directly */
-#ifdef RKNPU_DKMS_MISCDEV
-		dmabuf = rknpu_dkms_alloc(rknpu_dev->dev, args.size);
-		if (IS_ERR(dmabuf)) {
-			LOG_ERROR("DKMS direct alloc failed, size=%llu\n",
-				  args.size);
-			ret = PTR_ERR(dmabuf);
-			goto err_free_obj;
-		}
+/*
+ * A pinned user range (RKNPU_MEM_USERPTR) exported as a dma-buf. @sgt
+ * is already mapped for @dev: either the user pages themselves, or the
+ * contiguous @bounce buffer that rknpu_mem_userptr_sync() keeps in step
+ * with the user pages around each job.
+ */
+struct rknpu_userptr {
+	struct device *dev;
+	struct page **pages;
+	unsigned long nr_pages;
+	size_t size;
+	struct sg_table sgt;
+	void *bounce;
+	struct page *bounce_page;
+	dma_addr_t bounce_dma;
+};
 
-		rknpu_obj->dmabuf = dmabuf;
-		rknpu_obj->owner = 1;
+static struct sg_table *rknpu_userptr_map(struct dma_buf_attachment *attach,
+					  enum dma_data_direction dir)
+{
+	struct rknpu_userptr *up = attach->dmabuf->priv;
 
-		fd = dma_buf_fd(dmabuf, O_CLOEXEC | O_RDWR);
-		if (fd < 0) {
-			LOG_ERROR("DKMS direct alloc: fd get failed\n");
-			ret = -EFAULT;
-			goto err_free_dma_buf;
-		}
-#else
-		dmabuf = rk_dma_heap_buffer_alloc(rknpu_dev->heap, args.size,
-					  O_CLOEXEC | O_RDWR, 0x0,
-					  dev_name(rknpu_dev->dev));
-		if (IS_ERR(dmabuf)) {
-			LOG_ERROR("dmabuf alloc failed, args.size = %llu\n",
-				  args.size);
-			ret = PTR_ERR(dmabuf);
-			goto err_free_obj;
-		}
+	/* The table is premapped for the NPU, nothing else may import it */
+	if (attach->dev != up->dev)
+		return ERR_PTR(-EINVAL);
 
-		rknpu_obj->dmabuf = dmabuf;
-		rknpu_obj->owner = 1;
+	return &up->sgt;
+}
 
-		fd = dma_buf_fd(dmabuf, O_CLOEXEC | O_RDWR);
-		if (fd < 0) {
-			LOG_ERROR("dmabuf fd get failed\n");
-			ret = -EFAULT;
-			goto err_free_dma_buf;
-		}
-#endif
-	}
-
-	attachment = dma_buf_attach(dmabuf, rknpu_dev->dev);
-	if (IS_ERR(attachment)) {
-		LOG_ERROR("dma_buf_attach failed\n");
-		ret = PTR_ERR(attachment);
-		goto err_free_dma_buf;
-	}
+static void rknpu_userptr_unmap(struct dma_buf_attachment *attach,
+				struct sg_table *sgt,
+				enum dma_data_direction dir)
+{
+}
 
-	table = dma_buf_map_attachment(attachment, DMA_BIDIRECTIONAL);
-	if (IS_ERR(table)) {
-		LOG_ERROR("dma_buf_map_attachment failed\n");
-		dma_buf_detach(dmabuf, attachment);
-		ret = PTR_ERR(table);
-		goto err_free_dma_buf;
-	}
+static void rknpu_userptr_free(struct rknpu_userptr *up)
+{
+	if (up->bounce)
+		dma_free_pages(up->dev, up->size, up->bounce_page,
+			       up->bounce_dma, DMA_BIDIRECTIONAL);
+	else
+		dma_unmap_sgtable(up->dev, &up->sgt, DMA_BIDIRECTIONAL, 0);
+	sg_free_table(&up->sgt);
+	unpin_user_pages_dirty_lock(up->pages, up->nr_pages, true);
+	kvfree(up->pages);
+	kfree(up);
+}
 
-	if (args.flags & RKNPU_MEM_KERNEL_MAPPING) {
-		ret = dma_buf_vmap(dmabuf, &map);
-		if (ret) {
-			LOG_ERROR("dma_buf_vmap failed\n");
-			goto err_detach_dma_buf;
-		}
-		rknpu_obj->kv_addr = map.vaddr;
-	}
+static void rknpu_userptr_release(struct dma_buf *dmabuf)
+{
+	rknpu_userptr_free(dmabuf->priv);
+}
 
-	rknpu_obj->size = PAGE_ALIGN(args.size);
-	rknpu_obj->dma_addr = sg_dma_address(table->sgl);
-	rknpu_obj->sgt = table;
-	rknpu_obj->attachment = attachment;
+static const struct dma_buf_ops rknpu_userptr_ops = {
+	.map_dma_buf = rknpu_userptr_map,
+	.unmap_dma_buf = rknpu_userptr_unmap,
+	.release = rknpu_userptr_release,
+};
 
-	args.size = rknpu_obj->size;
-	args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
-	args.dma_addr = rknpu_obj->dma_addr;
-	args.handle = fd;
+/*
+ * Map the pinned pages directly when the NPU can see them as one linear
+ * range: through the IOMMU, or physically contiguous below 4 GB.
+ */
+static int rknpu_userptr_map_direct(struct rknpu_device *rknpu_dev,
+				    struct rknpu_userptr *up)
+{
+	unsigned long i;
+	int ret;
 
-	LOG_DEBUG(
-		"args.handle: %d, args.size: %lld, rknpu_obj: %#llx, rknpu_obj->dma_addr: %#llx\n",
-		args.handle, args.size, (__u64)(uintptr_t)rknpu_obj,
-		(__u64)rknpu_obj->dma_addr);
+	if (!rknpu_dev->iommu_en) {
+		phys_addr_t start = page_to_phys(up->pages[0]);
 
-	if (unlikely(copy_to_user((struct rknpu_mem_create *)data, &args,
-				  in_size))) {
-		LOG_ERROR("%s: copy_to_user failed\n", __func__);
-		ret = -EFAULT;
-		goto err_unmap_kv_addr;
+		for (i = 1; i < up->nr_pages; i++) {
+			if (page_to_phys(up->pages[i]) !=
+			    start + (i << PAGE_SHIFT))
+				return -EINVAL;
+		}
+		if (start + up->size - 1 > DMA_BIT_MASK(32))
+			return -EINVAL;
 	}
 
-	spin_lock(&rknpu_dev->lock);
+	ret = sg_alloc_table_from_pages(&up->sgt, up->pages, up->nr_pages, 0,
+					up->size, GFP_KERNEL);
+	if (ret)
+		return ret;
 
-	session = file->private_data;
-	if (!session) {
-		spin_unlock(&rknpu_dev->lock);
-		ret = -EFAULT;
-		goto err_unmap_kv_addr;
-	}
-	list_add_tail(&rknpu_obj->head, &session->list);
+	ret = dma_map_sgtable(up->dev, &up->sgt, DMA_BIDIRECTIONAL, 0);
+	if (ret)
+		goto err_free_table;
 
-	spin_unlock(&rknpu_dev->lock);
+	if (!rknpu_sgt_dma_contiguous(&up->sgt)) {
+		ret = -EINVAL;
+		goto err_unmap;
+	}
 
 	return 0;
 
-err_unmap_kv_addr:
-	dma_buf_vunmap(rknpu_obj->dmabuf, &map);
-	rknpu_obj->kv_addr = NULL;
+err_unmap:
+	dma_unmap_sgtable(up->dev, &up->sgt, DMA_BIDIRECTIONAL, 0);
+err_free_table:
+	sg_free_table(&up->sgt);
 
-err_detach_dma_buf:
-	dma_buf_unmap_attachment(attachment, table, DMA_BIDIRECTIONAL);
-	dma_buf_detach(dmabuf, attachment);
+	return ret;
+}
 
-err_free_dma_buf:
-	if (rknpu_obj->owner) {
-#if defined(RKNPU_DKMS_MISCDEV)
-		dma_buf_put(dmabuf);
-#elif defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
-		rk_dma_heap_buffer_free(dmabuf);
-#else
-		dma_buf_put(dmabuf);
-#endif
-	} else {
-		dma_buf_put(dmabuf);
+static int rknpu_userptr_alloc_bounce(struct rknpu_userptr *up)
+{
+	up->bounce_page = dma_alloc_pages(up->dev, up->size, &up->bounce_dma,
+					  DMA_BIDIRECTIONAL, GFP_KERNEL);
+	if (!up->bounce_page)
+		return -ENOMEM;
+
+	if (sg_alloc_table(&up->sgt, 1, GFP_KERNEL)) {
+		dma_free_pages(up->dev, up->size, up->bounce_page,
+			       up->bounce_dma, DMA_BIDIRECTIONAL);
+		return -ENOMEM;
 	}
 
-err_free_obj:
-	kfree(rknpu_obj);
+	up->bounce = page_address(up->bounce_page);
+	sg_set_page(up->sgt.sgl, up->bounce_page, up->size, 0);
+	sg_dma_address(up->sgt.sgl) = up->bounce_dma;
+	sg_dma_len(up->sgt.sgl) = up->size;
 
-	return ret;
+	return 0;
 }
 
-int rknpu_mem_destroy_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
-			    unsigned long data)
+static struct dma_buf *rknpu_userptr_import(struct rknpu_device *rknpu_dev,
+					    __u64 userptr, __u64 size,
+					    __u32 *mode)
 {
-	struct rknpu_mem_object *rknpu_obj, *entry, *q;
-	struct rknpu_session *session = NULL;
-	struct rknpu_mem_destroy args;
-	int ret = -EFAULT;
-	bool found = false;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct rknpu_userptr *up;
+	struct dma_buf *dmabuf;
+	int pinned;
+	int ret;
 
-	if (unlikely(copy_from_user(&args, (struct rknpu_mem_destroy *)data,
-				    sizeof(struct rknpu_mem_destroy)))) {
-		LOG_ERROR("%s: copy_from_user failed\n", __func__);
-		ret = -EFAULT;
-		return ret;
-	}
+	if (!size || !PAGE_ALIGNED(userptr))
+		return ERR_PTR(-EINVAL);
 
-	#ifndef RKNPU_DKMS
-	if (!kern_addr_valid(args.obj_addr)) {
-		LOG_ERROR("%s: invalid obj_addr: %#llx\n", __func__,
-			  (__u64)(uintptr_t)args.obj_addr);
-		ret = -EINVAL;
-		return ret;
-	}
-	#endif
+	up = kzalloc(sizeof(*up), GFP_KERNEL);
+	if (!up)
+		return ERR_PTR(-ENOMEM);
 
-	rknpu_obj = (struct rknpu_mem_object *)(uintptr_t)args.obj_addr;
+	up->dev = rknpu_dev->dev;
+	up->size = PAGE_ALIGN(size);
+	up->nr_pages = up->size >> PAGE_SHIFT;
+	up->pages = kvmalloc_array(up->nr_pages, sizeof(*up->pages),
+				   GFP_KERNEL);
+	if (!up->pages) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
 
-	spin_lock(&rknpu_dev->lock);
-	session = file->private_data;
-	if (!session) {
-		spin_unlock(&rknpu_dev->lock);
+	pinned = pin_user_pages_fast(userptr, up->nr_pages,
+				     FOLL_WRITE | FOLL_LONGTERM, up->pages);
+	if (pinned < 0) {
+		ret = pinned;
+		goto err_free_pages;
+	}
+	if (pinned != up->nr_pages) {
+		unpin_user_pages(up->pages, pinned);
 		ret = -EFAULT;
-		return ret;
+		goto err_free_pages;
 	}
-	list_for_each_entry_safe(entry, q, &session->list, head) {
-		if (entry == rknpu_obj) {
-			list_del(&entry->head);
-			found = true;
-			rknpu_obj = entry;
-			break;
+
+	if (!rknpu_userptr_map_direct(rknpu_dev, up)) {
+		*mode = RKNPU_USERPTR_DIRECT;
+	} else {
+		ret = rknpu_userptr_alloc_bounce(up);
+		if (ret) {
+			unpin_user_pages(up->pages, up->nr_pages);
+			goto err_free_pages;
 		}
+		*mode = RKNPU_USERPTR_BOUNCE;
 	}
-	spin_unlock(&rknpu_dev->lock);
 
-	if (!found) {
-		ret = -EINVAL;
-		return ret;
-	}
+	exp_info.ops = &rknpu_userptr_ops;
+	exp_info.size = up->size;
+	exp_info.flags = O_CLOEXEC | O_RDWR;
+	exp_info.priv = up;
 
-	LOG_DEBUG(
-		"free args.handle: %d, rknpu_obj: %#llx, rknpu_obj->dma_addr: %#llx\n",
-		args.handle, (__u64)(uintptr_t)rknpu_obj,
-		(__u64)rknpu_obj->dma_addr);
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf))
+		rknpu_userptr_free(up);
 
-	if (rknpu_obj->kv_addr) {
-		struct iosys_map map = IOSYS_MAP_INIT_VADDR(rknpu_obj->kv_addr);
-		dma_buf_vunmap(rknpu_obj->dmabuf, &map);
-		rknpu_obj->kv_addr = NULL;
-	}
+	return dmabuf;
 
-	dma_buf_unmap_attachment(rknpu_obj->attachment, rknpu_obj->sgt,
-				 DMA_BIDIRECTIONAL);
-	dma_buf_detach(rknpu_obj->dmabuf, rknpu_obj->attachment);
+err_free_pages:
+	kvfree(up->pages);
+err_free:
+	kfree(up);
 
-	if (!rknpu_obj->owner)
-		dma_buf_put(rknpu_obj->dmabuf);
+	return ERR_PTR(ret);
+}
 
-	kfree(rknpu_obj);
+static bool rknpu_mem_is_bounce(struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_userptr *up;
 
-	return 0;
+	if (!(rknpu_obj->flags & RKNPU_MEM_USERPTR))
+		return false;
+
+	up = rknpu_obj->dmabuf->priv;
+	return up->bounce != NULL;
 }
 
 /*
- * begin cpu access => for_cpu = true
- * end cpu access => for_cpu = false
+ * Take a reference on the dma-buf of the buffer @obj_addr of the session
+ * behind @file if it is a bounced userptr buffer, else return NULL.
  */
-static void __maybe_unused rknpu_dma_buf_sync(
-	struct rknpu_device *rknpu_dev, struct rknpu_mem_object *rknpu_obj,
-	u32 offset, u32 length, enum dma_data_direction dir, bool for_cpu)
+struct dma_buf *rknpu_mem_userptr_get(struct rknpu_device *rknpu_dev,
+				      struct file *file, __u64 obj_addr)
 {
-	struct device *dev = rknpu_dev->dev;
-	struct sg_table *sgt = rknpu_obj->sgt;
-	struct scatterlist *sg = sgt->sgl;
-	dma_addr_t sg_dma_addr = sg_dma_address(sg);
-	unsigned int len = 0;
-	int i;
+	struct rknpu_session *session = NULL;
+	struct rknpu_mem_object *entry;
+	struct dma_buf *dmabuf = NULL;
 
-	for_each_sgtable_sg(sgt, sg, i) {
-		unsigned int sg_offset, sg_left, size = 0;
+	if (!file || !obj_addr)
+		return NULL;
 
-		len += sg->length;
-		if (len <= offset) {
-			sg_dma_addr += sg->length;
-			continue;
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (session) {
+		entry = rknpu_mem_session_find(session, obj_addr);
+		if (entry && rknpu_mem_is_bounce(entry)) {
+			get_dma_buf(entry->dmabuf);
+			dmabuf = entry->dmabuf;
 		}
+	}
+	spin_unlock(&rknpu_dev->lock);
 
-		sg_left = len - offset;
-		sg_offset = sg->length - sg_left;
+	return dmabuf;
+}
 
-		size = (length < sg_left) ? length : sg_left;
+/*
+ * Take a reference on the shadow of the buffer @obj_addr of the session
+ * behind @file if it is a scattered import, else return NULL.
+ */
+struct rknpu_shadow *rknpu_mem_shadow_get(struct rknpu_device *rknpu_dev,
+					  struct file *file, __u64 obj_addr)
+{
+	struct rknpu_session *session = NULL;
+	struct rknpu_mem_object *entry;
+	struct rknpu_shadow *shadow = NULL;
 
-		if (for_cpu)
-			dma_sync_single_range_for_cpu(dev, sg_dma_addr,
-						      sg_offset, size, dir);
-		else
-			dma_sync_single_range_for_device(dev, sg_dma_addr,
-							 sg_offset, size, dir);
+	if (!file || !obj_addr)
+		return NULL;
 
-		offset += size;
-		length -= size;
-		sg_dma_addr += sg->length;
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (session) {
+		entry = rknpu_mem_session_find(session, obj_addr);
+		if (entry && entry->shadow) {
+			rknpu_shadow_ref(entry->shadow);
+			shadow = entry->shadow;
+		}
+	}
+	spin_unlock(&rknpu_dev->lock);
 
-		if (length == 0)
-			break;
+	return shadow;
+}
+
+/*
+ * Copy [@offset, @offset + @size) of the user pages into the bounce
+ * buffer before a job, or back out after it.
+ */
+void rknpu_mem_userptr_sync(struct dma_buf *dmabuf, u64 offset, u64 size,
+			    bool to_device)
+{
+	struct rknpu_userptr *up = dmabuf->priv;
+	unsigned long pos, end, in_page, len;
+	void *vaddr;
+
+	if (offset >= up->size)
+		return;
+	size = min_t(u64, size, up->size - offset);
+	end = offset + size;
+
+	if (!to_device)
+		dma_sync_single_for_cpu(up->dev, up->bounce_dma + offset, size,
+					DMA_FROM_DEVICE);
+
+	for (pos = offset; pos < end; pos += len) {
+		in_page = offset_in_page(pos);
+		len = min_t(unsigned long, end - pos, PAGE_SIZE - in_page);
+		vaddr = kmap_local_page(up->pages[pos >> PAGE_SHIFT]);
+		if (to_device)
+			memcpy(up->bounce + pos, vaddr + in_page, len);
+		else
+			memcpy(vaddr + in_page, up->bounce + pos, len);
+		kunmap_local(vaddr);
 	}
+
+	if (to_device)
+		dma_sync_single_for_device(up->dev, up->bounce_dma + offset,
+					   size, DMA_TO_DEVICE);
 }
 
-int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
-			 unsigned long data)
+/**
+ * rknpu_mem_find_by_obj_addr - Validate and find mem_object by its kernel address
+ * @rknpu_dev: RKNPU device
+ * @file: File handle (contains session)
+ * @obj_addr: The kernel address returned from MEM_CREATE
+ *
+ * Searches the session's memory object list to validate that obj_addr
+ * is a legitimate pointer that was returned to this session. This prevents
+ * userspace from passing arbitrary kernel pointers.
+ *
+ * Returns: pointer to rknpu_mem_object if found, NULL otherwise
+ */
+struct rknpu_mem_object *rknpu_mem_find_by_obj_addr(struct rknpu_device *rknpu_dev,
+						    struct file *file,
+						    __u64 obj_addr)
 {
-	struct rknpu_mem_object *rknpu_obj = NULL;
+	struct rknpu_session *session;
 	struct rknpu_mem_object *entry;
-	struct rknpu_session *session = NULL;
-	struct rknpu_mem_sync args;
-#ifdef CONFIG_DMABUF_PARTIAL
-	struct dma_buf *dmabuf;
-#endif
-	int ret = -EFAULT;
+	struct rknpu_mem_object *found = NULL;
 
-	if (unlikely(copy_from_user(&args, (struct rknpu_mem_sync *)data,
-				    sizeof(struct rknpu_mem_sync)))) {
-		LOG_ERROR("%s: copy_from_user failed\n", __func__);
-		ret = -EFAULT;
-		return ret;
-	}
+	if (!file || !file->private_data)
+		return NULL;
 
 	spin_lock(&rknpu_dev->lock);
 	session = file->private_data;
-	if (!session) {
-		spin_unlock(&rknpu_dev->lock);
-		ret = -EFAULT;
-		return ret;
-	}
 	list_for_each_entry(entry, &session->list, head) {
-		if ((unsigned long)(uintptr_t)entry == (unsigned long)args.obj_addr) {
-			rknpu_obj = entry;
+		if ((unsigned long)(uintptr_t)entry == (unsigned long)obj_addr) {
+			found = entry;
 			break;
 		}
 	}
 	spin_unlock(&rknpu_dev->lock);
 
-	if (!rknpu_obj) {
-		ret = -EINVAL;
-		return ret;
-	}
-
-#ifndef CONFIG_DMABUF_PARTIAL
-	if (args.flags & RKNPU_MEM_SYNC_TO_DEVICE) {
-		rknpu_dma_buf_sync(rknpu_dev, rknpu_obj, args.offset, args.size,
-				   DMA_TO_DEVICE, false);
-	}
-	if (args.flags & RKNPU_MEM_SYNC_FROM_DEVICE) {
-		rknpu_dma_buf_sync(rknpu_dev, rknpu_obj, args.offset, args.size,
-				   DMA_FROM_DEVICE, true);
-	}
-#else
-	dmabuf = rknpu_obj->dmabuf;
-	if (args.flags & RKNPU_MEM_SYNC_TO_DEVICE) {
-		dmabuf->ops->end_cpu_access_partial(dmabuf, DMA_TO_DEVICE,
-						    args.offset, args.size);
-	}
-	if (args.flags & RKNPU_MEM_SYNC_FROM_DEVICE) {
-		dmabuf->ops->begin_cpu_access_partial(dmabuf, DMA_FROM_DEVICE,
-						      args.offset, args.size);
-	}
-#endif
-
-	return 0;
+	return found;
 }
-
 #endif
+
+/*
+ * Set up the device and kernel view of @rknpu_obj->dmabuf.
+ *
+ * Buffers exported by rknpu_dkms_alloc() already carry their DMA address,
+ * kernel mapping and sg_table, so they skip the attach/map/vmap
+ * round-trip; @rknpu_obj->attachment stays NULL for them.
+ */
+static int rknpu_mem_map(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj,
+			 unsigned long flags)
+{
+	struct dma_buf *dmabuf = rknpu_obj->dmabuf;
+	struct dma_buf_attachment *attachment;
+	struct sg_table *table;
+	struct iosys_map map = { 0 };
+	int ret;
+
+#ifdef RKNPU_DKMS_MISCDEV
+	if (rknpu_obj->owner && dmabuf->ops == &rknpu_dkms_buf_ops) {
+		struct rknpu_dkms_buf *buf = dmabuf->priv;
+
+		rknpu_obj->kv_addr = buf->vaddr + rknpu_obj->slab_offset;
+		rknpu_obj->dma_addr = buf->dma_addr + rknpu_obj->slab_offset;
+		rknpu_obj->sgt = &buf->sgt;
+		rknpu_obj->attachment = NULL;
+		if (!buf->cacheable)
+			rknpu_obj->flags &= ~RKNPU_MEM_CACHEABLE;
+		return 0;
+	}
+
+	if (rknpu_obj->flags & RKNPU_MEM_USERPTR) {
+		struct rknpu_userptr *up = dmabuf->priv;
+
+		rknpu_obj->kv_addr = up->bounce;
+		rknpu_obj->dma_addr = sg_dma_address(up->sgt.sgl);
+		rknpu_obj->sgt = &up->sgt;
+		rknpu_obj->attachment = NULL;
+		/* User pages are always cacheable */
+		rknpu_obj->flags |= RKNPU_MEM_CACHEABLE;
+		return 0;
+	}
+#endif
+
+	attachment = dma_buf_attach(dmabuf, rknpu_dev->dev);
+	if (IS_ERR(attachment)) {
+		LOG_ERROR("dma_buf_attach failed\n");
+		return PTR_ERR(attachment);
+	}
+
+	table = dma_buf_map_attachment(attachment, DMA_BIDIRECTIONAL);
+	if (IS_ERR(table)) {
+		LOG_ERROR("dma_buf_map_attachment failed\n");
+		dma_buf_detach(dmabuf, attachment);
+		return PTR_ERR(table);
+	}
+
+	if (flags & RKNPU_MEM_KERNEL_MAPPING) {
+		ret = dma_buf_vmap(dmabuf, &map);
+		if (ret) {
+			LOG_ERROR("dma_buf_vmap failed\n");
+			dma_buf_unmap_attachment(attachment, table,
+						 DMA_BIDIRECTIONAL);
+			dma_buf_detach(dmabuf, attachment);
+			return ret;
+		}
+		rknpu_obj->kv_addr = map.vaddr;
+	}
+
+	/*
+	 * The NPU only takes a start address, a scattered import (no IOMMU
+	 * to linearize it) runs on a contiguous shadow instead. The caller
+	 * has to ask for it, only its MEM_SYNC calls keep the copy current.
+	 */
+	if (!rknpu_dev->iommu_en && !rknpu_sgt_dma_contiguous(table)) {
+		if (flags & RKNPU_MEM_SHADOW)
+			ret = rknpu_shadow_get(rknpu_dev, dmabuf,
+					       &rknpu_obj->shadow);
+		else
+			ret = -EINVAL;
+		if (ret) {
+			LOG_ERROR("no shadow for scattered import: %d\n", ret);
+			if (rknpu_obj->kv_addr) {
+				dma_buf_vunmap(dmabuf, &map);
+				rknpu_obj->kv_addr = NULL;
+			}
+			dma_buf_unmap_attachment(attachment, table,
+						 DMA_BIDIRECTIONAL);
+			dma_buf_detach(dmabuf, attachment);
+			return ret;
+		}
+		rknpu_obj->dma_addr = rknpu_shadow_dma_addr(rknpu_obj->shadow);
+	} else {
+		rknpu_obj->dma_addr = sg_dma_address(table->sgl);
+	}
+	rknpu_obj->sgt = table;
+	rknpu_obj->attachment = attachment;
+
+	return 0;
+}
+
+void rknpu_mem_unmap(struct rknpu_mem_object *rknpu_obj)
+{
+	if (!rknpu_obj->attachment) {
+		/* Self-owned buffer, nothing was attached or mapped */
+		rknpu_obj->kv_addr = NULL;
+		rknpu_obj->sgt = NULL;
+		return;
+	}
+
+	if (rknpu_obj->kv_addr) {
+		struct iosys_map map = IOSYS_MAP_INIT_VADDR(rknpu_obj->kv_addr);
+
+		dma_buf_vunmap(rknpu_obj->dmabuf, &map);
+		rknpu_obj->kv_addr = NULL;
+	}
+
+	if (rknpu_obj->shadow) {
+		rknpu_shadow_put(rknpu_obj->shadow);
+		rknpu_obj->shadow = NULL;
+	}
+
+	dma_buf_unmap_attachment(rknpu_obj->attachment, rknpu_obj->sgt,
+				 DMA_BIDIRECTIONAL);
+	dma_buf_detach(rknpu_obj->dmabuf, rknpu_obj->attachment);
+	rknpu_obj->attachment = NULL;
+	rknpu_obj->sgt = NULL;
+}
+
+static int rknpu_share_file_release(struct inode *inode, struct file *file)
+{
+	dma_buf_put(file->private_data);
+
+	return 0;
+}
+
+/* Refuse writable mappings, and mprotect() to writable later on */
+static int rknpu_share_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return dma_buf_mmap(file->private_data, vma, vma->vm_pgoff);
+}
+
+/* Read-only stand-in for the O_RDWR dma-buf file of a looked up buffer */
+static const struct file_operations rknpu_share_fops = {
+	.owner = THIS_MODULE,
+	.release = rknpu_share_file_release,
+	.mmap = rknpu_share_file_mmap,
+};
+
+static void rknpu_mem_share_put(struct rknpu_share *share)
+{
+	struct rknpu_device *rknpu_dev = share->rknpu_dev;
+	bool last;
+
+	mutex_lock(&rknpu_dev->share_lock);
+	last = !--share->users;
+	if (last)
+		list_del(&share->node);
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	if (last) {
+		dma_buf_put(share->dmabuf);
+		kfree(share);
+	}
+}
+
+/* Owned buffers other than userptr and sub-allocated ones live on their fd */
+static bool rknpu_mem_holds_ref(struct rknpu_mem_object *rknpu_obj)
+{
+	return !rknpu_obj->owner || (rknpu_obj->flags & RKNPU_MEM_USERPTR) ||
+	       rknpu_obj->slab;
+}
+
+/* Imports reuse the caller's fd, everything else gets a new one */
+static bool rknpu_mem_needs_fd(struct rknpu_mem_create *args)
+{
+	return (args->flags & RKNPU_MEM_USERPTR) || !args->handle;
+}
+
+/* Unmap @rknpu_obj, drop the references it holds and free it */
+static void rknpu_mem_obj_release(struct kref *ref)
+{
+	struct rknpu_mem_object *rknpu_obj =
+		container_of(ref, struct rknpu_mem_object, ref);
+
+	rknpu_mem_unmap(rknpu_obj);
+
+#ifdef RKNPU_DKMS_MISCDEV
+	if (rknpu_obj->slab)
+		rknpu_mem_slab_free(rknpu_obj);
+#endif
+	if (rknpu_obj->share)
+		rknpu_mem_share_put(rknpu_obj->share);
+	if (rknpu_mem_holds_ref(rknpu_obj))
+		dma_buf_put(rknpu_obj->dmabuf);
+
+	kfree(rknpu_obj);
+}
+
+/*
+ * Drop the owner's reference on @rknpu_obj, which is only torn down once
+ * no job uses it anymore.
+ */
+void rknpu_mem_free_obj(struct rknpu_mem_object *rknpu_obj)
+{
+	kref_put(&rknpu_obj->ref, rknpu_mem_obj_release);
+}
+
+static void rknpu_session_release(struct kref *ref)
+{
+	struct rknpu_session *session =
+		container_of(ref, struct rknpu_session, ref);
+
+	kfree(session);
+}
+
+void rknpu_session_get(struct rknpu_session *session)
+{
+	kref_get(&session->ref);
+}
+
+void rknpu_session_put(struct rknpu_session *session)
+{
+	kref_put(&session->ref, rknpu_session_release);
+}
+
+/*
+ * Undo rknpu_mem_create_obj() before an fd was installed, at which point
+ * nothing else owns a freshly exported buffer.
+ */
+static void rknpu_mem_create_rollback(struct rknpu_mem_object *rknpu_obj)
+{
+	struct dma_buf *dmabuf = rknpu_obj->dmabuf;
+	bool holds_ref = rknpu_mem_holds_ref(rknpu_obj);
+
+	rknpu_mem_free_obj(rknpu_obj);
+	if (holds_ref)
+		return;
+
+#if defined(RKNPU_DKMS_MISCDEV) || !defined(CONFIG_ROCKCHIP_RKNPU_DMA_HEAP)
+	dma_buf_put(dmabuf);
+#else
+	rk_dma_heap_buffer_free(dmabuf);
+#endif
+}
+
+/*
+ * Allocate, wrap or import the buffer described by @args and map it for
+ * the device, filling in the size and addresses of @args. No fd is
+ * installed and the object is not on the session list yet, so the whole
+ * thing can still be undone with rknpu_mem_create_rollback().
+ */
+static int rknpu_mem_create_obj(struct rknpu_device *rknpu_dev,
+				struct rknpu_session *session,
+				struct rknpu_mem_create *args,
+				struct rknpu_mem_object **out)
+{
+	struct rknpu_mem_object *rknpu_obj;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL);
+	if (!rknpu_obj)
+		return -ENOMEM;
+	kref_init(&rknpu_obj->ref);
+	rknpu_sync_track_init(&rknpu_obj->sync_track);
+
+	if (args->flags & RKNPU_MEM_USERPTR) {
+#ifdef RKNPU_DKMS_MISCDEV
+		dmabuf = rknpu_userptr_import(rknpu_dev, args->userptr,
+					      args->size, &args->userptr_mode);
+		if (IS_ERR(dmabuf)) {
+			LOG_ERROR("userptr import failed, size=%llu\n",
+				  args->size);
+			ret = PTR_ERR(dmabuf);
+			goto err_free_obj;
+		}
+
+		rknpu_obj->dmabuf = dmabuf;
+		rknpu_obj->owner = 1;
+#else
+		ret = -EINVAL;
+		goto err_free_obj;
+#endif
+	} else if (args->handle > 0) {
+		dmabuf = dma_buf_get(args->handle);
+		if (IS_ERR(dmabuf)) {
+			ret = PTR_ERR(dmabuf);
+			goto err_free_obj;
+		}
+
+		rknpu_obj->dmabuf = dmabuf;
+		rknpu_obj->owner = 0;
+	} else if ((args->flags & RKNPU_MEM_SUBALLOC) && args->size &&
+		   args->size <= RKNPU_MEM_SLAB_MAX_SIZE) {
+#ifdef RKNPU_DKMS_MISCDEV
+		ret = rknpu_mem_slab_alloc(rknpu_dev, session, rknpu_obj,
+					   args->size, args->flags);
+		if (ret) {
+			LOG_ERROR("sub-allocation failed, size=%llu\n",
+				  args->size);
+			goto err_free_obj;
+		}
+#else
+		ret = -EINVAL;
+		goto err_free_obj;
+#endif
+	} else {
+		/* Allocate DMA buffer directly */
+#ifdef RKNPU_DKMS_MISCDEV
+		dmabuf = rknpu_dkms_alloc(rknpu_dev, args->size, args->flags);
+		/* closed sessions may still be on their way out */
+		if (IS_ERR(dmabuf) && rknpu_reap_flush(rknpu_dev))
+			dmabuf = rknpu_dkms_alloc(rknpu_dev, args->size,
+						  args->flags);
+		if (IS_ERR(dmabuf)) {
+			LOG_ERROR("DKMS direct alloc failed, size=%llu\n",
+				  args->size);
+			ret = PTR_ERR(dmabuf);
+			goto err_free_obj;
+		}
+#else
+		dmabuf = rk_dma_heap_buffer_alloc(rknpu_dev->heap, args->size,
+					  O_CLOEXEC | O_RDWR, 0x0,
+					  dev_name(rknpu_dev->dev));
+		if (IS_ERR(dmabuf)) {
+			LOG_ERROR("dmabuf alloc failed, args.size = %llu\n",
+				  args->size);
+			ret = PTR_ERR(dmabuf);
+			goto err_free_obj;
+		}
+#endif
+
+		rknpu_obj->dmabuf = dmabuf;
+		rknpu_obj->owner = 1;
+	}
+
+	rknpu_obj->flags = args->flags;
+
+	ret = rknpu_mem_map(rknpu_dev, rknpu_obj, args->flags);
+	if (ret) {
+		rknpu_mem_create_rollback(rknpu_obj);
+		return ret;
+	}
+
+	if (!rknpu_obj->slab)
+		rknpu_obj->size = PAGE_ALIGN(args->size);
+
+	args->size = rknpu_obj->size;
+	args->obj_addr = (__u64)(uintptr_t)rknpu_obj;
+	args->dma_addr = rknpu_obj->dma_addr;
+	args->offset = rknpu_obj->slab_offset;
+
+	*out = rknpu_obj;
+
+	return 0;
+
+err_free_obj:
+	kfree(rknpu_obj);
+
+	return ret;
+}
+
+/* Publish @rknpu_obj on @fd, which can no longer be taken back */
+static void rknpu_mem_install_fd(struct rknpu_mem_object *rknpu_obj, int fd)
+{
+	if (rknpu_mem_holds_ref(rknpu_obj))
+		get_dma_buf(rknpu_obj->dmabuf);
+	fd_install(fd, rknpu_obj->dmabuf->file);
+}
+
+int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			   unsigned int cmd, unsigned long data)
+{
+	struct rknpu_mem_create args;
+	int ret = -EINVAL;
+	struct rknpu_mem_object *rknpu_obj = NULL;
+	struct rknpu_session *session = NULL;
+	int fd = -1;
+	unsigned int in_size = _IOC_SIZE(cmd);
+	unsigned int k_size = sizeof(struct rknpu_mem_create);
+	char *k_data = (char *)&args;
+
+	if (in_size > k_size)
+		in_size = k_size;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_create *)data,
+				    in_size))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	if (k_size > in_size)
+		memset(k_data + in_size, 0, k_size - in_size);
+
+	ret = rknpu_mem_create_obj(rknpu_dev, file->private_data, &args,
+				   &rknpu_obj);
+	if (ret)
+		return ret;
+
+	if (rknpu_mem_needs_fd(&args)) {
+		fd = get_unused_fd_flags(O_CLOEXEC);
+		if (fd < 0) {
+			LOG_ERROR("dmabuf fd get failed\n");
+			ret = fd;
+			goto err_rollback;
+		}
+		args.handle = fd;
+	}
+
+	LOG_DEBUG(
+		"args.handle: %d, args.size: %lld, rknpu_obj: %#llx, rknpu_obj->dma_addr: %#llx\n",
+		args.handle, args.size, (__u64)(uintptr_t)rknpu_obj,
+		(__u64)rknpu_obj->dma_addr);
+
+	if (unlikely(copy_to_user((struct rknpu_mem_create *)data, &args,
+				  in_size))) {
+		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		ret = -EFAULT;
+		goto err_put_fd;
+	}
+
+	spin_lock(&rknpu_dev->lock);
+
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		goto err_put_fd;
+	}
+	list_add_tail(&rknpu_obj->head, &session->list);
+
+	spin_unlock(&rknpu_dev->lock);
+
+	if (fd >= 0)
+		rknpu_mem_install_fd(rknpu_obj, fd);
+
+	return 0;
+
+err_put_fd:
+	if (fd >= 0)
+		put_unused_fd(fd);
+
+err_rollback:
+	rknpu_mem_create_rollback(rknpu_obj);
+
+	return ret;
+}
+
+/*
+ * Create every buffer of the array first, then reserve all fds, report
+ * back and publish everything under a single hold of the device lock.
+ * Any failure before that point undoes all entries.
+ */
+int rknpu_mem_create_vec_ioctl(struct rknpu_device *rknpu_dev,
+			       struct file *file, unsigned long data)
+{
+	struct rknpu_mem_object **rknpu_objs = NULL;
+	struct rknpu_mem_create_vec args;
+	struct rknpu_session *session;
+	struct rknpu_mem_create *creates;
+	int *fds = NULL;
+	int ret = 0;
+	int i;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_create_vec *)data,
+				    sizeof(struct rknpu_mem_create_vec)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	if (args.count == 0)
+		return 0;
+	if (args.count > RKNPU_MEM_VEC_MAX)
+		return -EINVAL;
+
+	creates = memdup_user(u64_to_user_ptr(args.creates),
+			      args.count * sizeof(struct rknpu_mem_create));
+	if (IS_ERR(creates))
+		return PTR_ERR(creates);
+
+	rknpu_objs = kcalloc(args.count, sizeof(*rknpu_objs), GFP_KERNEL);
+	fds = kmalloc_array(args.count, sizeof(*fds), GFP_KERNEL);
+	if (!rknpu_objs || !fds) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < args.count; i++)
+		fds[i] = -1;
+
+	for (i = 0; i < args.count; i++) {
+		ret = rknpu_mem_create_obj(rknpu_dev, file->private_data,
+					   &creates[i], &rknpu_objs[i]);
+		if (ret)
+			goto err_rollback;
+	}
+
+	for (i = 0; i < args.count; i++) {
+		if (!rknpu_mem_needs_fd(&creates[i]))
+			continue;
+		fds[i] = get_unused_fd_flags(O_CLOEXEC);
+		if (fds[i] < 0) {
+			ret = fds[i];
+			goto err_put_fds;
+		}
+		creates[i].handle = fds[i];
+	}
+
+	if (unlikely(copy_to_user(u64_to_user_ptr(args.creates), creates,
+				  args.count *
+					  sizeof(struct rknpu_mem_create)))) {
+		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		ret = -EFAULT;
+		goto err_put_fds;
+	}
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		goto err_put_fds;
+	}
+	for (i = 0; i < args.count; i++)
+		list_add_tail(&rknpu_objs[i]->head, &session->list);
+	spin_unlock(&rknpu_dev->lock);
+
+	for (i = 0; i < args.count; i++) {
+		if (fds[i] >= 0)
+			rknpu_mem_install_fd(rknpu_objs[i], fds[i]);
+	}
+
+	goto out_free;
+
+err_put_fds:
+	for (i = 0; i < args.count; i++) {
+		if (fds[i] >= 0)
+			put_unused_fd(fds[i]);
+	}
+
+err_rollback:
+	for (i = 0; i < args.count; i++) {
+		if (rknpu_objs[i])
+			rknpu_mem_create_rollback(rknpu_objs[i]);
+	}
+
+out_free:
+	kfree(fds);
+	kfree(rknpu_objs);
+	kfree(creates);
+
+	return ret;
+}
+
+int rknpu_mem_destroy_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			    unsigned long data)
+{
+	struct rknpu_mem_object *rknpu_obj, *entry, *q;
+	struct rknpu_session *session = NULL;
+	struct rknpu_mem_destroy args;
+	int ret = -EFAULT;
+	bool found = false;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_destroy *)data,
+				    sizeof(struct rknpu_mem_destroy)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	#ifndef RKNPU_DKMS
+	if (!kern_addr_valid(args.obj_addr)) {
+		LOG_ERROR("%s: invalid obj_addr: %#llx\n", __func__,
+			  (__u64)(uintptr_t)args.obj_addr);
+		ret = -EINVAL;
+		return ret;
+	}
+	#endif
+
+	rknpu_obj = (struct rknpu_mem_object *)(uintptr_t)args.obj_addr;
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		return ret;
+	}
+	list_for_each_entry_safe(entry, q, &session->list, head) {
+		if (entry == rknpu_obj) {
+			list_del(&entry->head);
+			found = true;
+			rknpu_obj = entry;
+			break;
+		}
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	if (!found) {
+		ret = -EINVAL;
+		return ret;
+	}
+
+	LOG_DEBUG(
+		"free args.handle: %d, rknpu_obj: %#llx, rknpu_obj->dma_addr: %#llx\n",
+		args.handle, (__u64)(uintptr_t)rknpu_obj,
+		(__u64)rknpu_obj->dma_addr);
+
+	rknpu_mem_free_obj(rknpu_obj);
+
+	return 0;
+}
+
+/*
+ * Take every listed object off the session under one hold of the device
+ * lock before freeing any of them. An unknown or repeated obj_addr puts
+ * the ones already taken back and fails the call with nothing freed.
+ */
+int rknpu_mem_destroy_vec_ioctl(struct rknpu_device *rknpu_dev,
+				struct file *file, unsigned long data)
+{
+	struct rknpu_mem_object **rknpu_objs = NULL;
+	struct rknpu_mem_destroy_vec args;
+	struct rknpu_session *session;
+	struct rknpu_mem_destroy *destroys;
+	int ret = 0;
+	int i;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_destroy_vec *)data,
+				    sizeof(struct rknpu_mem_destroy_vec)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	if (args.count == 0)
+		return 0;
+	if (args.count > RKNPU_MEM_VEC_MAX)
+		return -EINVAL;
+
+	destroys = memdup_user(u64_to_user_ptr(args.destroys),
+			       args.count * sizeof(struct rknpu_mem_destroy));
+	if (IS_ERR(destroys))
+		return PTR_ERR(destroys);
+
+	rknpu_objs = kcalloc(args.count, sizeof(*rknpu_objs), GFP_KERNEL);
+	if (!rknpu_objs) {
+		ret = -ENOMEM;
+		goto out_free_destroys;
+	}
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		goto out_free_objs;
+	}
+	for (i = 0; i < args.count; i++) {
+		rknpu_objs[i] = rknpu_mem_session_find(session,
+						       destroys[i].obj_addr);
+		if (!rknpu_objs[i]) {
+			while (i--)
+				list_add_tail(&rknpu_objs[i]->head,
+					      &session->list);
+			ret = -EINVAL;
+			break;
+		}
+		list_del(&rknpu_objs[i]->head);
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	if (ret)
+		goto out_free_objs;
+
+	for (i = 0; i < args.count; i++)
+		rknpu_mem_free_obj(rknpu_objs[i]);
+
+out_free_objs:
+	kfree(rknpu_objs);
+
+out_free_destroys:
+	kfree(destroys);
+
+	return ret;
+}
+
+/*
+ * Publish a buffer of this session under args.name. The entry keeps the
+ * dma-buf alive for as long as the publisher or any session that looked
+ * it up still holds an object on it.
+ */
+int rknpu_mem_publish_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			    unsigned long data)
+{
+	struct rknpu_mem_object *rknpu_obj = NULL;
+	struct rknpu_session *session = NULL;
+	struct rknpu_mem_share args;
+	struct rknpu_share *share;
+	int ret;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_share *)data,
+				    sizeof(struct rknpu_mem_share)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	ret = rknpu_share_check_name(args.name);
+	if (ret)
+		return ret;
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		return ret;
+	}
+	rknpu_obj = rknpu_mem_session_find(session, args.obj_addr);
+	spin_unlock(&rknpu_dev->lock);
+
+	if (!rknpu_obj)
+		return -EINVAL;
+
+	/* User memory and shared sub-allocation blocks carry other data */
+	if ((rknpu_obj->flags & RKNPU_MEM_USERPTR) || rknpu_obj->slab)
+		return -EINVAL;
+
+	share = kzalloc(sizeof(*share), GFP_KERNEL);
+	if (!share)
+		return -ENOMEM;
+
+	strscpy(share->name, (const char *)args.name, sizeof(share->name));
+	share->rknpu_dev = rknpu_dev;
+	share->size = rknpu_obj->size;
+	share->dmabuf = rknpu_obj->dmabuf;
+	share->users = 1;
+
+	mutex_lock(&rknpu_dev->share_lock);
+	if (rknpu_obj->share) {
+		ret = -EBUSY;
+	} else if (rknpu_share_find(rknpu_dev, share->name)) {
+		ret = -EEXIST;
+	} else {
+		get_dma_buf(share->dmabuf);
+		list_add_tail(&share->node, &rknpu_dev->share_list);
+		rknpu_obj->share = share;
+	}
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	if (ret)
+		kfree(share);
+
+	return ret;
+}
+
+/*
+ * Add a buffer published under args.name to this session. The NPU sees
+ * the publisher's pages, the CPU gets them through a read-only fd.
+ */
+int rknpu_mem_lookup_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			   unsigned long data)
+{
+	struct rknpu_mem_object *rknpu_obj = NULL;
+	struct rknpu_session *session = NULL;
+	struct rknpu_mem_share args;
+	struct rknpu_share *share;
+	struct file *ro_file;
+	int ret;
+	int fd;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_share *)data,
+				    sizeof(struct rknpu_mem_share)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	ret = rknpu_share_check_name(args.name);
+	if (ret)
+		return ret;
+
+	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL);
+	if (!rknpu_obj)
+		return -ENOMEM;
+	kref_init(&rknpu_obj->ref);
+	rknpu_sync_track_init(&rknpu_obj->sync_track);
+
+	mutex_lock(&rknpu_dev->share_lock);
+	share = rknpu_share_find(rknpu_dev, (const char *)args.name);
+	if (!share || !share->dmabuf) {
+		mutex_unlock(&rknpu_dev->share_lock);
+		kfree(rknpu_obj);
+		return -ENOENT;
+	}
+	share->users++;
+	get_dma_buf(share->dmabuf);
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	rknpu_obj->dmabuf = share->dmabuf;
+	rknpu_obj->owner = 0;
+	rknpu_obj->share = share;
+
+	ret = rknpu_mem_map(rknpu_dev, rknpu_obj, 0);
+	if (ret)
+		goto err_free_obj;
+	rknpu_obj->size = share->size;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto err_free_obj;
+	}
+
+	get_dma_buf(share->dmabuf);
+	ro_file = anon_inode_getfile("rknpu-share", &rknpu_share_fops,
+				     share->dmabuf, O_RDONLY);
+	if (IS_ERR(ro_file)) {
+		dma_buf_put(share->dmabuf);
+		ret = PTR_ERR(ro_file);
+		goto err_put_fd;
+	}
+
+	args.handle = fd;
+	args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
+	args.dma_addr = rknpu_obj->dma_addr;
+	args.size = rknpu_obj->size;
+
+	if (unlikely(copy_to_user((struct rknpu_mem_share *)data, &args,
+				  sizeof(struct rknpu_mem_share)))) {
+		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		ret = -EFAULT;
+		goto err_fput;
+	}
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		goto err_fput;
+	}
+	list_add_tail(&rknpu_obj->head, &session->list);
+	spin_unlock(&rknpu_dev->lock);
+
+	fd_install(fd, ro_file);
+
+	return 0;
+
+err_fput:
+	fput(ro_file);
+
+err_put_fd:
+	put_unused_fd(fd);
+
+err_free_obj:
+	rknpu_mem_free_obj(rknpu_obj);
+
+	return ret;
+}
+
+/*
+ * begin cpu access => for_cpu = true
+ * end cpu access => for_cpu = false
+ */
+static void __maybe_unused rknpu_dma_buf_sync(
+	struct rknpu_device *rknpu_dev, struct rknpu_mem_object *rknpu_obj,
+	u32 offset, u32 length, enum dma_data_direction dir, bool for_cpu)
+{
+	struct device *dev = rknpu_dev->dev;
+	struct sg_table *sgt = rknpu_obj->sgt;
+	struct scatterlist *sg = sgt->sgl;
+	dma_addr_t sg_dma_addr = sg_dma_address(sg);
+	unsigned int len = 0;
+	int i;
+
+	for_each_sgtable_sg(sgt, sg, i) {
+		unsigned int sg_offset, sg_left, size = 0;
+
+		len += sg->length;
+		if (len <= offset) {
+			sg_dma_addr += sg->length;
+			continue;
+		}
+
+		sg_left = len - offset;
+		sg_offset = sg->length - sg_left;
+
+		size = (length < sg_left) ? length : sg_left;
+
+		rknpu_dma_sync_range(dev, sg_dma_addr, sg_offset, size, dir,
+				     for_cpu);
+
+		offset += size;
+		length -= size;
+		sg_dma_addr += sg->length;
+
+		if (length == 0)
+			break;
+	}
+}
+
+void rknpu_mem_sync_obj(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj,
+			struct rknpu_mem_sync *args)
+{
+#ifdef CONFIG_DMABUF_PARTIAL
+	struct dma_buf *dmabuf;
+#endif
+	struct rknpu_mem_sync sync = *args;
+	bool tracked = false;
+	bool cpu_touched = false;
+	bool full;
+	u64 seq;
+
+#ifdef RKNPU_DKMS_MISCDEV
+	struct rknpu_dkms_buf *buf = NULL;
+#endif
+
+	/* Scattered imports copy the range between the import and shadow */
+	if (rknpu_obj->shadow) {
+		if (args->flags & RKNPU_MEM_SYNC_TO_DEVICE)
+			rknpu_shadow_sync(rknpu_obj->shadow, args->offset,
+					  args->size, true);
+		if (args->flags & RKNPU_MEM_SYNC_FROM_DEVICE)
+			rknpu_shadow_sync(rknpu_obj->shadow, args->offset,
+					  args->size, false);
+		return;
+	}
+
+#ifdef RKNPU_DKMS_MISCDEV
+	/* Bounced userptr buffers copy the range between user pages and bounce */
+	if (rknpu_mem_is_bounce(rknpu_obj)) {
+		if (args->flags & RKNPU_MEM_SYNC_TO_DEVICE)
+			rknpu_mem_userptr_sync(rknpu_obj->dmabuf, args->offset,
+					       args->size, true);
+		if (args->flags & RKNPU_MEM_SYNC_FROM_DEVICE)
+			rknpu_mem_userptr_sync(rknpu_obj->dmabuf, args->offset,
+					       args->size, false);
+		return;
+	}
+
+	/*
+	 * Self-owned uncached buffers come from dma_alloc_coherent(), there
+	 * is nothing to clean or invalidate.
+	 */
+	if (dkms_mem_cacheable && !rknpu_obj->attachment &&
+	    !(rknpu_obj->flags & RKNPU_MEM_CACHEABLE))
+		return;
+#endif
+
+	mutex_lock(&rknpu_obj->sync_track.lock);
+
+#ifdef RKNPU_DKMS_MISCDEV
+	/*
+	 * Only our own unshared buffers have observable CPU access. It is
+	 * tracked per block, not per sub-allocated buffer.
+	 */
+	if (rknpu_obj->owner && !rknpu_obj->slab &&
+	    rknpu_obj->dmabuf->ops == &rknpu_dkms_buf_ops) {
+		buf = rknpu_obj->dmabuf->priv;
+		tracked = buf->cacheable && !READ_ONCE(buf->shared);
+		cpu_touched = READ_ONCE(buf->cpu_touched);
+	}
+#endif
+
+	full = tracked && args->offset == 0 &&
+	       PAGE_ALIGN(args->size) >= rknpu_obj->size;
+	sync.flags = rknpu_sync_track_begin(rknpu_dev, &rknpu_obj->sync_track,
+					    tracked, cpu_touched, args, &seq);
+	if (!sync.flags)
+		goto out_unlock;
+	args = &sync;
+
+	/* Sub-allocated buffers sync their own part of the block only */
+	if (rknpu_obj->slab) {
+		if (sync.offset >= rknpu_obj->size)
+			goto out_unlock;
+		sync.size = min_t(u64, sync.size,
+				  rknpu_obj->size - sync.offset);
+		sync.offset += rknpu_obj->slab_offset;
+	}
+
+#ifdef RKNPU_DKMS_MISCDEV
+	/*
+	 * Re-arm CPU access detection before cleaning, see
+	 * rknpu_dkms_buf_fault(). Untouched buffers have no user PTEs left
+	 * since the last zap, so there is nothing to zap.
+	 */
+	if (full && cpu_touched && (args->flags & RKNPU_MEM_SYNC_TO_DEVICE)) {
+		WRITE_ONCE(buf->cpu_touched, false);
+		unmap_mapping_range(rknpu_obj->dmabuf->file->f_mapping, 0, 0, 1);
+	}
+#endif
+
+#ifndef CONFIG_DMABUF_PARTIAL
+	if (args->flags & RKNPU_MEM_SYNC_TO_DEVICE) {
+		rknpu_dma_buf_sync(rknpu_dev, rknpu_obj, args->offset,
+				   args->size, DMA_TO_DEVICE, false);
+	}
+	if (args->flags & RKNPU_MEM_SYNC_FROM_DEVICE) {
+		rknpu_dma_buf_sync(rknpu_dev, rknpu_obj, args->offset,
+				   args->size, DMA_FROM_DEVICE, true);
+	}
+#else
+	dmabuf = rknpu_obj->dmabuf;
+	if (args->flags & RKNPU_MEM_SYNC_TO_DEVICE) {
+		dmabuf->ops->end_cpu_access_partial(dmabuf, DMA_TO_DEVICE,
+						    args->offset, args->size);
+	}
+	if (args->flags & RKNPU_MEM_SYNC_FROM_DEVICE) {
+		dmabuf->ops->begin_cpu_access_partial(dmabuf, DMA_FROM_DEVICE,
+						      args->offset, args->size);
+	}
+#endif
+
+	rknpu_sync_track_end(&rknpu_obj->sync_track, args->flags, full, seq);
+out_unlock:
+	mutex_unlock(&rknpu_obj->sync_track.lock);
+}
+
+int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			 unsigned long data)
+{
+	struct rknpu_mem_object *rknpu_obj = NULL;
+	struct rknpu_session *session = NULL;
+	struct rknpu_mem_sync args;
+	int ret = -EFAULT;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_sync *)data,
+				    sizeof(struct rknpu_mem_sync)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		ret = -EFAULT;
+		return ret;
+	}
+	rknpu_obj = rknpu_mem_session_find(session, args.obj_addr);
+	spin_unlock(&rknpu_dev->lock);
+
+	if (!rknpu_obj) {
+		ret = -EINVAL;
+		return ret;
+	}
+
+	rknpu_mem_sync_obj(rknpu_dev, rknpu_obj, &args);
+
+	return 0;
+}
+
+/*
+ * Resolve the obj_addr of every entry of @syncs against the session of
+ * @file, holding the device lock once for all of them, and take a
+ * reference on each object. An unknown object fails the lookup with
+ * nothing referenced.
+ */
+int rknpu_mem_lookup_syncs(struct rknpu_device *rknpu_dev, struct file *file,
+			   struct rknpu_mem_sync *syncs, unsigned int count,
+			   struct rknpu_mem_object **rknpu_objs)
+{
+	struct rknpu_session *session = NULL;
+	int ret = 0;
+	int i;
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (!session) {
+		spin_unlock(&rknpu_dev->lock);
+		return -EFAULT;
+	}
+	for (i = 0; i < count; i++) {
+		rknpu_objs[i] = rknpu_mem_session_find(session,
+						       syncs[i].obj_addr);
+		if (!rknpu_objs[i]) {
+			ret = -EINVAL;
+			break;
+		}
+		kref_get(&rknpu_objs[i]->ref);
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	if (ret)
+		rknpu_mem_put_syncs(rknpu_objs, i);
+
+	return ret;
+}
+
+void rknpu_mem_put_syncs(struct rknpu_mem_object **rknpu_objs,
+			 unsigned int count)
+{
+	while (count--) {
+		rknpu_mem_free_obj(rknpu_objs[count]);
+		rknpu_objs[count] = NULL;
+	}
+}
+
+int rknpu_mem_sync_vec_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			     unsigned long data)
+{
+	struct rknpu_mem_object **rknpu_objs = NULL;
+	struct rknpu_mem_sync_vec args;
+	struct rknpu_mem_sync *syncs;
+	int ret = 0;
+	int i;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_sync_vec *)data,
+				    sizeof(struct rknpu_mem_sync_vec)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		ret = -EFAULT;
+		return ret;
+	}
+
+	if (args.count == 0)
+		return 0;
+	if (args.count > RKNPU_MEM_SYNC_VEC_MAX)
+		return -EINVAL;
+
+	syncs = memdup_user(u64_to_user_ptr(args.syncs),
+			    args.count * sizeof(struct rknpu_mem_sync));
+	if (IS_ERR(syncs))
+		return PTR_ERR(syncs);
+
+	rknpu_objs = kcalloc(args.count, sizeof(*rknpu_objs), GFP_KERNEL);
+	if (!rknpu_objs) {
+		ret = -ENOMEM;
+		goto out_free_syncs;
+	}
+
+	ret = rknpu_mem_lookup_syncs(rknpu_dev, file, syncs, args.count,
+				     rknpu_objs);
+	if (ret)
+		goto out_free_objs;
+
+	for (i = 0; i < args.count; i++)
+		rknpu_mem_sync_obj(rknpu_dev, rknpu_objs[i], &syncs[i]);
+
+	rknpu_mem_put_syncs(rknpu_objs, args.count);
+
+out_free_objs:
+	kfree(rknpu_objs);
+
+out_free_syncs:
+	kfree(syncs);
+
+	return ret;
+}
+
+#endif
+
+static unsigned int cache_sync_parallel_kb = 1024;
+module_param(cache_sync_parallel_kb, uint, 0644);
+MODULE_PARM_DESC(cache_sync_parallel_kb,
+	"Split cache maintenance of ranges from this size (KB) across online CPUs (0=disable, default=1024)");
+
+/* Upper bound on the chunks one range is split into, kept on the stack */
+#define RKNPU_CACHE_SYNC_MAX_CHUNKS 8
+
+struct rknpu_cache_chunk {
+	struct work_struct work;
+	rknpu_cache_op_t fn;
+	void *data;
+	unsigned long offset;
+	unsigned long size;
+};
+
+static void rknpu_cache_chunk_work(struct work_struct *work)
+{
+	struct rknpu_cache_chunk *chunk =
+		container_of(work, struct rknpu_cache_chunk, work);
+
+	chunk->fn(chunk->data, chunk->offset, chunk->size);
+}
+
+/*
+ * Run the cache maintenance @fn over [0, @size). Ranges from
+ * cache_sync_parallel_kb up are split into page aligned chunks handed to
+ * the other online CPUs, the calling CPU takes the last chunk and then
+ * waits for the rest. Must be called from process context.
+ */
+void rknpu_cache_op_parallel(rknpu_cache_op_t fn, void *data,
+			     unsigned long size)
+{
+	struct rknpu_cache_chunk chunks[RKNPU_CACHE_SYNC_MAX_CHUNKS - 1];
+	unsigned long threshold = (unsigned long)cache_sync_parallel_kb << 10;
+	unsigned long chunk_size, offset = 0;
+	int nr_chunks, this_cpu, cpu;
+	int n = 0, i;
+
+	nr_chunks = min_t(int, num_online_cpus(), RKNPU_CACHE_SYNC_MAX_CHUNKS);
+	if (!threshold || size < threshold || nr_chunks < 2) {
+		fn(data, 0, size);
+		return;
+	}
+
+	chunk_size = PAGE_ALIGN(DIV_ROUND_UP(size, nr_chunks));
+
+	/* stay off the CPUs the other chunks are queued on */
+	migrate_disable();
+	this_cpu = smp_processor_id();
+
+	for_each_online_cpu(cpu) {
+		struct rknpu_cache_chunk *chunk;
+
+		if (cpu == this_cpu)
+			continue;
+		if (n == nr_chunks - 1 || size - offset <= chunk_size)
+			break;
+
+		chunk = &chunks[n++];
+		INIT_WORK_ONSTACK(&chunk->work, rknpu_cache_chunk_work);
+		chunk->fn = fn;
+		chunk->data = data;
+		chunk->offset = offset;
+		chunk->size = chunk_size;
+		queue_work_on(cpu, system_highpri_wq, &chunk->work);
+
+		offset += chunk_size;
+	}
+
+	fn(data, offset, size - offset);
+	migrate_enable();
+
+	for (i = 0; i < n; i++) {
+		flush_work(&chunks[i].work);
+		destroy_work_on_stack(&chunks[i].work);
+	}
+}
+
+struct rknpu_dma_sync_args {
+	struct device *dev;
+	dma_addr_t addr;
+	unsigned long offset;
+	enum dma_data_direction dir;
+	bool for_cpu;
+};
+
+static void rknpu_dma_sync_chunk(void *data, unsigned long offset,
+				 unsigned long size)
+{
+	struct rknpu_dma_sync_args *args = data;
+
+	if (args->for_cpu)
+		dma_sync_single_range_for_cpu(args->dev, args->addr,
+					      args->offset + offset, size,
+					      args->dir);
+	else
+		dma_sync_single_range_for_device(args->dev, args->addr,
+						 args->offset + offset, size,
+						 args->dir);
+}
+
+/* dma_sync_single_range_for_{cpu,device}() split across CPUs when large */
+void rknpu_dma_sync_range(struct device *dev, dma_addr_t addr,
+			  unsigned long offset, unsigned long size,
+			  enum dma_data_direction dir, bool for_cpu)
+{
+	struct rknpu_dma_sync_args args = {
+		.dev = dev,
+		.addr = addr,
+		.offset = offset,
+		.dir = dir,
+		.for_cpu = for_cpu,
+	};
+
+	rknpu_cache_op_parallel(rknpu_dma_sync_chunk, &args, size);
+}
+
+static bool mem_sync_elide = true;
+module_param(mem_sync_elide, bool, 0644);
+MODULE_PARM_DESC(mem_sync_elide,
+	"Skip MEM_SYNC cache maintenance on buffers known to be clean (default=Y)");
+
+void rknpu_sync_track_init(struct rknpu_sync_track *track)
+{
+	mutex_init(&track->lock);
+	track->state = RKNPU_SYNC_CPU_DIRTY;
+	/* Nothing is known about earlier device writes */
+	track->seq = U64_MAX;
+}
+
+enum rknpu_sync_state rknpu_sync_track_state(struct rknpu_device *rknpu_dev,
+					     struct rknpu_sync_track *track)
+{
+	if (track->state == RKNPU_SYNC_CLEAN &&
+	    track->seq != atomic64_read(&rknpu_dev->job_seq))
+		return RKNPU_SYNC_DEVICE_DIRTY;
+
+	return track->state;
+}
+
+/*
+ * Filter a MEM_SYNC request against the buffer's ownership state and
+ * return the directions that still need cache maintenance. Called with
+ * @track's lock held until rknpu_sync_track_end(). @tracked
+ * says whether CPU access to the buffer is observable at all, i.e.
+ * @cpu_touched is reliable and no other device writes the buffer.
+ * @seq receives the job sequence to pass to rknpu_sync_track_end().
+ */
+uint32_t rknpu_sync_track_begin(struct rknpu_device *rknpu_dev,
+				struct rknpu_sync_track *track, bool tracked,
+				bool cpu_touched, struct rknpu_mem_sync *args,
+				u64 *seq)
+{
+	struct rknpu_sync_stats *stats = &rknpu_dev->sync_stats;
+	uint32_t todo = args->flags & (RKNPU_MEM_SYNC_TO_DEVICE |
+				       RKNPU_MEM_SYNC_FROM_DEVICE);
+	uint32_t elided = 0;
+
+	*seq = atomic64_read(&rknpu_dev->job_seq);
+
+	if (mem_sync_elide && tracked) {
+		if (track->state == RKNPU_SYNC_CLEAN && !cpu_touched)
+			elided |= todo & RKNPU_MEM_SYNC_TO_DEVICE;
+		if (rknpu_sync_track_state(rknpu_dev, track) ==
+		    RKNPU_SYNC_CLEAN)
+			elided |= todo & RKNPU_MEM_SYNC_FROM_DEVICE;
+	}
+	todo &= ~elided;
+
+	if (elided) {
+		atomic64_add(hweight32(elided), &stats->elided);
+		atomic64_add(hweight32(elided) * args->size,
+			     &stats->elided_bytes);
+	}
+	if (todo) {
+		atomic64_add(hweight32(todo), &stats->performed);
+		atomic64_add(hweight32(todo) * args->size,
+			     &stats->performed_bytes);
+	}
+
+	return todo;
+}
+
+/*
+ * Record the maintenance done for @flags. Only a @full (whole buffer,
+ * tracked) clean makes the buffer CLEAN, and only a full invalidate
+ * moves it past the job sequence @seq sampled before it started.
+ */
+void rknpu_sync_track_end(struct rknpu_sync_track *track, uint32_t flags,
+			  bool full, u64 seq)
+{
+	if (flags & RKNPU_MEM_SYNC_TO_DEVICE)
+		track->state = full ? RKNPU_SYNC_CLEAN : RKNPU_SYNC_CPU_DIRTY;
+	if (full && (flags & RKNPU_MEM_SYNC_FROM_DEVICE))
+		track->seq = seq;
+}
+
+int rknpu_sync_stats_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_sync_stats *stats = &rknpu_dev->sync_stats;
+
+	seq_printf(m, "elide: %s\n", mem_sync_elide ? "on" : "off");
+	seq_printf(m, "performed: %lld, %lld bytes\n",
+		   atomic64_read(&stats->performed),
+		   atomic64_read(&stats->performed_bytes));
+	seq_printf(m, "elided: %lld, %lld bytes\n",
+		   atomic64_read(&stats->elided),
+		   atomic64_read(&stats->elided_bytes));
+
+	return 0;
+}
+
+/* True if the device view of @sgt is one linear DMA range */
+bool rknpu_sgt_dma_contiguous(struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	dma_addr_t next = sg_dma_address(sgt->sgl);
+	int i;
+
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		if (sg_dma_address(sg) != next)
+			return false;
+		next += sg_dma_len(sg);
+	}
+
+	return true;
+}
+
+/*
+ * Contiguous, cacheable copy of a scattered RKNPU_MEM_SHADOW import, shared
+ * by all importers of the same dma-buf. Only the ranges MEM_SYNC or a job's
+ * cache sync list name, and its task object, are copied in and out, see
+ * rknpu_shadow_sync().
+ */
+struct rknpu_shadow {
+	struct list_head node;
+	struct rknpu_device *rknpu_dev;
+	struct dma_buf *dmabuf;
+	struct iosys_map map;
+	struct kref ref;
+	size_t size;
+	struct page *page;
+	void *vaddr;
+	dma_addr_t dma_addr;
+};
+
+/* Called with rknpu_dev->shadow_lock held */
+static void __rknpu_shadow_sync(struct rknpu_shadow *shadow, u64 offset,
+				u64 size, bool to_device)
+{
+	struct rknpu_device *rknpu_dev = shadow->rknpu_dev;
+	struct rknpu_shadow_stats *stats = &rknpu_dev->shadow_stats;
+
+	if (offset >= shadow->dmabuf->size)
+		return;
+	size = min_t(u64, size, shadow->dmabuf->size - offset);
+
+	if (to_device) {
+		dma_buf_begin_cpu_access(shadow->dmabuf, DMA_FROM_DEVICE);
+		iosys_map_memcpy_from(shadow->vaddr + offset, &shadow->map,
+				      offset, size);
+		dma_buf_end_cpu_access(shadow->dmabuf, DMA_FROM_DEVICE);
+		rknpu_dma_sync_range(rknpu_dev->dev, shadow->dma_addr, offset,
+				     size, DMA_TO_DEVICE, false);
+		stats->copy_in++;
+	} else {
+		rknpu_dma_sync_range(rknpu_dev->dev, shadow->dma_addr, offset,
+				     size, DMA_FROM_DEVICE, true);
+		dma_buf_begin_cpu_access(shadow->dmabuf, DMA_TO_DEVICE);
+		iosys_map_memcpy_to(&shadow->map, offset,
+				    shadow->vaddr + offset, size);
+		dma_buf_end_cpu_access(shadow->dmabuf, DMA_TO_DEVICE);
+		stats->copy_out++;
+	}
+	stats->copy_bytes += size;
+}
+
+/*
+ * Copy [@offset, @offset + @size) of the imported buffer into @shadow
+ * before a job, or back out after it.
+ */
+void rknpu_shadow_sync(struct rknpu_shadow *shadow, u64 offset, u64 size,
+		       bool to_device)
+{
+	mutex_lock(&shadow->rknpu_dev->shadow_lock);
+	__rknpu_shadow_sync(shadow, offset, size, to_device);
+	mutex_unlock(&shadow->rknpu_dev->shadow_lock);
+}
+
+int rknpu_shadow_get(struct rknpu_device *rknpu_dev, struct dma_buf *dmabuf,
+		     struct rknpu_shadow **shadowp)
+{
+	struct rknpu_shadow *shadow;
+	int ret;
+
+	mutex_lock(&rknpu_dev->shadow_lock);
+
+	list_for_each_entry(shadow, &rknpu_dev->shadow_list, node) {
+		if (shadow->dmabuf == dmabuf) {
+			kref_get(&shadow->ref);
+			rknpu_dev->shadow_stats.reused++;
+			goto out;
+		}
+	}
+
+	shadow = kzalloc(sizeof(*shadow), GFP_KERNEL);
+	if (!shadow) {
+		ret = -ENOMEM;
+		goto err_unlock;
+	}
+
+	ret = dma_buf_vmap_unlocked(dmabuf, &shadow->map);
+	if (ret)
+		goto err_free;
+
+	/* dma_alloc_pages() rejects zone modifiers, the dma mask picks it */
+	shadow->size = PAGE_ALIGN(dmabuf->size);
+	shadow->page = dma_alloc_pages(rknpu_dev->dev, shadow->size,
+				       &shadow->dma_addr, DMA_BIDIRECTIONAL,
+				       GFP_KERNEL);
+	if (!shadow->page) {
+		ret = -ENOMEM;
+		goto err_vunmap;
+	}
+
+	get_dma_buf(dmabuf);
+	shadow->rknpu_dev = rknpu_dev;
+	shadow->dmabuf = dmabuf;
+	shadow->vaddr = page_address(shadow->page);
+	kref_init(&shadow->ref);
+	list_add_tail(&shadow->node, &rknpu_dev->shadow_list);
+
+	rknpu_dev->shadow_stats.created++;
+	rknpu_dev->shadow_stats.live_bytes += shadow->size;
+
+	/* Start from the current contents */
+	__rknpu_shadow_sync(shadow, 0, dmabuf->size, true);
+
+	LOG_INFO("scattered dma-buf import of %zu bytes shadowed at %pad\n",
+		 dmabuf->size, &shadow->dma_addr);
+
+out:
+	mutex_unlock(&rknpu_dev->shadow_lock);
+	*shadowp = shadow;
+
+	return 0;
+
+err_vunmap:
+	dma_buf_vunmap_unlocked(dmabuf, &shadow->map);
+err_free:
+	kfree(shadow);
+err_unlock:
+	mutex_unlock(&rknpu_dev->shadow_lock);
+
+	return ret;
+}
+
+/*
+ * Take another reference on @shadow for a job. The caller already holds
+ * one through the importing object, so no lock is needed.
+ */
+void rknpu_shadow_ref(struct rknpu_shadow *shadow)
+{
+	kref_get(&shadow->ref);
+}
+
+/* Called with rknpu_dev->shadow_lock held, drops it */
+static void rknpu_shadow_release(struct kref *ref)
+{
+	struct rknpu_shadow *shadow =
+		container_of(ref, struct rknpu_shadow, ref);
+	struct rknpu_device *rknpu_dev = shadow->rknpu_dev;
+
+	list_del(&shadow->node);
+	rknpu_dev->shadow_stats.live_bytes -= shadow->size;
+	mutex_unlock(&rknpu_dev->shadow_lock);
+
+	dma_free_pages(rknpu_dev->dev, shadow->size, shadow->page,
+		       shadow->dma_addr, DMA_BIDIRECTIONAL);
+	dma_buf_vunmap_unlocked(shadow->dmabuf, &shadow->map);
+	dma_buf_put(shadow->dmabuf);
+	kfree(shadow);
+}
+
+void rknpu_shadow_put(struct rknpu_shadow *shadow)
+{
+	kref_put_mutex(&shadow->ref, rknpu_shadow_release,
+		       &shadow->rknpu_dev->shadow_lock);
+}
+
+dma_addr_t rknpu_shadow_dma_addr(struct rknpu_shadow *shadow)
+{
+	return shadow->dma_addr;
+}
+
+int rknpu_shadow_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_shadow_stats stats;
+	unsigned int live = 0;
+	struct rknpu_shadow *shadow;
+
+	mutex_lock(&rknpu_dev->shadow_lock);
+	stats = rknpu_dev->shadow_stats;
+	list_for_each_entry(shadow, &rknpu_dev->shadow_list, node)
+		live++;
+	mutex_unlock(&rknpu_dev->shadow_lock);
+
+	seq_printf(m, "live: %u, %llu bytes\n", live, stats.live_bytes);
+	seq_printf(m, "created: %llu\n", stats.created);
+	seq_printf(m, "reused: %llu\n", stats.reused);
+	seq_printf(m, "copy in: %llu\n", stats.copy_in);
+	seq_printf(m, "copy out: %llu\n", stats.copy_out);
+	seq_printf(m, "copy bytes: %llu\n", stats.copy_bytes);
+
+	return 0;
+}
+
+static unsigned int dma32_compact_order = 9;
+module_param(dma32_compact_order, uint, 0644);
+MODULE_PARM_DESC(dma32_compact_order,
+	"Block order the idle compaction keeps free below 4GB (default=9)");
+
+static unsigned int dma32_compact_blocks;
+module_param(dma32_compact_blocks, uint, 0644);
+MODULE_PARM_DESC(dma32_compact_blocks,
+	"Free dma32_compact_order blocks below 4GB to restore while the NPU is powered off, 0 disables (default=0)");
+
+#define RKNPU_DMA32_LIMIT_PFN PHYS_PFN(DMA_BIT_MASK(32) + 1ULL)
+
+/* Free blocks of exactly @order in the zones entirely below 4GB */
+static unsigned long rknpu_dma32_nr_free(unsigned int order)
+{
+	unsigned long nr_free = 0;
+	int nid, z;
+
+	for_each_online_node(nid) {
+		pg_data_t *pgdat = NODE_DATA(nid);
+
+		for (z = 0; z < MAX_NR_ZONES; z++) {
+			struct zone *zone = &pgdat->node_zones[z];
+
+			if (!populated_zone(zone) ||
+			    zone_end_pfn(zone) > RKNPU_DMA32_LIMIT_PFN)
+				continue;
+			nr_free += data_race(zone->free_area[order].nr_free);
+		}
+	}
+
+	return nr_free;
+}
+
+/* Free @order sized blocks, counting larger blocks by how many they hold */
+static unsigned long rknpu_dma32_free_blocks(unsigned int order)
+{
+	unsigned long blocks = 0;
+	unsigned int o;
+
+	for (o = order; o < NR_PAGE_ORDERS; o++)
+		blocks += rknpu_dma32_nr_free(o) << (o - order);
+
+	return blocks;
+}
+
+/*
+ * Drive direct compaction of the zones below 4GB by allocating blocks of
+ * the watermark order until enough of them are free, then hand them all
+ * back to the buddy allocator at once. Runs from the power-off work, and
+ * gives up as soon as the NPU is powered again.
+ */
+void rknpu_compact_work(struct work_struct *work)
+{
+	struct rknpu_device *rknpu_dev =
+		container_of(work, struct rknpu_device, compact_work);
+	struct rknpu_compact_stats *stats = &rknpu_dev->compact_stats;
+	unsigned int order = min(dma32_compact_order, (unsigned int)MAX_PAGE_ORDER);
+	unsigned long want = dma32_compact_blocks;
+	unsigned long held = 0, tries;
+	ktime_t start = ktime_get();
+	struct page *page, *tmp;
+	LIST_HEAD(pages);
+
+	if (!want || rknpu_dma32_free_blocks(order) >= want)
+		return;
+
+	stats->runs++;
+	for (tries = 0; tries < 2 * want; tries++) {
+		if (atomic_read(&rknpu_dev->power_refcount) > 0) {
+			stats->aborted++;
+			break;
+		}
+		if (held + rknpu_dma32_free_blocks(order) >= want)
+			break;
+
+		page = alloc_pages(GFP_KERNEL | __GFP_DMA32 | __GFP_NOWARN |
+				   __GFP_NORETRY, order);
+		if (!page) {
+			stats->failures++;
+			break;
+		}
+		if (page_to_pfn(page) + (1UL << order) > RKNPU_DMA32_LIMIT_PFN) {
+			__free_pages(page, order);
+			stats->failures++;
+			break;
+		}
+		list_add(&page->lru, &pages);
+		held++;
+		cond_resched();
+	}
+
+	list_for_each_entry_safe(page, tmp, &pages, lru) {
+		list_del(&page->lru);
+		__free_pages(page, order);
+	}
+
+	stats->blocks += held;
+	stats->last_us = ktime_us_delta(ktime_get(), start);
+}
+
+/* Called with power_lock held once the NPU has been powered off */
+void rknpu_compact_kick(struct rknpu_device *rknpu_dev)
+{
+	if (dma32_compact_blocks)
+		queue_work(rknpu_dev->power_off_wq, &rknpu_dev->compact_work);
+}
+
+int rknpu_compact_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_compact_stats *stats = &rknpu_dev->compact_stats;
+	unsigned int order = min(dma32_compact_order, (unsigned int)MAX_PAGE_ORDER);
+	unsigned long free_pages = 0, usable = 0;
+	unsigned int o;
+
+	seq_printf(m, "watermark: %u blocks of order %u\n",
+		   dma32_compact_blocks, order);
+	seq_puts(m, "free blocks below 4GB:");
+	for (o = 0; o < NR_PAGE_ORDERS; o++) {
+		unsigned long n = rknpu_dma32_nr_free(o);
+
+		seq_printf(m, " %lu", n);
+		free_pages += n << o;
+		if (o >= order)
+			usable += n << o;
+	}
+	seq_puts(m, "\n");
+	seq_printf(m, "free below 4GB: %lu KB, %lu%% in order >= %u blocks\n",
+		   free_pages << (PAGE_SHIFT - 10),
+		   free_pages ? usable * 100 / free_pages : 0, order);
+	seq_printf(m, "runs: %llu, blocks: %llu, failures: %llu, aborted: %llu\n",
+		   stats->runs, stats->blocks, stats->failures, stats->aborted);
+	seq_printf(m, "last run: %llu us\n", stats->last_us);
+
+	return 0;
+}
+
+/*
+ * Reserved-memory carveout named by the NPU node's memory-region, for
+ * boards without IOMMU translation. GEM and /dev/rknpu allocations are
+ * carved out of it first, so model switches neither wait for the page
+ * allocator nor fail on fragmentation. The region must stay in the
+ * linear map (no no-map) so its pages have a cacheable kernel alias.
+ */
+struct rknpu_carveout {
+	struct gen_pool *pool;
+	phys_addr_t base;
+	phys_addr_t size;
+	atomic64_t allocs;
+	atomic64_t failures;
+};
+
+int rknpu_carveout_init(struct rknpu_device *rknpu_dev)
+{
+	struct device *dev = rknpu_dev->dev;
+	struct rknpu_carveout *carveout;
+	struct reserved_mem *rmem;
+	struct device_node *np;
+	int ret;
+
+	np = of_parse_phandle(dev->of_node, "memory-region", 0);
+	if (!np)
+		return 0;
+	rmem = of_reserved_mem_lookup(np);
+	of_node_put(np);
+	if (!rmem || !rmem->size)
+		return -EINVAL;
+
+	/* shared-dma-pool and friends belong to the DMA layer */
+	if (rmem->ops)
+		return 0;
+
+	if (!PAGE_ALIGNED(rmem->base) || !PAGE_ALIGNED(rmem->size) ||
+	    !pfn_valid(PHYS_PFN(rmem->base))) {
+		LOG_DEV_ERROR(dev, "carveout %pa must be page aligned and mapped\n",
+			      &rmem->base);
+		return -EINVAL;
+	}
+	if (rmem->base + rmem->size - 1 > rknpu_dev->config->dma_mask) {
+		LOG_DEV_ERROR(dev, "carveout %pa + %pa beyond the DMA mask\n",
+			      &rmem->base, &rmem->size);
+		return -ERANGE;
+	}
+
+	carveout = devm_kzalloc(dev, sizeof(*carveout), GFP_KERNEL);
+	if (!carveout)
+		return -ENOMEM;
+
+	carveout->pool = devm_gen_pool_create(dev, PAGE_SHIFT, NUMA_NO_NODE,
+					      "rknpu-carveout");
+	if (IS_ERR(carveout->pool))
+		return PTR_ERR(carveout->pool);
+	gen_pool_set_algo(carveout->pool, gen_pool_best_fit, NULL);
+
+	ret = gen_pool_add_virt(carveout->pool,
+				(unsigned long)phys_to_virt(rmem->base),
+				rmem->base, rmem->size, NUMA_NO_NODE);
+	if (ret)
+		return ret;
+
+	carveout->base = rmem->base;
+	carveout->size = rmem->size;
+	rknpu_dev->carveout = carveout;
+
+	LOG_DEV_INFO(dev, "carveout %pa + %pa for NPU buffers\n",
+		     &carveout->base, &carveout->size);
+
+	return 0;
+}
+
+/* Physically contiguous pages from the carveout, or NULL when exhausted */
+struct page *rknpu_carveout_alloc(struct rknpu_carveout *carveout,
+				  size_t size)
+{
+	unsigned long vaddr;
+
+	vaddr = gen_pool_alloc(carveout->pool, PAGE_ALIGN(size));
+	if (!vaddr) {
+		atomic64_inc(&carveout->failures);
+		return NULL;
+	}
+	atomic64_inc(&carveout->allocs);
+
+	return virt_to_page((void *)vaddr);
+}
+
+void rknpu_carveout_free(struct rknpu_carveout *carveout, struct page *page,
+			 size_t size)
+{
+	gen_pool_free(carveout->pool, (unsigned long)page_address(page),
+		      PAGE_ALIGN(size));
+}
+
+static void rknpu_carveout_largest(struct gen_pool *pool,
+				   struct gen_pool_chunk *chunk, void *data)
+{
+	unsigned long nbits = (chunk->end_addr - chunk->start_addr + 1) >>
+			      pool->min_alloc_order;
+	unsigned long *largest = data;
+	unsigned long start = 0, end;
+
+	while ((start = find_next_zero_bit(chunk->bits, nbits, start)) < nbits) {
+		end = find_next_bit(chunk->bits, nbits, start);
+		*largest = max(*largest, (end - start) << pool->min_alloc_order);
+		start = end;
+	}
+}
+
+int rknpu_carveout_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_carveout *carveout = rknpu_dev->carveout;
+	unsigned long largest = 0;
+
+	if (!carveout) {
+		seq_puts(m, "carveout: none\n");
+		return 0;
+	}
+
+	gen_pool_for_each_chunk(carveout->pool, rknpu_carveout_largest,
+				&largest);
+
+	seq_printf(m, "carveout: %pa + %pa\n", &carveout->base,
+		   &carveout->size);
+	seq_printf(m, "free: %zu KB, largest free: %lu KB\n",
+		   gen_pool_avail(carveout->pool) >> 10, largest >> 10);
+	seq_printf(m, "allocs: %lld, failures: %lld\n",
+		   atomic64_read(&carveout->allocs),
+		   atomic64_read(&carveout->failures));
+
+	return 0;
+}
+
+/* Names are NUL terminated and non-empty */
+int rknpu_share_check_name(const __u8 *name)
+{
+	size_t len = strnlen((const char *)name, RKNPU_MEM_SHARE_NAME_LEN);
+
+	if (!len || len == RKNPU_MEM_SHARE_NAME_LEN)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Caller holds rknpu_dev->share_lock */
+struct rknpu_share *rknpu_share_find(struct rknpu_device *rknpu_dev,
+				     const char *name)
+{
+	struct rknpu_share *share;
+
+	list_for_each_entry(share, &rknpu_dev->share_list, node) {
+		if (!strcmp(share->name, name))
+			return share;
+	}
+
+	return NULL;
+}
+
+/* Unpublish a GEM buffer that is being freed */
+void rknpu_share_del(struct rknpu_share *share)
+{
+	struct rknpu_device *rknpu_dev = share->rknpu_dev;
+
+	mutex_lock(&rknpu_dev->share_lock);
+	list_del(&share->node);
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	kfree(share);
+}
+
+int rknpu_share_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_share *share;
+	unsigned int count = 0;
+	size_t bytes = 0;
+
+	mutex_lock(&rknpu_dev->share_lock);
+	list_for_each_entry(share, &rknpu_dev->share_list, node) {
+		if (share->gem)
+			seq_printf(m, "%s: %zu bytes, gem, %u handles\n",
+				   share->name, share->size,
+				   share->gem->handle_count);
+		else
+			seq_printf(m, "%s: %zu bytes, users %u\n",
+				   share->name, share->size, share->users);
+		count++;
+		bytes += share->size;
+	}
+	mutex_unlock(&rknpu_dev->share_lock);
+
+	seq_printf(m, "total: %u, %zu bytes\n", count, bytes);
+
+	return 0;
+}
+
+static unsigned int release_defer_mb = 256;
+module_param(release_defer_mb, uint, 0644);
+MODULE_PARM_DESC(release_defer_mb,
+	"Max MB of closed /dev/rknpu sessions and freed GEM buffers torn down in the background, beyond which they are freed synchronously (0=always synchronous, default=256)");
+
+/*
+ * Hand @item to the reap work instead of tearing it down in the caller,
+ * typically an exiting process in close(). Returns false, and the caller
+ * frees @item itself, once release_defer_mb worth of buffers is already
+ * waiting or the device is being removed.
+ */
+bool rknpu_reap_defer(struct rknpu_device *rknpu_dev,
+		      struct rknpu_reap_item *item)
+{
+	struct rknpu_reap_stats *stats = &rknpu_dev->reap_stats;
+	size_t max_bytes = (size_t)READ_ONCE(release_defer_mb) << 20;
+	bool deferred = false;
+
+	spin_lock(&rknpu_dev->reap_lock);
+	if (!rknpu_dev->reap_closed && max_bytes &&
+	    rknpu_dev->reap_bytes + item->size <= max_bytes) {
+		list_add_tail(&item->node, &rknpu_dev->reap_list);
+		rknpu_dev->reap_bytes += item->size;
+		rknpu_dev->reap_count++;
+		stats->deferred++;
+		stats->deferred_bytes += item->size;
+		deferred = true;
+	} else {
+		stats->sync++;
+	}
+	spin_unlock(&rknpu_dev->reap_lock);
+
+	if (deferred)
+		queue_work(system_unbound_wq, &rknpu_dev->reap_work);
+
+	return deferred;
+}
+
+void rknpu_reap_work(struct work_struct *work)
+{
+	struct rknpu_device *rknpu_dev =
+		container_of(work, struct rknpu_device, reap_work);
+	struct rknpu_reap_item *item;
+	ktime_t start = ktime_get();
+	size_t size;
+
+	while (true) {
+		spin_lock(&rknpu_dev->reap_lock);
+		item = list_first_entry_or_null(&rknpu_dev->reap_list,
+						struct rknpu_reap_item, node);
+		if (item)
+			list_del(&item->node);
+		spin_unlock(&rknpu_dev->reap_lock);
+		if (!item)
+			break;
+
+		size = item->size;
+		item->free(item);
+
+		/* only account it as gone once the memory really is */
+		spin_lock(&rknpu_dev->reap_lock);
+		rknpu_dev->reap_bytes -= size;
+		rknpu_dev->reap_count--;
+		spin_unlock(&rknpu_dev->reap_lock);
+
+		cond_resched();
+	}
+
+	rknpu_dev->reap_stats.last_us = ktime_us_delta(ktime_get(), start);
+}
+
+/*
+ * Wait for everything queued so far to be torn down, for allocations
+ * that failed while closed buffers were still on their way out. Returns
+ * true if anything was pending, i.e. the allocation is worth retrying.
+ */
+bool rknpu_reap_flush(struct rknpu_device *rknpu_dev)
+{
+	bool pending;
+
+	spin_lock(&rknpu_dev->reap_lock);
+	pending = rknpu_dev->reap_count > 0;
+	if (pending)
+		rknpu_dev->reap_stats.flushes++;
+	spin_unlock(&rknpu_dev->reap_lock);
+
+	if (pending)
+		flush_work(&rknpu_dev->reap_work);
+
+	return pending;
+}
+
+/*
+ * Stop deferring once removal starts, later releases are torn down by
+ * their callers. Everything queued so far is torn down before return.
+ */
+void rknpu_reap_close(struct rknpu_device *rknpu_dev)
+{
+	spin_lock(&rknpu_dev->reap_lock);
+	rknpu_dev->reap_closed = true;
+	spin_unlock(&rknpu_dev->reap_lock);
+
+	/* an item queued just before may not have kicked the work yet */
+	rknpu_reap_work(&rknpu_dev->reap_work);
+	flush_work(&rknpu_dev->reap_work);
+}
+
+int rknpu_reap_dump(struct seq_file *m, void *data)
+{
+	struct rknpu_debugger_node *node = m->private;
+	struct rknpu_debugger *debugger = node->debugger;
+	struct rknpu_device *rknpu_dev =
+		container_of(debugger, struct rknpu_device, debugger);
+	struct rknpu_reap_stats stats;
+	unsigned int count;
+	size_t bytes;
+
+	spin_lock(&rknpu_dev->reap_lock);
+	stats = rknpu_dev->reap_stats;
+	count = rknpu_dev->reap_count;
+	bytes = rknpu_dev->reap_bytes;
+	spin_unlock(&rknpu_dev->reap_lock);
+
+	seq_printf(m, "pending: %u, %zu KB, max: %u KB\n", count, bytes >> 10,
+		   READ_ONCE(release_defer_mb) << 10);
+	seq_printf(m, "deferred: %llu, %llu KB\n", stats.deferred,
+		   stats.deferred_bytes >> 10);
+	seq_printf(m, "synchronous: %llu, flushes: %llu\n", stats.sync,
+		   stats.flushes);
+	seq_printf(m, "last run: %llu us\n", stats.last_us);
+
+	return 0;
+}
@@ -4,6 +4,9 @@
  * Author: Felix Zeng <felix.zeng@rock-chips.com>
  */
 
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+
 #include "rknpu_debugger.h"
 #include "rknpu_mm.h"
 
@@ -45,7 +48,7 @@ int rknpu_mm_create(unsigned int mem_size, unsigned int chunk_size,
 	return 0;
 
 free_mm:
-	kfree(mm);
+	kfree(*mm);
 	return ret;
 }
 
@@ -58,119 +61,120 @@ void rknpu_mm_destroy(struct rknpu_mm *mm)
 	}
 }
 
-int rknpu_mm_alloc(struct rknpu_mm *mm, unsigned int size,
-		   struct rknpu_mm_obj **mm_obj)
+/*
+ * Best fit: pick the smallest free extent that still holds @nr_chunks at an
+ * @align_chunks boundary, the lowest one on a tie, so small buffers stop
+ * splitting the extents large ones need. Also reports the largest free
+ * extent in chunks. Called with mm->lock held.
+ */
+static unsigned int rknpu_mm_find(struct rknpu_mm *mm, unsigned int nr_chunks,
+				  unsigned int align_chunks,
+				  unsigned int *largest)
 {
-	unsigned int found, start_search, cur_size;
+	unsigned int best = mm->total_chunks, best_len = UINT_MAX;
+	unsigned int start = 0, end = 0, first = 0;
 
-	if (size == 0)
-		return -EINVAL;
+	*largest = 0;
 
-	if (size > mm->total_chunks * mm->chunk_size)
-		return -ENOMEM;
+	while (start < mm->total_chunks) {
+		start = find_next_zero_bit(mm->bitmap, mm->total_chunks, start);
+		if (start >= mm->total_chunks)
+			break;
+		end = find_next_bit(mm->bitmap, mm->total_chunks, start);
 
-	*mm_obj = kzalloc(sizeof(struct rknpu_mm_obj), GFP_KERNEL);
-	if (!(*mm_obj))
-		return -ENOMEM;
+		*largest = max(*largest, end - start);
 
-	start_search = 0;
+		first = ALIGN(start, align_chunks);
+		if (first + nr_chunks <= end && end - start < best_len) {
+			best = first;
+			best_len = end - start;
+		}
 
-	mutex_lock(&mm->lock);
+		start = end;
+	}
 
-mm_restart_search:
-	/* Find the first chunk that is free */
-	found = find_next_zero_bit(mm->bitmap, mm->total_chunks, start_search);
+	return best;
+}
 
-	/* If there wasn't any free chunk, bail out */
-	if (found == mm->total_chunks)
-		goto mm_no_free_chunk;
+/*
+ * Allocate @size bytes, starting at a multiple of @align bytes (0 or up to
+ * chunk_size: no constraint, otherwise a power of two), into @mm_obj.
+ */
+int rknpu_mm_alloc(struct rknpu_mm *mm, unsigned int size,
+		   unsigned int align, struct rknpu_mm_obj *mm_obj)
+{
+	unsigned int nr_chunks, align_chunks, found, largest;
 
-	/* Update fields of mm_obj */
-	(*mm_obj)->range_start = found;
-	(*mm_obj)->range_end = found;
+	if (size == 0)
+		return -EINVAL;
 
-	/* If we need only one chunk, mark it as allocated and get out */
-	if (size <= mm->chunk_size) {
-		set_bit(found, mm->bitmap);
-		goto mm_out;
-	}
+	if (align > mm->chunk_size && !is_power_of_2(align))
+		return -EINVAL;
 
-	/* Otherwise, try to see if we have enough contiguous chunks */
-	cur_size = size - mm->chunk_size;
-	do {
-		(*mm_obj)->range_end = find_next_zero_bit(
-			mm->bitmap, mm->total_chunks, ++found);
-		/*
-		 * If next free chunk is not contiguous than we need to
-		 * restart our search from the last free chunk we found (which
-		 * wasn't contiguous to the previous ones
-		 */
-		if ((*mm_obj)->range_end != found) {
-			start_search = found;
-			goto mm_restart_search;
-		}
+	if (size > mm->total_chunks * mm->chunk_size)
+		return -ENOMEM;
 
-		/*
-		 * If we reached end of buffer, bail out with error
-		 */
-		if (found == mm->total_chunks)
-			goto mm_no_free_chunk;
+	nr_chunks = DIV_ROUND_UP(size, mm->chunk_size);
+	align_chunks = max(align / mm->chunk_size, 1U);
 
-		/* Check if we don't need another chunk */
-		if (cur_size <= mm->chunk_size)
-			cur_size = 0;
-		else
-			cur_size -= mm->chunk_size;
+	mutex_lock(&mm->lock);
 
-	} while (cur_size > 0);
+	found = rknpu_mm_find(mm, nr_chunks, align_chunks, &largest);
+	if (found >= mm->total_chunks) {
+		mm->failures++;
+		if (mm->free_chunks >= nr_chunks)
+			mm->frag_failures++;
+		mutex_unlock(&mm->lock);
+		return -ENOMEM;
+	}
 
-	/* Mark the chunks as allocated */
-	for (found = (*mm_obj)->range_start; found <= (*mm_obj)->range_end;
-	     found++)
-		set_bit(found, mm->bitmap);
+	bitmap_set(mm->bitmap, found, nr_chunks);
+	mm->free_chunks -= nr_chunks;
+	mm->allocs++;
 
-mm_out:
-	mm->free_chunks -= ((*mm_obj)->range_end - (*mm_obj)->range_start + 1);
 	mutex_unlock(&mm->lock);
 
+	mm_obj->range_start = found;
+	mm_obj->range_end = found + nr_chunks - 1;
+
 	LOG_DEBUG("mm allocate, mm_obj: %p, range_start: %d, range_end: %d\n",
-		  *mm_obj, (*mm_obj)->range_start, (*mm_obj)->range_end);
+		  mm_obj, mm_obj->range_start, mm_obj->range_end);
 
 	return 0;
-
-mm_no_free_chunk:
-	mutex_unlock(&mm->lock);
-	kfree(*mm_obj);
-
-	return -ENOMEM;
 }
 
 int rknpu_mm_free(struct rknpu_mm *mm, struct rknpu_mm_obj *mm_obj)
 {
-	unsigned int bit;
-
-	/* Act like kfree when trying to free a NULL object */
-	if (!mm_obj)
-		return 0;
+	unsigned int nr_chunks;
 
 	LOG_DEBUG("mm free, mem_obj: %p, range_start: %d, range_end: %d\n",
 		  mm_obj, mm_obj->range_start, mm_obj->range_end);
 
+	nr_chunks = mm_obj->range_end - mm_obj->range_start + 1;
+
 	mutex_lock(&mm->lock);
 
 	/* Mark the chunks as free */
-	for (bit = mm_obj->range_start; bit <= mm_obj->range_end; bit++)
-		clear_bit(bit, mm->bitmap);
-
-	mm->free_chunks += (mm_obj->range_end - mm_obj->range_start + 1);
+	bitmap_clear(mm->bitmap, mm_obj->range_start, nr_chunks);
+	mm->free_chunks += nr_chunks;
 
 	mutex_unlock(&mm->lock);
 
-	kfree(mm_obj);
-
 	return 0;
 }
 
+/* Size in bytes of the largest allocation that would currently succeed */
+unsigned int rknpu_mm_largest_free(struct rknpu_mm *mm)
+{
+	unsigned int largest;
+
+	mutex_lock(&mm->lock);
+	rknpu_mm_find(mm, mm->total_chunks + 1, 1, &largest);
+	mutex_unlock(&mm->lock);
+
+	return largest * mm->chunk_size;
+}
+
 int rknpu_mm_dump(struct seq_file *m, void *data)
 {
 	struct rknpu_debugger_node *node = m->private;
@@ -233,6 +237,13 @@ int rknpu_mm_dump(struct seq_file *m, void *data)
 	seq_printf(m, "SRAM total size: %d, used: %d, free: %d\n",
 		   rknpu_dev->sram_size, rknpu_dev->sram_size - free_size,
 		   free_size);
+	seq_printf(m, "SRAM largest free extent: %u\n",
+		   rknpu_mm_largest_free(mm));
+
+	mutex_lock(&mm->lock);
+	seq_printf(m, "SRAM allocs: %lu, failures: %lu (fragmented: %lu)\n",
+		   mm->allocs, mm->failures, mm->frag_failures);
+	mutex_unlock(&mm->lock);
 
 	return 0;
 }
@@ -66,13 +66,29 @@ SRAM_PAGES=11
 NPU_PAGES=$((SRAM_PAGES * SRAM_PCT / 100))
 RKVDEC_PAGES=$((SRAM_PAGES - NPU_PAGES))
 
+# Read RKNPU_CARVEOUT_MB from Makefile (default 0 = no carveout)
+CARVEOUT_MB=$(grep '^RKNPU_CARVEOUT_MB' "$SCRIPT_DIR/drivers/rknpu/Makefile" \
+    | head -1 | grep -oP '\d+$' || echo 0)
+
+# The carveout only serves the non-IOMMU path, don't reserve RAM the
+# driver will never use (a node without status is enabled)
+NPU_IOMMU=/proc/device-tree/iommu@fde4b000
+if [ "$CARVEOUT_MB" -gt 0 ] && [ -d "$NPU_IOMMU" ] && \
+   { [ ! -e "$NPU_IOMMU/status" ] || \
+     tr -d '\0' < "$NPU_IOMMU/status" | grep -qE '^(okay|ok)$'; }; then
+    echo "  WARNING: NPU IOMMU is enabled, ignoring RKNPU_CARVEOUT_MB=${CARVEOUT_MB}"
+    CARVEOUT_MB=0
+fi
+
 TMP_DTS=$(mktemp /tmp/rknpu-overlay.XXXXXX.dts)
 
 # Build DTS: take everything outside the SRAM markers, inject computed SRAM split
 {
-    # Part 1: everything before SRAM_SPLIT_BEGIN (strip SRAM_PHANDLE line if 0%)
+    # Part 1: everything before SRAM_SPLIT_BEGIN (strip SRAM_PHANDLE line if 0%,
+    # CARVEOUT_PHANDLE line if no carveout)
     awk '/SRAM_SPLIT_BEGIN/{exit} 1' "$SCRIPT_DIR/overlays/rknpu.dts" | \
-        if [ "$SRAM_PCT" -eq 0 ]; then grep -v 'SRAM_PHANDLE'; else cat; fi
+        if [ "$SRAM_PCT" -eq 0 ]; then grep -v 'SRAM_PHANDLE'; else cat; fi | \
+        if [ "$CARVEOUT_MB" -eq 0 ]; then grep -v 'CARVEOUT_PHANDLE'; else cat; fi
 
     # Part 2: SRAM fragment (skip if 0%)
     if [ "$SRAM_PCT" -gt 0 ]; then
@@ -122,8 +138,35 @@ EOF
         fi
     fi
 
-    # Part 3: everything after SRAM_SPLIT_END
-    awk 'p; /SRAM_SPLIT_END/{p=1}' "$SCRIPT_DIR/overlays/rknpu.dts"
+    # Part 3: everything between SRAM_SPLIT_END and CARVEOUT_BEGIN
+    awk '/CARVEOUT_BEGIN/{exit} p; /SRAM_SPLIT_END/{p=1}' "$SCRIPT_DIR/overlays/rknpu.dts"
+
+    # Part 4: carveout fragment (skip if 0)
+    if [ "$CARVEOUT_MB" -gt 0 ]; then
+        CARVEOUT_SZ_HEX=$(printf '0x%x' $((CARVEOUT_MB * 1024 * 1024)))
+        cat <<EOF
+	/* NPU carveout: ${CARVEOUT_MB} MB below 4 GB */
+	fragment@12 {
+		target-path = "/";
+		__overlay__ {
+			reserved-memory {
+				#address-cells = <2>;
+				#size-cells = <2>;
+				ranges;
+
+				npu_carveout: npu-carveout {
+					size = <0x0 ${CARVEOUT_SZ_HEX}>;
+					alignment = <0x0 0x200000>;
+					alloc-ranges = <0x0 0x0 0x0 0xf0000000>;
+				};
+			};
+		};
+	};
+EOF
+    fi
+
+    # Part 5: everything after CARVEOUT_END
+    awk 'p; /CARVEOUT_END/{p=1}' "$SCRIPT_DIR/overlays/rknpu.dts"
 } > "$TMP_DTS"
 
 case "$SRAM_PCT" in
@@ -132,6 +175,12 @@ case "$SRAM_PCT" in
     *)   echo "  SRAM: ${SRAM_PCT}% NPU ($((NPU_PAGES*4))KB), rkvdec ($((RKVDEC_PAGES*4))KB)" ;;
 esac
 
+if [ "$CARVEOUT_MB" -gt 0 ]; then
+    echo "  Carveout: ${CARVEOUT_MB} MB reserved for NPU buffers"
+else
+    echo "  Carveout: OFF (buffers from the page allocator)"
+fi
+
 dtc -@ -I dts -O dtb -o /boot/overlay-user/rknpu.dtbo "$TMP_DTS" 2>/dev/null
 rm -f "$TMP_DTS"
 echo "  rknpu.dtbo installed to /boot/overlay-user/"